@@ -40,18 +40,60 @@ SOURCES += src/BtBencode.cpp \
         src/BtTorrent.cpp \
         src/BtTracker.cpp \
         src/BtPeer.cpp \
+        src/BtPeerWire.cpp \
+        src/BtRc4.cpp \
+        src/BtMse.cpp \
+        src/BtStorage.cpp \
+        src/BtPipeline.cpp \
+        src/BtPicker.cpp \
+        src/BtPieceSet.cpp \
+        src/BtExtension.cpp \
+        src/BtPex.cpp \
+        src/BtPeerPool.cpp \
+        src/BtTransferStats.cpp \
+        src/BtTokenBucket.cpp \
+        src/BtChoker.cpp \
+        src/BtConnection.cpp \
+        src/BtSwarm.cpp \
+        src/BtReactor.cpp \
+        src/BtListener.cpp \
+        src/BtSession.cpp \
         src/BtCore.cpp \
+        src/BtAnnounce.cpp \
         src/QBitTorrent.cpp \
 
 HEADERS += include/BtBencode.h \
         include/BtTorrent.h \
         include/BtTracker.h \
         include/BtPeer.h \
+        include/BtPeerWire.h \
+        include/BtRc4.h \
+        include/BtMse.h \
+        include/BtStorage.h \
+        include/BtPipeline.h \
+        include/BtPicker.h \
+        include/BtPieceSet.h \
+        include/BtExtension.h \
+        include/BtPex.h \
+        include/BtPeerPool.h \
+        include/BtTransferStats.h \
+        include/BtTokenBucket.h \
+        include/BtChoker.h \
+        include/BtConnection.h \
+        include/BtSwarm.h \
+        include/BtReactor.h \
+        include/BtListener.h \
+        include/BtSession.h \
         include/BtCore.h \
+        include/BtAnnounce.h \
+        include/BtEndpoint.h \
         include/BtDefs.h \
         include/BtDebug.h \
         include/QBitTorrent.h \
 
+# RtlGenRandom, keys of MSE
+win32: LIBS += -ladvapi32
+
 unix:!macx: {
 # Static librarys
     #LIBS += -Wl,-Bstatic -lcryptopp
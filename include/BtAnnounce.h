@@ -0,0 +1,238 @@
+#pragma once
+
+#ifndef __BTANNOUNCE_H__
+#define __BTANNOUNCE_H__
+
+/* This is an implementation of announce scheduling shared by all torrents */
+
+/* Every torrent has to re-announce to its trackers every 'interval' seconds
+ * and must never do it more often than 'min interval'. With thousands of
+ * torrents a timer per torrent means thousands of wakeups, and all torrents
+ * started together will hit the tracker together again every interval.
+ *
+ * BtAnnounceScheduler keeps all pending announces on a single hashed timer
+ * wheel driven by one single-shot QTimer, which is only armed for the next
+ * non-empty slot:
+ *
+ * - Every announce has a window [earliest, latest]. Earliest is never before
+ *   'min interval', latest is 'interval' plus a random jitter so that
+ *   torrents started at the same time drift apart.
+ *
+ * - Announces to the same tracker are coalesced: if another announce to that
+ *   tracker is already due inside the window, the new one joins it, so the
+ *   tracker sees one burst instead of many scattered requests, and we wake
+ *   up once for all of them.
+ *
+ * - A tracker that fails gets an exponential backoff shared by every torrent
+ *   announcing to it, so a dead tracker costs one retry per backoff period
+ *   instead of one per torrent.
+ * */
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QVariant>
+#include <QVector>
+#include <QUrl>
+
+#include <BtDefs.h>
+#include <BtTracker.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+/* Anything that announces to trackers through BtAnnounceScheduler.
+ *
+ * When an announce is due, the scheduler calls announce(), and the target
+ * must report the result back with BtAnnounceScheduler::announced() or
+ * BtAnnounceScheduler::announceFailed(), possibly later (asynchronously).
+ * Until then the announce is in flight and will not be scheduled again.
+ * */
+class BtAnnounceTarget {
+public:
+    virtual ~BtAnnounceTarget() {}
+    virtual void announce(QUrl const &tracker, BtTrackerDownloadEvent) = 0;
+};
+
+class BtAnnounceScheduler : public QObject {
+    Q_OBJECT
+
+public:
+    /* Granularity of the wheel, and how far it reaches in one round.
+     * Announces further away than one round stay in their slot and are
+     * skipped until their tick comes. */
+    static const int TickMs = 1000;
+    static const int WheelSize = 512;
+
+    /* Used when tracker says nothing about interval */
+    static const int DefaultInterval = 1800;
+    /* Backoff of failing tracker: BackoffBase * 2^(failures - 1) seconds,
+     * no more than BackoffMax */
+    static const int BackoffBase = 15;
+    static const int BackoffMax = 3600;
+
+    explicit BtAnnounceScheduler(QObject *parent = 0);
+    ~BtAnnounceScheduler();
+
+    /* A scheduler shared by all torrents of this process */
+    static BtAnnounceScheduler *shared();
+
+    /* Schedule the first announce of target to tracker.
+     * The first announce is spread over [0, startSpread) seconds so that
+     * starting many torrents together does not hit trackers at once. */
+    void add(BtAnnounceTarget *, QUrl const &tracker,
+            BtTrackerDownloadEvent = BtTrackerDownloadEvent::started);
+    /* Announce as soon as possible, ignoring interval.
+     * It is used for 'completed' and 'stopped' events. */
+    void announceNow(BtAnnounceTarget *, QUrl const &tracker,
+            BtTrackerDownloadEvent);
+    /* Drop every announce of this target, in the wheel or in flight */
+    void remove(BtAnnounceTarget *);
+    /* Drop announce of target to this tracker only */
+    void remove(BtAnnounceTarget *, QUrl const &tracker);
+
+    /* Reports from targets */
+    void announced(BtAnnounceTarget *, QUrl const &tracker,
+            BtTrackerResponse const &);
+    void announceFailed(BtAnnounceTarget *, QUrl const &tracker);
+
+    void setStartSpread(int seconds);
+    int startSpread() const;
+
+    /* Number of announces scheduled or in flight */
+    int pending() const;
+    /* Number of times the wheel woke up, for statistics */
+    quint64 wakeups() const;
+
+private slots:
+    void tick();
+
+private:
+    struct Job {
+        BtAnnounceTarget *target;
+        QString tracker;
+        BtTrackerDownloadEvent event;
+        /* Absolute tick this job is due at */
+        qint64 due;
+        /* Links of slot list, -1 for none */
+        int prev;
+        int next;
+        bool inWheel;
+        bool inUse;
+    };
+
+    struct TrackerState {
+        int failures;
+        /* No announce to this tracker before this tick while failing */
+        qint64 blockedUntil;
+        /* due tick -> number of jobs due at that tick */
+        QMap<qint64, int> dueTicks;
+        TrackerState() : failures(0), blockedUntil(0) {}
+    };
+
+    typedef QPair<BtAnnounceTarget *, QString> JobKey;
+
+    /* Jobs are kept in a vector and linked into slots by index,
+     * so scheduling does not allocate once the pool has grown */
+    QVector<Job> jobs;
+    QVector<int> freeJobs;
+    QHash<JobKey, int> jobIndex;
+    QHash<BtAnnounceTarget *, QList<QString>> targetTrackers;
+    QVector<int> wheel;
+    QVector<int> slotSize;
+    /* Number of jobs in the wheel */
+    int linked;
+    QHash<QString, TrackerState> trackers;
+
+    QTimer timer;
+    QElapsedTimer clock;
+    /* Last tick whose slot has been processed */
+    qint64 lastTick;
+    int StartSpread;
+    quint64 Wakeups;
+
+    qint64 currentTick() const;
+    int jobFor(BtAnnounceTarget *, QString const &tracker);
+    void releaseJob(int);
+    void link(int, qint64 due);
+    void unlink(int);
+    /* Pick a due tick in [earliest, latest], joining an announce already
+     * scheduled to the same tracker when possible */
+    qint64 coalesce(QString const &tracker, qint64 earliest, qint64 latest) const;
+    void arm();
+};
+
+/* Multitracker announce, see BEP 12.
+ *
+ * Trackers of 'announce-list' are grouped into tiers. Trackers in a tier
+ * are shuffled once when the tiers are set. Instead of trying them one by
+ * one, all trackers of a tier are asked at the same time, and the first
+ * reply with peers wins: other requests of the tier are cancelled, and the
+ * winner is moved to the front of its tier so it's asked first next time.
+ * Only when every tracker of a tier fails, the next tier is tried.
+ *
+ * With dual stack on, a tracker known by name is asked over IPv4 and IPv6
+ * at the same time, so that it sees (and hands out) us on both families.
+ * The request over the other family of the winner is not cancelled, its
+ * response comes with alsoAnnounced().
+ * */
+class BtTierAnnounce : public QObject {
+    Q_OBJECT
+
+public:
+    explicit BtTierAnnounce(QObject *parent = 0);
+    ~BtTierAnnounce();
+
+    void setTiers(QList<QList<QString>> const &);
+    QList<QList<QUrl>> tiers() const;
+
+    /* Turn it on only if we have both IPv4 and IPv6 connectivity */
+    void setDualStack(bool);
+    bool isDualStack() const;
+
+    /* timeout is for every single tracker, in ms. Tiers are tried from
+     * the one of tracker, and the earlier ones after the last; from the
+     * first tier when tracker is empty or not one of ours. */
+    void start(BtTrackerRequest const &, int timeout = 15000,
+            QUrl const &tracker = QUrl());
+    void abort();
+    bool isRunning() const;
+
+signals:
+    void finished(QUrl const &tracker, BtTrackerResponse const &);
+    /* The winner replied over the other address family too */
+    void alsoAnnounced(QUrl const &tracker, BtTrackerResponse const &);
+    void failed();
+
+private:
+    QList<QList<QUrl>> Tiers;
+    QList<BtHttpAnnounce *> running;
+    QByteArray query;
+    int timeout;
+    int currentTier;
+    /* Where this round started, it's over when we are back here */
+    int firstTier;
+    bool dualStack;
+    /* Only requests to the winner over the other family are still running */
+    bool won;
+
+    /* A successful reply without peers, it's only used when no other
+     * tracker of the tier has peers */
+    bool haveFallback;
+    QUrl fallbackTracker;
+    BtTrackerResponse fallback;
+
+    void startTier(int);
+    void requestFinished(BtHttpAnnounce *, QByteArray const &);
+    void requestFailed(BtHttpAnnounce *);
+    void release(BtHttpAnnounce *);
+    void cancelRunning();
+    /* Nobody of current tier has peers */
+    void tierDone();
+    void win(QUrl const &tracker, BtTrackerResponse const &);
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTANNOUNCE_H__
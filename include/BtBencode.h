@@ -10,6 +10,8 @@
 #include <QVariant>
 #include <BtDefs.h>
 
+#include <cstring>
+
 /* First, let`s show some facts about bencode
  * From wikipedia: [https://en.wikipedia.org/wiki/Bencode]
  * * An integer is encoded as i<integer encoded in base ten ASCII>e. (Negative zero is not allowed)
@@ -56,6 +58,27 @@ void BtEncodeBencodeList(QList<QVariant> const &, QByteArray &);
 
 void BtEncodeBencodeMap(QMap<QString, QVariant> const&, QByteArray &);
 
+/* A cursor over bencoded data, for parsers of messages that come often
+ * (tracker responses, PEX). Strings are returned as pointer and length
+ * into the data, nothing is copied until the caller knows it's a value it
+ * wants. Like the decoders above, broken data throws -1. */
+struct BtBencodeCursor {
+    const char *p;
+    const char *end;
+
+    qint64 readInteger();
+    /* Return length of the string, str points to the first byte of it */
+    int readString(const char *&str);
+    void skipValue(int depth = 0);
+};
+
+/* Compare a key with a literal without strlen */
+template <int N>
+inline bool bencodeKeyIs(const char *key, int len, const char (&name)[N])
+{
+    return len == N - 1 && memcmp(key, name, N - 1) == 0;
+}
+
 NAMESPACE_END(BtQt)
 
 #endif // __BTBENCODE_H__
@@ -0,0 +1,72 @@
+#pragma once
+
+#ifndef __BTCHOKER_H__
+#define __BTCHOKER_H__
+
+/* This is an implementation of the choking algorithm */
+
+/* Upload slots are what we have least of, and tit-for-tat gives them to
+ * peers that give back:
+ *
+ * - Every 10 seconds peers are ranked by how fast they upload to us, or,
+ *   once we are a seed and nobody gives anything back, by how fast we
+ *   upload to them (so slots go to peers that can take the data).
+ * - Going down the ranking, peers are unchoked until 'slots - 1' of the
+ *   unchoked ones are interested. Uninterested peers faster than those
+ *   are unchoked too, they cost nothing until they get interested, and
+ *   then they are among the best anyway.
+ * - One more slot is the optimistic unchoke, a random interested peer
+ *   rotated every 30 seconds, so new peers get a chance to show their
+ *   rate. Peers connected for less than a minute are three times as
+ *   likely to get it, they have nothing to be ranked by yet.
+ * - Everyone else is choked.
+ *
+ * Choking the same peers again and again is kept from happening by only
+ * changing the ranking every round, and a peer getting interested between
+ * rounds is unchoked at once only when a slot is free.
+ * */
+
+#include <QList>
+
+#include <BtDefs.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+class BtConnection;
+
+class BtChoker {
+public:
+    static const int DefaultSlots = 4;
+    /* In ticks of a second */
+    static const int RechokeTicks = 10;
+    static const int OptimisticTicks = 30;
+    /* Peers connected for less are new */
+    static const int NewPeerMs = 60000;
+
+    explicit BtChoker(int uploadSlots = DefaultSlots);
+
+    /* With the optimistic one, at least 1 */
+    void setUploadSlots(int);
+    int uploadSlots() const;
+
+    /* Once a second, rechokes every RechokeTicks */
+    void tick(QList<BtConnection *> const &, bool seeding);
+    /* Rank again now, and pick another optimistic one if rotate */
+    void rechoke(QList<BtConnection *> const &, bool seeding, bool rotate);
+    /* Peer got interested between rounds */
+    void interested(QList<BtConnection *> const &, BtConnection *);
+    /* Peer is gone */
+    void remove(BtConnection *);
+
+    BtConnection *optimistic() const;
+
+private:
+    int Slots;
+    int ticks;
+    BtConnection *Optimistic;
+
+    void pickOptimistic(QList<BtConnection *> const &);
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTCHOKER_H__
@@ -0,0 +1,216 @@
+#pragma once
+
+#ifndef __BTCONNECTION_H__
+#define __BTCONNECTION_H__
+
+/* This is an implementation of one connection to a remote peer */
+
+/* A connection goes through
+ *
+ *   connecting -> encrypting -> handshaking -> active -> closed
+ *
+ * Incoming ones start at encrypting (or handshaking when encryption is
+ * disabled, or settled by BtListener), and encrypting is skipped by peers
+ * sending a plain handshake.
+ * Every state is driven by socket signals on the event loop of the swarm
+ * owning the connection, so hundreds of connections are a few hundred
+ * sockets and no thread.
+ *
+ * The connection keeps the state of the protocol (choking, interest, what
+ * the peer has, requests in flight), and asks its BtSwarm for what is shared
+ * by the torrent: which block to request next, where a received block goes,
+ * which pieces we have.
+ * */
+
+#include <QObject>
+#include <QTcpSocket>
+#include <QElapsedTimer>
+#include <QScopedPointer>
+#include <QVector>
+
+#include <BtDefs.h>
+#include <BtEndpoint.h>
+#include <BtPeerWire.h>
+#include <BtPieceSet.h>
+#include <BtPipeline.h>
+#include <BtExtension.h>
+#include <BtPex.h>
+#include <BtMse.h>
+#include <BtTransferStats.h>
+#include <BtTokenBucket.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+class BtSwarm;
+
+class BtConnection : public QObject, private BtPeerWireHandler {
+    Q_OBJECT
+
+public:
+    enum class State {
+        connecting,
+        encrypting,
+        handshaking,
+        active,
+        closed
+    };
+
+    /* Drop peers that don't get to active in time */
+    static const int HandshakeTimeoutMs = 20000;
+    /* Drop peers silent for this long, keep-alives count */
+    static const int IdleTimeoutMs = 180000;
+    /* Send a keep-alive when we said nothing for this long */
+    static const int KeepAliveMs = 90000;
+    /* Serve more requests only while less than this waits to be sent */
+    static const int SendWatermark = 1 << 18;
+    /* Largest block we serve */
+    static const int MaxBlockLength = 1 << 17;
+    /* Read ahead of the socket, more waits in the kernel */
+    static const int ReadBufferSize = 1 << 18;
+    /* Pieces a peer may request while we choke it (BEP 6) */
+    static const int AllowedFastCount = 10;
+    /* Suggestions of the peer we remember, older ones are dropped */
+    static const int MaxSuggested = 16;
+
+    /* Outgoing, connects at once */
+    BtConnection(BtSwarm &, BtPeerEndpoint const &, BtEncryptionPolicy);
+    /* Incoming, socket is connected and is taken over */
+    BtConnection(BtSwarm &, QTcpSocket *, BtEncryptionPolicy);
+    /* Incoming through BtListener, which has read the start of it */
+    BtConnection(BtSwarm &, QTcpSocket *, BtStreamStart const &, BtEncryptionPolicy);
+    ~BtConnection();
+
+    State state() const;
+    bool isActive() const;
+    bool isOutgoing() const;
+    bool isEncrypted() const;
+    /* Where we connected to, or where the peer came from */
+    BtPeerEndpoint endpoint() const;
+    /* Where the peer listens, unknown (port 0) for incoming peers that
+     * did not tell it in the extended handshake */
+    BtPeerEndpoint listenEndpoint() const;
+    QByteArray peerId() const;
+
+    BtPieceSet const &peerPieces() const;
+    /* What we may request now: everything the peer has, or only its
+     * allowed fast pieces while it chokes us */
+    BtPieceSet const &requestablePieces() const;
+    /* Pieces the peer suggested, newest last */
+    QVector<int> const &suggestedPieces() const;
+    bool isSeed() const;
+    bool amChoking() const;
+    bool amInterested() const;
+    bool peerChoking() const;
+    bool peerInterested() const;
+    BtPipeline const &pipeline() const;
+
+    /* Bytes of blocks */
+    qint64 downloaded() const;
+    qint64 uploaded() const;
+    /* Bytes of blocks a second, smoothed over about 20 seconds */
+    qint64 downloadRate() const;
+    qint64 uploadRate() const;
+    /* Payload and wire bytes, they add to the swarm's too */
+    BtTransferStats const &transferStats() const;
+    qint64 connectedMs() const;
+
+    void choke();
+    void unchoke();
+    void setInterested(bool);
+    void sendHave(int index);
+    /* Top up requests, if the peer lets us */
+    void requestBlocks();
+    /* Send cancel for a request still outstanding, false if it's not */
+    bool cancelRequest(BtBlockRequest const &);
+    /* Bytes a second of this connection, 0 is unlimited. Tokens are taken
+     * from the swarm's buckets too. */
+    void setRateLimits(qint64 upload, qint64 download);
+    /* Tokens may be there now, read and send what waited for them */
+    void bandwidthAvailable();
+    /* Keep-alives, timeouts and PEX, once a second */
+    void tick();
+    /* Drop the connection, the swarm is told and it's deleted later */
+    void close(QString const &reason);
+
+private:
+    BtSwarm &swarm;
+    QTcpSocket *socket;
+    BtPeerEndpoint Endpoint;
+    bool outgoing;
+    State connectionState;
+    BtEncryptionPolicy policy;
+
+    BtPeerWireFramer framer;
+    BtWireBuffer sendBuffer;
+    BtPeerWireWriter writer;
+    BtExtensionTable extensions;
+    BtPex pex;
+    QScopedPointer<BtMseHandshake> mse;
+    BtWireBuffer mseBuffer;
+
+    QByteArray PeerId;
+    BtPieceSet pieces;
+    bool piecesKnown;
+    bool AmChoking;
+    bool AmInterested;
+    bool PeerChoking;
+    bool PeerInterested;
+
+    BtPipeline Pipeline;
+    /* Requests of the peer waiting for the socket */
+    QVector<BtBlockRequest> uploads;
+    /* BEP 6, what the peer may request while we choke it */
+    QVector<int> allowedToPeer;
+    /* and what it lets us request while it chokes us, fastPieces is the
+     * part of it the peer has */
+    BtPieceSet allowedFromPeer;
+    BtPieceSet fastPieces;
+    QVector<int> suggested;
+
+    QElapsedTimer started;
+    QElapsedTimer lastReceived;
+    QElapsedTimer lastSent;
+    BtTransferStats stats;
+    /* Piece payload we send, and everything we read once active */
+    BtBandwidth sending;
+    BtBandwidth receiving;
+
+    void init();
+    void connectSocket();
+    /* MSE failed on our way out, try the same peer in plain once */
+    bool retryPlain();
+    /* Peer hung up or broke the protocol, MSE may be why */
+    void peerFailed(QString const &reason);
+    void connected();
+    void readSocket();
+    void readEncryptionHandshake();
+    /* Encryption is settled, return false if the connection is closed */
+    bool startStream(BtStreamStart const &);
+    void sendHandshake();
+    void serveUploads();
+    void updateFastPieces();
+    void flush();
+    void socketError();
+
+    /* BtPeerWireHandler */
+    void handshakeReceived(BtHandshakeView const &) override;
+    void keepAliveReceived() override;
+    void chokeReceived() override;
+    void unchokeReceived() override;
+    void interestedReceived() override;
+    void notInterestedReceived() override;
+    void haveReceived(quint32 index) override;
+    void bitfieldReceived(const char *bits, int size) override;
+    void requestReceived(BtBlockRequest const &) override;
+    void pieceReceived(BtBlockView const &) override;
+    void cancelReceived(BtBlockRequest const &) override;
+    void haveAllReceived() override;
+    void haveNoneReceived() override;
+    void rejectReceived(BtBlockRequest const &) override;
+    void suggestReceived(quint32 index) override;
+    void allowedFastReceived(quint32 index) override;
+    void extendedReceived(const char *payload, int size) override;
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTCONNECTION_H__
@@ -7,33 +7,120 @@
 #include <BtPeer.h>
 #include <BtTracker.h>
 #include <BtTorrent.h>
+#include <BtAnnounce.h>
+#include <BtSwarm.h>
+#include <BtReactor.h>
+#include <BtListener.h>
 #include <BtDebug.h>
 
 #include <QList>
-#include <QSharedPointer>
+#include <QMap>
+#include <QSet>
+#include <QVector>
+#include <QTimer>
+
+#include <functional>
 
 NAMESPACE_BEGIN(BtQt)
 
-class BtCore {
+class BtSession;
+
+/* stopped -> running <-> paused, and either of them -> stopping -> stopped.
+ * Stopping lasts until the stopped announce is done, StopAnnounceTimeoutMs
+ * at most. */
+enum class BtTorrentState {
+    stopped,
+    running,
+    paused,
+    stopping
+};
+
+class BtCore : public BtAnnounceTarget, public BtListenTarget {
 public:
-    BtCore(BtTorrent const &torrent, int listenPort);
+    static const int StopAnnounceTimeoutMs = 5000;
+
+    /* Announces are scheduled by scheduler, and connections run on a
+     * worker of reactor, the shared ones if not given */
+    BtCore(BtTorrent const &torrent, int listenPort,
+            BtAnnounceScheduler *scheduler = 0, BtReactor *reactor = 0);
+    /* Incoming peers come from listener, shared with other torrents */
+    BtCore(BtTorrent const &torrent, BtListener *listener,
+            BtAnnounceScheduler *scheduler = 0, BtReactor *reactor = 0);
+    /* Everything but the torrent's own state comes from session */
+    BtCore(BtTorrent const &torrent, BtSession &session);
+    /* Deleting it while running or stopping drops the stopped announce,
+     * stop() it and wait for the stopped callback first */
     ~BtCore();
+    /* Where the files go, before start() */
+    void setDownloadDirectory(QString const &);
+    /* Bytes a second of the torrent, and of each of its peers, 0 is
+     * unlimited. Session limits apply on top. */
+    void setRateLimits(qint64 upload, qint64 download);
+    void setPeerRateLimits(qint64 upload, qint64 download);
+    /* Counters of the swarm, what trackers are told */
+    qint64 downloaded() const;
+    qint64 uploaded() const;
+    qint64 left() const;
+    /* Payload and protocol bytes with their rates, read from any thread */
+    BtTransferStats const &transferStats() const;
     /* Methods */
+    /* Start, resume a paused torrent, or start again while stopping */
     void start();
+    /* Keep connections and what we know of peers, but choke everybody
+     * and ask for nothing. Announces go on. */
     void pause();
+    /* Drop connections, leave the scheduler, write the files back and
+     * save resume data, and tell trackers we stopped */
     void stop();
+    BtTorrentState state() const;
+    /* Called once a stop is over, the stopped announce done or given up.
+     * It's called from inside the core, don't delete the core there. */
+    void setStoppedCallback(std::function<void()>);
+
+    /* Called by announce scheduler */
+    void announce(QUrl const &tracker, BtTrackerDownloadEvent) override;
+    /* Called by listener */
+    void incoming(QTcpSocket *, BtStreamStart const &) override;
+
+    /* Globally routable addresses of this host, at most one of each family */
+    static void globalAddresses(QHostAddress &ipv4, QHostAddress &ipv6);
 
 private:
-    BtTrackerResponse contactWithTracker(QUrl trackerUrl, int numwant = 50, BtTrackerDownloadEvent e = BtTrackerDownloadEvent::empty) const;
+    void init(QByteArray const &peerId, quint16 port,
+            QHostAddress const &ipv4, QHostAddress const &ipv6);
+    /* Announce to all tiers of trackers, starting at the tier of
+     * announceUrl, result comes back asynchronously */
+    void contactWithTracker(BtTrackerDownloadEvent e = BtTrackerDownloadEvent::empty,
+            int numwant = 50, int timeout = 15000);
+    void trackerAnnounced(QUrl const &tracker, BtTrackerResponse const &);
+    void trackerFailed();
+    /* The stopped announce is done, or given up */
+    void stopped();
 
     void startDownload();
-    const BtTorrent& torrent;
-    QSharedPointer<BtLocalPeer> localPeer;
-    QList<BtRemotePeer> remotePeerList;
-    QList<BtTrackerResponse> trackerState;
+    /* New peers go to the swarm, unless they are known or connected */
+    void addCandidates(QVector<BtPeerEndpoint> const &);
 
-    quint64 uploaded;
-    quint64 downloaded;
+    const BtTorrent& torrent;
+    /* Lives on a worker of reactor, everything but counters is posted */
+    BtReactor *reactor;
+    int worker;
+    BtSwarm *swarm;
+    BtListener *listener;
+    /* Latest response of every tracker, keyed by announce url */
+    QMap<QString, BtTrackerResponse> trackerState;
+    BtTierAnnounce trackers;
+    /* Kept across announces, only counters and event change */
+    BtTrackerRequest trackerRequest;
+    /* The tracker this torrent is known by in the scheduler, the one that
+     * replied last (the first one we know until somebody replies) */
+    QUrl announceUrl;
+    BtAnnounceScheduler *scheduler;
+    bool downloading;
+    BtTorrentState lifecycle;
+    /* Bounds the stopped announce, trackers may be slow or gone */
+    QTimer stopTimer;
+    std::function<void()> onStopped;
 };
 
 NAMESPACE_END(BtQt)
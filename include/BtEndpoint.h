@@ -0,0 +1,116 @@
+#pragma once
+
+#ifndef __BTENDPOINT_H__
+#define __BTENDPOINT_H__
+
+#include <QHostAddress>
+#include <QAbstractSocket>
+#include <QHash>
+#include <QtEndian>
+#include <BtDefs.h>
+
+#include <cstring>
+
+NAMESPACE_BEGIN(BtQt)
+
+/* Address and port of a peer.
+ *
+ * It's 18 bytes for both IPv4 and IPv6: IPv4 addresses are kept in the
+ * IPv4-mapped form (::ffff:a.b.c.d), so peers of both families fit into one
+ * packed vector, and comparing or hashing them is plain memory work, no
+ * QHostAddress (which allocates) is built until we really connect.
+ *
+ * Compact form is what trackers (BEP 23, BEP 7) and PEX send: 4 or 16
+ * bytes of address followed by 2 bytes of port, in network byte order.
+ * */
+struct BtPeerEndpoint {
+    quint8 ip[16];
+    quint16 port;
+
+    static const int CompactIPv4Size = 6;
+    static const int CompactIPv6Size = 18;
+
+    bool isIPv4() const
+    {
+        static const quint8 mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+        return memcmp(ip, mapped, 12) == 0;
+    }
+
+    QHostAddress address() const
+    {
+        if(isIPv4()) return QHostAddress(qFromBigEndian<quint32>(ip + 12));
+        Q_IPV6ADDR ip6;
+        memcpy(ip6.c, ip, 16);
+        return QHostAddress(ip6);
+    }
+
+    static BtPeerEndpoint fromCompactIPv4(const char *compact)
+    {
+        BtPeerEndpoint e;
+        memset(e.ip, 0, 10);
+        e.ip[10] = e.ip[11] = 0xff;
+        memcpy(e.ip + 12, compact, 4);
+        e.port = qFromBigEndian<quint16>(reinterpret_cast<const uchar *>(compact + 4));
+        return e;
+    }
+
+    static BtPeerEndpoint fromCompactIPv6(const char *compact)
+    {
+        BtPeerEndpoint e;
+        memcpy(e.ip, compact, 16);
+        e.port = qFromBigEndian<quint16>(reinterpret_cast<const uchar *>(compact + 16));
+        return e;
+    }
+
+    static BtPeerEndpoint fromAddress(QHostAddress const &address, quint16 port)
+    {
+        BtPeerEndpoint e;
+        if(address.protocol() == QAbstractSocket::IPv4Protocol) {
+            memset(e.ip, 0, 10);
+            e.ip[10] = e.ip[11] = 0xff;
+            qToBigEndian<quint32>(address.toIPv4Address(), e.ip + 12);
+        } else {
+            Q_IPV6ADDR ip6 = address.toIPv6Address();
+            memcpy(e.ip, ip6.c, 16);
+        }
+        e.port = port;
+        return e;
+    }
+
+    /* Write compact form, return its size (CompactIPv4Size or
+     * CompactIPv6Size) */
+    int toCompact(char *out) const
+    {
+        uchar *o = reinterpret_cast<uchar *>(out);
+        if(isIPv4()) {
+            memcpy(o, ip + 12, 4);
+            qToBigEndian<quint16>(port, o + 4);
+            return CompactIPv4Size;
+        }
+        memcpy(o, ip, 16);
+        qToBigEndian<quint16>(port, o + 16);
+        return CompactIPv6Size;
+    }
+
+    bool operator==(BtPeerEndpoint const &other) const
+    {
+        return port == other.port && memcmp(ip, other.ip, 16) == 0;
+    }
+    bool operator!=(BtPeerEndpoint const &other) const
+    {
+        return !(*this == other);
+    }
+};
+
+inline uint qHash(BtPeerEndpoint const &e, uint seed = 0)
+{
+    /* FNV-1a over the address, port mixed in at the end */
+    uint h = 2166136261u ^ seed;
+    for(int i = 0; i < 16; ++ i) h = (h ^ e.ip[i]) * 16777619u;
+    return (h ^ e.port) * 16777619u;
+}
+NAMESPACE_END(BtQt)
+
+Q_DECLARE_TYPEINFO(BtQt::BtPeerEndpoint, Q_PRIMITIVE_TYPE);
+
+#endif // __BTENDPOINT_H__
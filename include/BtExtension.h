@@ -0,0 +1,110 @@
+#pragma once
+
+#ifndef __BTEXTENSION_H__
+#define __BTEXTENSION_H__
+
+/* This is an implementation of extension protocol, see BEP 10 */
+
+/* Peers supporting it set bit 0x10 of the 6th reserved byte. Then every
+ * extension message is <len><id=20><extended id><payload>, and extended id
+ * 0 is the extended handshake, a bencoded dictionary:
+ *
+ * - m: names of extensions mapped to the extended ids the sender wants to
+ *   receive them with, 0 means disabled
+ * - p: listen port of the sender
+ * - v: client name and version
+ * - yourip: compact address of the receiver as seen by the sender
+ * - reqq: number of outstanding requests the sender accepts
+ *
+ * Ids are chosen by the receiver, so a message of one extension is sent
+ * with the peer's id and comes back with ours.
+ *
+ * BtExtensionTable gives extensions our ids in the order they are added,
+ * 1, 2, ..., so an incoming message is dispatched by indexing an array
+ * with its id, and the peer's ids are looked up by name once, when its
+ * handshake comes. Nothing is allocated or searched per message, only the
+ * handshake goes through the bencode decoder.
+ * */
+
+#include <QByteArray>
+#include <QHostAddress>
+#include <QMap>
+#include <QString>
+#include <QVariant>
+
+#include <BtDefs.h>
+#include <BtPeerWire.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+/* One extension on one connection, e.g. ut_pex */
+class BtExtensionHandler {
+public:
+    virtual ~BtExtensionHandler() {}
+    /* Peer's handshake says it has this extension. The whole dictionary
+     * is there for keys of extensions, like 'metadata_size'. */
+    virtual void peerHandshake(QMap<QString, QVariant> const &) {}
+    /* A message of this extension, payload points into receive buffer */
+    virtual void received(const char *payload, int size) = 0;
+};
+
+class BtExtensionTable {
+public:
+    static const quint8 HandshakeId = 0;
+    static const int MaxExtensions = 16;
+    /* Requests we accept outstanding, told with 'reqq' */
+    static const int DefaultRequestQueue = 250;
+
+    BtExtensionTable();
+
+    /* Add an extension before our handshake is sent, handler is not owned.
+     * Return our id of the extension, 0 if the table is full. */
+    quint8 add(QByteArray const &name, BtExtensionHandler *);
+    int size() const;
+
+    /* Our extended handshake, extra keys (e.g. yourip) are added to it */
+    QByteArray handshake(quint16 listenPort,
+            QMap<QString, QVariant> const &extra = QMap<QString, QVariant>()) const;
+    void writeHandshake(BtPeerWireWriter &, quint16 listenPort,
+            QMap<QString, QVariant> const &extra = QMap<QString, QVariant>()) const;
+
+    /* Payload of an extended message, starting with the extended id.
+     * Return false if it's broken. */
+    bool dispatch(const char *payload, int size);
+
+    /* Peer has extension of our id */
+    bool peerSupports(quint8 id) const;
+    /* Write a message of extension of our id with the peer's id.
+     * Return false if peer does not have it. */
+    bool write(BtPeerWireWriter &, quint8 id, const char *payload, int size) const;
+
+    /* What peer said in its handshake */
+    bool peerHandshaked() const;
+    int peerRequestQueue() const;
+    QString peerClient() const;
+    quint16 peerListenPort() const;
+    QHostAddress yourIp() const;
+
+private:
+    struct Entry {
+        QByteArray name;
+        BtExtensionHandler *handler;
+        /* Peer's id of it, 0 when peer does not have it */
+        quint8 peerId;
+    };
+
+    /* Entry of our id n is entries[n - 1] */
+    Entry entries[MaxExtensions];
+    int count;
+
+    bool handshaked;
+    int reqq;
+    QString client;
+    quint16 listenPort;
+    QHostAddress yourip;
+
+    bool handshakeReceived(const char *payload, int size);
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTEXTENSION_H__
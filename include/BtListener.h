@@ -0,0 +1,102 @@
+#pragma once
+
+#ifndef __BTLISTENER_H__
+#define __BTLISTENER_H__
+
+/* This is an implementation of one listening port shared by torrents */
+
+/* Incoming peers say which torrent they want in their first bytes:
+ *
+ * - plain: the 48 bytes <pstrlen><pstr><reserved><info_hash> at the start
+ *   of the handshake
+ * - MSE: HASH('req2', info_hash) xor HASH('req3', S) in step 3
+ *
+ * BtListener accepts on one port for every torrent added to it, reads just
+ * that far and looks the info hash up in a hash table. Unknown torrents are
+ * dropped right there, a peer costs nothing but its socket and a pending
+ * record until then, and the DH keys too if it speaks MSE. Known ones are
+ * handed to their BtListenTarget with what was read, the target takes the
+ * socket over and starts its connection in the middle of the handshake.
+ *
+ * Peers that don't get as far as the info hash in HandshakeTimeoutMs, or
+ * that come when MaxPending are already waiting, are dropped.
+ * */
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QHash>
+#include <QScopedPointer>
+
+#include <BtDefs.h>
+#include <BtPeerWire.h>
+#include <BtMse.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+/* A torrent taking incoming peers from BtListener */
+class BtListenTarget {
+public:
+    virtual ~BtListenTarget() {}
+    /* Socket has no parent and lives in the listener's thread, it's ours
+     * to move elsewhere and delete. The handshake goes on from start. */
+    virtual void incoming(QTcpSocket *, BtStreamStart const &start) = 0;
+};
+
+class BtListener : public QObject {
+    Q_OBJECT
+
+public:
+    /* <pstrlen><pstr><reserved><info_hash> */
+    static const int RoutingSize = 48;
+    static const int HandshakeTimeoutMs = 10000;
+    static const int MaxPending = 256;
+
+    explicit BtListener(QObject *parent = 0);
+    ~BtListener();
+
+    /* Port 0 picks any free one */
+    bool listen(quint16 port, QHostAddress const & = QHostAddress::Any);
+    void close();
+    bool isListening() const;
+    quint16 port() const;
+    QString errorString() const;
+
+    /* MSE of incoming peers, for every torrent */
+    void setEncryptionPolicy(BtEncryptionPolicy);
+    BtEncryptionPolicy encryptionPolicy() const;
+
+    void add(QByteArray const &infoHash, BtListenTarget *);
+    void remove(QByteArray const &infoHash);
+    int torrentCount() const;
+
+private:
+    struct Pending {
+        Pending() : buffer(BtMseHandshake::KeySize + BtMseHandshake::MaxPad) {}
+        QElapsedTimer since;
+        BtWireBuffer buffer;
+        /* Only for peers not starting with a plain handshake */
+        QScopedPointer<BtMseHandshake> mse;
+    };
+
+    QTcpServer server;
+    QTimer timer;
+    BtEncryptionPolicy policy;
+    QHash<QByteArray, BtListenTarget *> targets;
+    /* Info hashes keyed by BtMseHandshake::obfuscatedHash() */
+    QHash<QByteArray, QByteArray> obfuscated;
+    QHash<QTcpSocket *, Pending *> pending;
+
+    void acceptConnections();
+    void readPending(QTcpSocket *);
+    /* MSE bytes in p.buffer, return false if the peer is dropped */
+    bool readEncrypted(QTcpSocket *, Pending &);
+    void handOver(QTcpSocket *, BtStreamStart const &);
+    void drop(QTcpSocket *);
+    void dropStale();
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTLISTENER_H__
@@ -0,0 +1,173 @@
+#pragma once
+
+#ifndef __BTMSE_H__
+#define __BTMSE_H__
+
+/* This is an implementation of Message Stream Encryption, aka protocol
+ * encryption or connection obfuscation */
+
+/* MSE hides the BitTorrent handshake from traffic shapers. Before the usual
+ * handshake, A (who connects) and B do a Diffie-Hellman key exchange over a
+ * 768-bit prime, and then talk RC4 keyed with the shared secret S and the
+ * info hash (SKEY):
+ *
+ * 1 A->B: Ya, PadA
+ * 2 B->A: Yb, PadB
+ * 3 A->B: HASH('req1', S), HASH('req2', SKEY) xor HASH('req3', S),
+ *         ENCRYPT(VC, crypto_provide, len(PadC), PadC, len(IA)), ENCRYPT(IA)
+ * 4 B->A: ENCRYPT(VC, crypto_select, len(padD), padD), ENCRYPT2(payload)
+ * 5 A->B: ENCRYPT2(payload)
+ *
+ * - Y is 96 bytes of 2^X mod P, X is a random 160-bit private key
+ * - pads are 0 to 512 random bytes, PadC and PadD are zeros here
+ * - HASH is SHA-1, VC is 8 zero bytes
+ * - A->B is keyed with HASH('keyA', S, SKEY), B->A with HASH('keyB', S,
+ *   SKEY), both drop the first 1024 bytes of keystream
+ * - crypto_provide is a bitmask of 0x01 plaintext and 0x02 RC4,
+ *   crypto_select is one of them. ENCRYPT2 is RC4 or nothing as selected.
+ * - IA is the initial payload, usually the BitTorrent handshake of A
+ *
+ * B finds out which torrent A wants from HASH('req2', SKEY), so one
+ * listener serves all torrents. B also takes a plain BitTorrent handshake
+ * when encryption is not forced.
+ *
+ * BtMseHandshake only does the bytes: it reads the raw stream from one
+ * buffer and writes to another. Once it's done, the connection hands the
+ * ciphers to its framer and writer (BtPeerWire.h), which then decrypt what
+ * is read and encrypt what is sent, in place in their buffers.
+ * */
+
+#include <QByteArray>
+#include <QList>
+#include <QHash>
+#include <QString>
+
+#include <BtDefs.h>
+#include <BtPeerWire.h>
+#include <BtRc4.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+enum class BtEncryptionPolicy {
+    /* Never MSE, plain handshakes only */
+    disabled,
+    /* MSE preferring RC4, plain handshakes are taken too */
+    enabled,
+    /* RC4 only */
+    forced,
+};
+
+/* Where the BitTorrent stream of a connection starts, once encryption is
+ * settled by whoever read the first bytes */
+struct BtStreamStart {
+    BtStreamStart() : encrypted(false) {}
+
+    QByteArray infoHash;
+    bool encrypted;
+    BtRc4 encryptor;
+    BtRc4 decryptor;
+    /* Plain already: IA of MSE, or the start of a plain handshake */
+    QByteArray head;
+    /* Read after head, as it came from the wire */
+    QByteArray rest;
+};
+
+class BtMseHandshake {
+public:
+    static const int KeySize = 96;
+    static const int MaxPad = 512;
+    static const quint32 CryptoPlaintext = 0x01;
+    static const quint32 CryptoRc4 = 0x02;
+
+    /* A, we know the torrent. initialPayload goes with step 3. */
+    BtMseHandshake(QByteArray const &infoHash, BtEncryptionPolicy,
+            QByteArray const &initialPayload = QByteArray());
+    /* B, the torrent is one of infoHashes */
+    BtMseHandshake(QList<QByteArray> const &infoHashes, BtEncryptionPolicy);
+    /* B, with info hashes keyed by obfuscatedHash(), so that finding the
+     * torrent is one lookup however many there are */
+    BtMseHandshake(QHash<QByteArray, QByteArray> const &infoHashes, BtEncryptionPolicy);
+
+    /* HASH('req2', info hash), what A's step 3 hides the torrent with */
+    static QByteArray obfuscatedHash(QByteArray const &infoHash);
+
+    bool isInitiator() const;
+
+    /* A writes step 1, B does nothing. False if the handshake failed,
+     * there is no random source for the key. */
+    bool start(BtWireBuffer &out);
+    /* Take what is in buffer in and write replies to out. Return false if
+     * the handshake failed, then the connection should be dropped (or tried
+     * again in plain, if we are A and policy is not forced).
+     *
+     * Once done, in is left with what follows the handshake as it came
+     * from the wire: the BitTorrent stream, still encrypted if RC4 is
+     * selected. */
+    bool received(BtWireBuffer &in, BtWireBuffer &out);
+
+    bool isDone() const;
+    bool hasFailed() const;
+    QString errorString() const;
+
+    /* B got a plain BitTorrent handshake, nothing was consumed */
+    bool isPlaintext() const;
+    /* RC4 is selected for the stream after the handshake */
+    bool isEncrypted() const;
+    QByteArray infoHash() const;
+    /* B: IA from A, decrypted, it comes before what is left in buffer */
+    QByteArray initialPayload() const;
+
+    /* Keyed and at the right place of keystream once done */
+    BtRc4 const &encryptor() const;
+    BtRc4 const &decryptor() const;
+
+private:
+    enum class State {
+        start,
+        /* A */
+        waitYb,
+        waitVc,
+        waitPadD,
+        /* B */
+        waitYa,
+        waitReq,
+        waitPadC,
+        waitIA,
+        done,
+        failed,
+    };
+
+    State state;
+    BtEncryptionPolicy policy;
+    bool initiator;
+    /* B, keyed by obfuscatedHash() */
+    QHash<QByteArray, QByteArray> infoHashes;
+    QByteArray skey;
+    QByteArray ia;
+
+    QByteArray privateKey;
+    QByteArray secret;
+    /* What we search for behind the peer's pad */
+    QByteArray sync;
+
+    quint32 provide;
+    quint32 select;
+    int padLength;
+    int iaLength;
+    bool plaintext;
+    QString ErrorString;
+
+    BtRc4 sendCipher;
+    BtRc4 receiveCipher;
+
+    bool fail(QString const &);
+    bool writeKey(BtWireBuffer &);
+    void setKeys();
+    /* Find sync within at most MaxPad bytes, drop what is before it.
+     * Return 1 found, 0 need more, -1 not there. */
+    int synchronize(BtWireBuffer &);
+    quint32 crypto() const;
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTMSE_H__
@@ -156,7 +156,13 @@
 #include <QBitArray>
 #include <QHostAddress>
 #include <BtTorrent.h>
+#include <BtPeerWire.h>
+#include <BtStorage.h>
+#include <BtPieceSet.h>
+#include <BtExtension.h>
+#include <BtMse.h>
 #include <QTcpSocket>
+#include <QScopedPointer>
 #include <QUdpSocket>
 
 NAMESPACE_BEGIN(BtQt)
@@ -191,7 +197,7 @@ protected:
     /* Specify what torrent this peer has */
     const BtTorrent& torrentRef;
     /* Specify pieces this peer has */
-    QBitArray pieces;
+    BtPieceSet pieces;
 
 public:
     BtPeer(BtTorrent const &);
@@ -217,6 +223,7 @@ public:
     bool peerChoking() const;
     bool peerInterested() const;
     QBitArray getPieceBitArray() const;
+    BtPieceSet const &getPieceSet() const;
     bool havePiece(int) const;
 };
 
@@ -228,8 +235,13 @@ public:
 };
 
 /* Local Peer is declared to be QObject so that we can use
- * signal-slot mechanism */
-class BtLocalPeer : public QObject, public BtPeer {
+ * signal-slot mechanism
+ *
+ * Incoming stream is cut by a BtPeerWireFramer, messages come back as
+ * signals. Blocks of piece messages are QByteArray::fromRawData() over the
+ * receive buffer, copy them if they are needed after the signal returns.
+ * */
+class BtLocalPeer : public QObject, public BtPeer, private BtPeerWireHandler {
     Q_OBJECT
 
 private:
@@ -240,6 +252,35 @@ private:
     QTcpSocket tcpSocket;
     QUdpSocket udpSocket;
 
+    BtPeerWireFramer framer;
+    BtWireBuffer sendBuffer;
+    BtPeerWireWriter writer;
+    BtExtensionTable extensionTable;
+    /* MSE in progress, and raw bytes it has not taken yet */
+    QScopedPointer<BtMseHandshake> mse;
+    BtWireBuffer mseBuffer;
+
+    void readEncryptionHandshake();
+
+    /* BtPeerWireHandler */
+    void handshakeReceived(BtHandshakeView const &) override;
+    void chokeReceived() override;
+    void unchokeReceived() override;
+    void interestedReceived() override;
+    void notInterestedReceived() override;
+    void haveReceived(quint32 index) override;
+    void bitfieldReceived(const char *bits, int size) override;
+    void requestReceived(BtBlockRequest const &) override;
+    void pieceReceived(BtBlockView const &) override;
+    void cancelReceived(BtBlockRequest const &) override;
+    void portReceived(quint16 port) override;
+    void suggestReceived(quint32 index) override;
+    void haveAllReceived() override;
+    void haveNoneReceived() override;
+    void rejectReceived(BtBlockRequest const &) override;
+    void allowedFastReceived(quint32 index) override;
+    void extendedReceived(const char *payload, int size) override;
+
 public:
     BtLocalPeer(BtTorrent const &);
     BtLocalPeer(BtTorrent const &, QByteArray const &,
@@ -258,17 +299,69 @@ public:
     /* pieceData is correspongding to piece of index */
     QByteArray piece(int index, qint64 begin, qint64 length,
             QByteArray const& pieceData) const;
+    /* Send a block straight from the mapped files, for seeding */
+    bool sendPiece(BtStorage const &, int index, qint64 begin, qint64 length);
     QByteArray cancel(int index, qint64 begin, qint64 length) const;
     QByteArray port(quint16 listenPort) const;
+    /* Fast extension, BEP 6 */
+    QByteArray suggest(int index) const;
+    QByteArray haveAll() const;
+    QByteArray haveNone() const;
+    QByteArray rejectRequest(int index, qint64 begin, qint64 length) const;
+    QByteArray allowedFast(int index) const;
+    /* Both sides have fast extension */
+    bool fastExtension() const;
+    /* Extension protocol, BEP 10. Add extensions to the table before
+     * extendedHandshake() is sent. */
+    bool extensionProtocol() const;
+    BtExtensionTable &extensions();
+    QByteArray extendedHandshake() const;
+
+    /* Queue messages into the send buffer without allocating, then
+     * flush() them to the socket */
+    BtPeerWireWriter &wire();
+    bool flush();
+
+    /* Message stream encryption on the connected socket, before the
+     * BitTorrent handshake. Initiator is the side that connected, it sends
+     * its handshake once encryptionDone() comes. */
+    void startEncryption(bool initiator, BtEncryptionPolicy = BtEncryptionPolicy::enabled);
+    bool isEncrypted() const;
 
     /* Process messages */
     /* Send messages, return true if sent */
     bool send(BtRemotePeer const &, QByteArray const &);
 
-    /* Process message and decide what to do next */
+    /* Process one message, without its length prefix */
     void process(QByteArray const &);
 public slots:
+    /* Any part of the stream, messages may be cut anywhere */
     void received(QByteArray const &);
+
+signals:
+    void handshaked(QByteArray const &infoHash, QByteArray const &peerId);
+    /* Remote peer chokes us or not, is interested in us or not */
+    void chokeChanged(bool choking);
+    void interestChanged(bool interested);
+    void peerHas(int index);
+    void peerBitfield(QByteArray const &bits);
+    void blockRequested(int index, qint64 begin, qint64 length);
+    void blockReceived(int index, qint64 begin, QByteArray const &block);
+    void requestCancelled(int index, qint64 begin, qint64 length);
+    void dhtPort(quint16 port);
+    /* Fast extension */
+    void pieceSuggested(int index);
+    void peerHasAll();
+    void peerHasNone();
+    void requestRejected(int index, qint64 begin, qint64 length);
+    void fastAllowed(int index);
+    /* MSE is done, the stream is RC4 or plain as encrypted says */
+    void encryptionDone(bool encrypted);
+    /* Stream is broken, drop the connection */
+    void protocolError(QString const &reason);
+
+private slots:
+    void readSocket();
 };
 NAMESPACE_END(BtQt)
 
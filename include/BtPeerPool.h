@@ -0,0 +1,104 @@
+#pragma once
+
+#ifndef __BTPEERPOOL_H__
+#define __BTPEERPOOL_H__
+
+/* This is an implementation of the pool of peers a swarm may connect to */
+
+/* Trackers, PEX and DHT all hand out endpoints, mostly the same ones over
+ * and over, and many of them are dead. The pool keeps one record per
+ * endpoint, merging what every source says about it, and remembers how
+ * connecting to it went:
+ *
+ * - ready peers wait in order of score, best first, oldest first among
+ *   equals. Score is what the sources are worth (a tracker saw the peer
+ *   announce, PEX and DHT are hearsay) plus a bonus for having been
+ *   connected before, less the failures.
+ * - a failed connect puts the peer aside for RetryMs, doubled with every
+ *   failure in a row up to MaxRetryMs, and MaxFailures in a row forget it.
+ *   Peers we were connected to come back after ReconnectMs.
+ * - at most MaxHalfOpen connects are in flight, counting until the peer
+ *   is handshaken, so a swarm of dead peers can't eat sockets.
+ *
+ * Ready peers are in a map ordered by rank and waiting ones in a map
+ * ordered by time, so taking the next peer and adding one are O(log n)
+ * however many thousands of peers are known.
+ * */
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+
+#include <BtDefs.h>
+#include <BtEndpoint.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+enum class BtPeerSource : quint8 {
+    tracker = 1,
+    pex = 2,
+    dht = 4
+};
+
+class BtPeerPool {
+public:
+    static const int MaxPeers = 16384;
+    static const int MaxHalfOpen = 16;
+    static const int MaxFailures = 6;
+    static const int RetryMs = 30000;
+    static const int MaxRetryMs = 1800000;
+    static const int ReconnectMs = 120000;
+
+    BtPeerPool();
+
+    /* Known ones get the source added, score goes up */
+    void add(BtPeerEndpoint const &, BtPeerSource);
+    int size() const;
+    int halfOpen() const;
+
+    /* Best ready peer to connect to, false if none or MaxHalfOpen are
+     * being connected already. The peer is connecting from now on. */
+    bool next(BtPeerEndpoint &);
+    /* Peer from next() is not connected after all, it's ready again */
+    void putBack(BtPeerEndpoint const &);
+    /* Handshake is done */
+    void connected(BtPeerEndpoint const &);
+    /* Connection is gone. A connect that did not get as far as the
+     * handshake is a failure, unless blame is false (we stopped). */
+    void disconnected(BtPeerEndpoint const &, bool blame = true);
+
+private:
+    enum class State : quint8 {
+        ready,
+        waiting,
+        connecting,
+        connected
+    };
+    struct Peer {
+        quint8 sources;
+        quint8 failures;
+        bool wasConnected;
+        State state;
+        /* Key in ready or waiting */
+        qint64 key;
+    };
+
+    QHash<BtPeerEndpoint, Peer> peers;
+    QMap<qint64, BtPeerEndpoint> ready;
+    QMultiMap<qint64, BtPeerEndpoint> waiting;
+    int HalfOpen;
+    /* Keeps ready peers of the same score in order of coming */
+    qint64 sequence;
+    QElapsedTimer clock;
+
+    static int score(Peer const &);
+    void makeReady(BtPeerEndpoint const &, Peer &);
+    void makeWaiting(BtPeerEndpoint const &, Peer &, qint64 ms);
+    /* Take peer out of ready or waiting */
+    void unlink(BtPeerEndpoint const &, Peer &);
+    /* Waiting peers whose time has come are ready */
+    void wakeUp();
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTPEERPOOL_H__
@@ -0,0 +1,334 @@
+#pragma once
+
+#ifndef __BTPEERWIRE_H__
+#define __BTPEERWIRE_H__
+
+/* This is an implementation of peer wire framing and serializing, see
+ * BtPeer.h for the messages themselves */
+
+/* Data from a peer comes as a byte stream cut at arbitrary places by TCP,
+ * a 16 KiB piece message usually arrives in several reads and one read may
+ * carry the tail of one message and the heads of a few more.
+ *
+ * BtPeerWireFramer reads the stream into a BtWireBuffer and cuts it into
+ * the handshake and length-prefixed messages as soon as they are complete.
+ * Every message is handed to a BtPeerWireHandler as a small typed struct
+ * whose variable part (bitfield, block of a piece) is only a pointer into
+ * the buffer: nothing is copied between the socket and whoever writes the
+ * block to disk. The pointers are valid during the callback only.
+ *
+ * On connections encrypted with MSE (BtMse.h), the framer decrypts what it
+ * reads and the writer encrypts what it sends, in place in their buffers,
+ * so encryption adds one pass over the bytes and no copy.
+ * */
+
+#include <QIODevice>
+#include <QAbstractSocket>
+#include <QByteArray>
+#include <QBitArray>
+#include <QString>
+#include <QtEndian>
+#include <QHostAddress>
+#include <QVector>
+
+#include <BtDefs.h>
+#include <BtPieceSet.h>
+#include <BtRc4.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+enum class BtPeerMessageId : quint8 {
+    choke = 0,
+    unchoke = 1,
+    interested = 2,
+    notInterested = 3,
+    have = 4,
+    bitfield = 5,
+    request = 6,
+    piece = 7,
+    cancel = 8,
+    port = 9,
+    /* Fast extension, BEP 6 */
+    suggest = 0x0d,
+    haveAll = 0x0e,
+    haveNone = 0x0f,
+    rejectRequest = 0x10,
+    allowedFast = 0x11,
+    /* Extension protocol, BEP 10 */
+    extended = 20
+};
+
+/* Extensions announced with bits of the reserved bytes of handshake */
+enum class BtExtensionBit {
+    dht,
+    fast,
+    extensionProtocol
+};
+
+bool supportsExtension(const char *reserved, BtExtensionBit);
+void setExtension(char *reserved, BtExtensionBit);
+
+/* Allowed fast set of BEP 6: pieces a peer at ip may request from us even
+ * when choked. It depends only on the /24 of ip and the torrent, so the
+ * peer computes the same set. Empty for IPv6, BEP 6 has no rule for it. */
+QVector<int> allowedFastSet(QHostAddress const &ip, QByteArray const &infoHash,
+        int pieceCount, int k = 10);
+
+/* handshake, pointers into the buffer */
+struct BtHandshakeView {
+    /* 8 bytes */
+    const char *reserved;
+    /* 20 bytes each */
+    const char *infoHash;
+    const char *peerId;
+};
+
+/* Payload of request and cancel */
+struct BtBlockRequest {
+    quint32 index;
+    quint32 begin;
+    quint32 length;
+};
+
+/* Payload of piece, data points into the buffer */
+struct BtBlockView {
+    quint32 index;
+    quint32 begin;
+    const char *data;
+    int length;
+};
+
+/* Some bytes somewhere else, e.g. a part of a mapped file */
+struct BtIoSlice {
+    const char *data;
+    int size;
+};
+
+/* Sizes of messages on the wire, with length prefix */
+namespace BtWireSize {
+    const int handshake = 68;
+    const int lengthPrefix = 4;
+    const int keepAlive = 4;
+    /* choke, unchoke, interested, not interested */
+    const int state = 5;
+    const int have = 9;
+    const int request = 17;
+    const int cancel = 17;
+    /* Without the block */
+    const int pieceHeader = 13;
+    const int port = 7;
+    const int suggest = 9;
+    const int haveAll = 5;
+    const int haveNone = 5;
+    const int rejectRequest = 17;
+    const int allowedFast = 9;
+    /* bitfield of pieceCount pieces */
+    inline int bitfield(int pieceCount) { return 5 + (pieceCount + 7) / 8; }
+}
+
+/* Receives messages cut by BtPeerWireFramer.
+ * Everything is ignored by default, override what you care about. */
+class BtPeerWireHandler {
+public:
+    virtual ~BtPeerWireHandler() {}
+
+    virtual void handshakeReceived(BtHandshakeView const &) {}
+    virtual void keepAliveReceived() {}
+    virtual void chokeReceived() {}
+    virtual void unchokeReceived() {}
+    virtual void interestedReceived() {}
+    virtual void notInterestedReceived() {}
+    virtual void haveReceived(quint32 index) { Q_UNUSED(index); }
+    /* Raw bitfield, high bit of the first byte is piece 0 */
+    virtual void bitfieldReceived(const char *bits, int size)
+    {
+        Q_UNUSED(bits); Q_UNUSED(size);
+    }
+    virtual void requestReceived(BtBlockRequest const &) {}
+    virtual void pieceReceived(BtBlockView const &) {}
+    virtual void cancelReceived(BtBlockRequest const &) {}
+    virtual void portReceived(quint16 port) { Q_UNUSED(port); }
+    /* Fast extension, only when both sides have it */
+    virtual void suggestReceived(quint32 index) { Q_UNUSED(index); }
+    virtual void haveAllReceived() {}
+    virtual void haveNoneReceived() {}
+    virtual void rejectReceived(BtBlockRequest const &) {}
+    virtual void allowedFastReceived(quint32 index) { Q_UNUSED(index); }
+    /* Extension protocol, payload starts with the extended id */
+    virtual void extendedReceived(const char *payload, int size)
+    {
+        Q_UNUSED(payload); Q_UNUSED(size);
+    }
+    /* Messages of extensions we don't know, payload without id */
+    virtual void unknownReceived(quint8 id, const char *payload, int size)
+    {
+        Q_UNUSED(id); Q_UNUSED(payload); Q_UNUSED(size);
+    }
+};
+
+/* Receive or send buffer of one connection.
+ *
+ * Unread bytes are always contiguous in [data(), data() + size()). Writing
+ * goes on after them and wraps back to the front of the storage, but only
+ * between messages: the few bytes of a message not complete yet are moved
+ * to the front when there's no room after them. So wrapping costs at most
+ * one partial message, and a message is never split into two pieces of
+ * memory, which is what lets blocks be handed out without a copy.
+ * */
+class BtWireBuffer {
+public:
+    /* Four 16 KiB blocks with their headers */
+    static const int DefaultCapacity = 1 << 16;
+
+    explicit BtWireBuffer(int capacity = DefaultCapacity);
+
+    int size() const;
+    bool isEmpty() const;
+    int capacity() const;
+    const char *data() const;
+    char *data();
+
+    /* Make room for n contiguous bytes after data and return where to write
+     * them. Storage only grows when a single message is larger than it. */
+    char *reserve(int n);
+    /* n bytes have been written at reserve() */
+    void commit(int n);
+    /* Drop n bytes from the front */
+    void consume(int n);
+    void clear();
+
+private:
+    QByteArray storage;
+    int head;
+    int tail;
+};
+
+/* Serializes messages straight into an output buffer, usually the send
+ * buffer of a connection. Every message of fixed size is one reserve() of
+ * its size and a few stores, so once the buffer has grown to the usual
+ * burst, queuing requests or haves allocates nothing. */
+class BtPeerWireWriter {
+public:
+    explicit BtPeerWireWriter(BtWireBuffer &out);
+
+    void handshake(QByteArray const &infoHash, QByteArray const &peerId,
+            const char *reserved = 0);
+    void keepAlive();
+    void choke();
+    void unchoke();
+    void interested();
+    void notInterested();
+    void have(quint32 index);
+    /* pieces is the number of pieces, bits are packed high bit first and
+     * spare bits are zero, whatever bits has after them */
+    void bitfield(QBitArray const &bits);
+    void bitfield(const char *bits, int pieces);
+    void bitfield(BtPieceSet const &);
+    void request(BtBlockRequest const &);
+    void cancel(BtBlockRequest const &);
+    /* Header of piece message, the block has to follow right after it */
+    void pieceHeader(quint32 index, quint32 begin, int length);
+    void piece(quint32 index, quint32 begin, const char *block, int length);
+    /* Send a piece message whose block is in slices, usually mapped files,
+     * with a single writev() of header and slices on the socket. Only what
+     * the socket does not take at once is copied into the buffer. When
+     * something is queued before it, the stream is encrypted, or writev()
+     * is not there, it's all copied. Return false on socket error. */
+    bool sendPiece(QAbstractSocket *, quint32 index, quint32 begin,
+            BtIoSlice const *slices, int count);
+    void port(quint16 listenPort);
+    /* Fast extension */
+    void suggest(quint32 index);
+    void haveAll();
+    void haveNone();
+    void rejectRequest(BtBlockRequest const &);
+    void allowedFast(quint32 index);
+    /* Extension protocol, id is the extended id */
+    void extended(quint8 id, const char *payload, int size);
+    void raw(const char *data, int size);
+
+    /* Write buffered bytes to device and drop what has been written.
+     * Return bytes written, or -1 on error */
+    qint64 flush(QIODevice *);
+
+    /* Encrypt from now on, what is queued already is taken as encrypted.
+     * Bytes are encrypted in the buffer when flushed. */
+    void setEncryption(BtRc4 const &);
+    bool isEncrypted() const;
+
+private:
+    BtWireBuffer &out;
+    BtRc4 cipher;
+    bool encrypting;
+    /* Bytes at the front of out that are encrypted already */
+    int encrypted;
+
+    /* Slices of a block a single writev() takes */
+    static const int MaxSlices = 15;
+
+    void stateMessage(BtPeerMessageId);
+    void blockMessage(BtPeerMessageId, BtBlockRequest const &);
+};
+
+class BtPeerWireFramer {
+public:
+    static const int HandshakeSize = BtWireSize::handshake;
+    /* Largest message accepted: a 128 KiB block (some clients go above
+     * 16 KiB) or a bitfield of a million pieces */
+    static const quint32 MaxMessageLength = (1 << 17) + 9;
+    /* Bytes read from socket before dispatching */
+    static const int ReadChunk = 1 << 14;
+
+    /* Without expectHandshake, the first bytes are taken as a message,
+     * for the stream after a handshake read by somebody else */
+    explicit BtPeerWireFramer(BtPeerWireHandler *, bool expectHandshake = true);
+
+    /* Read what the device has and dispatch every complete message.
+     * Return false on a protocol error, then the connection should be
+     * dropped and nothing more is dispatched. */
+    bool readFrom(QIODevice *);
+    /* At most max bytes (all of them if negative), read tells how many */
+    bool readFrom(QIODevice *, qint64 max, qint64 &read);
+    /* Same for bytes got elsewhere, they are copied into the buffer */
+    bool feed(const char *data, int size);
+    /* Dispatch one message, without length prefix */
+    bool dispatchMessage(const char *message, int size);
+
+    /* Take fast extension messages, once both handshakes have the bit.
+     * Otherwise they are unknown messages. */
+    void setFastExtension(bool);
+    bool fastExtension() const;
+    /* Same for extended messages */
+    void setExtensionProtocol(bool);
+    bool extensionProtocol() const;
+    /* Decrypt everything read or fed from now on */
+    void setDecryption(BtRc4 const &);
+    bool isEncrypted() const;
+
+    bool handshakeDone() const;
+    /* Stop dispatching, for handlers dropping the connection in a callback */
+    void abort(QString const &reason);
+    bool hasError() const;
+    QString errorString() const;
+    /* Bytes buffered of messages not complete yet */
+    int pending() const;
+
+    void reset(bool expectHandshake = true);
+
+private:
+    BtPeerWireHandler *handler;
+    BtWireBuffer buffer;
+    bool handshaken;
+    bool fast;
+    bool extension;
+    bool error;
+    QString ErrorString;
+    BtRc4 cipher;
+    bool decrypting;
+
+    bool dispatch();
+    bool fail(QString const &);
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTPEERWIRE_H__
@@ -0,0 +1,76 @@
+#pragma once
+
+#ifndef __BTPEX_H__
+#define __BTPEX_H__
+
+/* This is an implementation of peer exchange, ut_pex over BEP 10 */
+
+/* Peers tell each other whom they are connected to, so a swarm keeps
+ * finding peers without asking trackers. A ut_pex message is a bencoded
+ * dictionary of deltas since the last message to that peer:
+ *
+ * - added, added6: compact peers connected since then (6 or 18 bytes each)
+ * - added.f, added6.f: a byte of flags for each of them
+ * - dropped, dropped6: compact peers disconnected since then
+ *
+ * At most one message a minute and at most 50 peers of each kind in it,
+ * clients drop connections sending more.
+ * */
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QVector>
+
+#include <BtDefs.h>
+#include <BtEndpoint.h>
+#include <BtExtension.h>
+#include <BtPeerWire.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+/* One per connection, registered into its BtExtensionTable as "ut_pex" */
+class BtPex : public QObject, public BtExtensionHandler {
+    Q_OBJECT
+
+public:
+    static const char Name[];
+    static const int IntervalMs = 60000;
+    static const int MaxPeers = 50;
+    /* Flags of added.f */
+    static const quint8 FlagEncryption = 0x01;
+    static const quint8 FlagSeed = 0x02;
+    static const quint8 FlagOutgoing = 0x10;
+
+    explicit BtPex(QObject *parent = 0);
+
+    /* Our id of ut_pex in the table of the connection */
+    void setId(quint8);
+    quint8 id() const;
+
+    void received(const char *payload, int size) override;
+
+    /* Send what changed in connected since the last message, if the peer
+     * has ut_pex and a minute has passed. The peer itself (self) is left
+     * out. Return true if a message is written. */
+    bool update(BtPeerWireWriter &, BtExtensionTable const &,
+            QVector<BtPeerEndpoint> const &connected, BtPeerEndpoint const &self);
+
+    /* Encode a message, for tests and for whoever builds it elsewhere */
+    static QByteArray encode(QVector<BtPeerEndpoint> const &added,
+            QVector<BtPeerEndpoint> const &dropped);
+
+signals:
+    void peersAdded(QVector<BtPeerEndpoint> const &);
+    void peersDropped(QVector<BtPeerEndpoint> const &);
+
+private:
+    quint8 Id;
+    /* What the peer knows from us */
+    QSet<BtPeerEndpoint> sent;
+    QElapsedTimer lastSent;
+    QElapsedTimer lastReceived;
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTPEX_H__
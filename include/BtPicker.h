@@ -0,0 +1,89 @@
+#pragma once
+
+#ifndef __BTPICKER_H__
+#define __BTPICKER_H__
+
+/* This is an implementation of rarest-first piece picking */
+
+/* Availability of a piece is how many connected peers have it. Asking for
+ * the rarest pieces first keeps every piece alive in the swarm and gives
+ * us what others want from us.
+ *
+ * Instead of counting bits of every peer's bitfield for each pick, the
+ * counts are kept up to date as peers come and go (bitfield, have,
+ * disconnect), and every piece we still want sits in the bucket of its
+ * availability. Moving a piece to the next bucket is a swap with the last
+ * one of its bucket, and picking for a peer walks the buckets from the
+ * rarest, so it stops at the first piece the peer has, usually at once.
+ * Pieces being downloaded leave their bucket until they are free again,
+ * so the walk does not step over them either.
+ *
+ * Seeds are not counted piece by piece, they add the same to every piece
+ * and don't change the order, so a seed coming or going costs nothing.
+ * A peer that is not a seed is counted in every piece it has, so the walk
+ * for it starts at bucket 1.
+ * */
+
+#include <QVector>
+
+#include <BtDefs.h>
+#include <BtPieceSet.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+class BtPicker {
+public:
+    explicit BtPicker(int pieceCount = 0);
+
+    void reset(int pieceCount);
+    int pieceCount() const;
+
+    /* Changes of the swarm */
+    void peerHas(int index);
+    void peerBitfield(BtPieceSet const &);
+    /* A peer disconnected, with the pieces it had */
+    void peerLost(BtPieceSet const &);
+    void seedJoined();
+    void seedLeft();
+
+    /* Our changes, pieces we have or don't want are never picked */
+    void weHave(int index);
+    void setWanted(int index, bool wanted);
+    /* Busy pieces are being downloaded from somebody and not picked */
+    void setBusy(int index, bool busy);
+
+    int availability(int index) const;
+    /* Not had and not unwanted, busy or not */
+    bool isWanted(int index) const;
+    /* Every piece we want is busy, nothing is left to pick */
+    bool allBusy() const;
+
+    /* Rarest wanted piece the peer has, -1 if it has nothing for us.
+     * Pieces of seeds are not counted, so rarest for them starts at
+     * pieces no other peer has */
+    int pick(BtPieceSet const &peerHas, bool isSeed = false) const;
+
+private:
+    enum PieceFlag {
+        Have = 1,
+        Unwanted = 2,
+        Busy = 4
+    };
+
+    /* Availability without seeds */
+    QVector<int> count;
+    /* Index of piece in its bucket, -1 when not in any bucket (we have it,
+     * don't want it or it's busy) */
+    QVector<int> position;
+    QVector<quint8> flags;
+    /* buckets[n] are pieces n peers (besides seeds) have */
+    QVector<QVector<int>> buckets;
+    int seeds;
+
+    void insert(int index);
+    void remove(int index);
+    void setCount(int index, int to);
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTPICKER_H__
@@ -0,0 +1,90 @@
+#pragma once
+
+#ifndef __BTPIECESET_H__
+#define __BTPIECESET_H__
+
+/* This is an implementation of a set of pieces, as peers' bitfields */
+
+/* Bits are kept in 64-bit words in the order of the wire: piece 0 is the
+ * highest bit of the first word, as it's the highest bit of the first byte
+ * of a bitfield message. So a word in big-endian is exactly eight bytes of
+ * the message, and converting from or to the wire is a byte swap per word
+ * instead of a loop over bits.
+ *
+ * Spare bits after the last piece are always zero, so counting and
+ * comparing never have to mask them.
+ *
+ * "What does this peer have that we don't" is the question asked all the
+ * time (interest, picking), it's anyAndNot() / firstAndNot(), 64 pieces per
+ * step.
+ * */
+
+#include <QVector>
+#include <QByteArray>
+#include <QBitArray>
+
+#include <BtDefs.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+class BtPieceSet {
+public:
+    BtPieceSet();
+    explicit BtPieceSet(int size, bool value = false);
+
+    int size() const;
+    /* New bits are zero */
+    void resize(int size);
+    void fill(bool value);
+
+    bool test(int i) const
+    {
+        return (words.at(i >> 6) >> (63 - (i & 63))) & 1;
+    }
+    void set(int i)
+    {
+        words[i >> 6] |= quint64(1) << (63 - (i & 63));
+    }
+    void clear(int i)
+    {
+        words[i >> 6] &= ~(quint64(1) << (63 - (i & 63)));
+    }
+
+    /* Number of set bits */
+    int count() const;
+    bool isFull() const;
+    bool isNone() const;
+    /* First set bit at or after from, -1 if none */
+    int findFirst(int from = 0) const;
+
+    /* this & ~other, other must have the same size */
+    bool anyAndNot(BtPieceSet const &other) const;
+    int countAndNot(BtPieceSet const &other) const;
+    int firstAndNot(BtPieceSet const &other, int from = 0) const;
+    BtPieceSet &andNot(BtPieceSet const &other);
+    BtPieceSet &operator&=(BtPieceSet const &other);
+    BtPieceSet &operator|=(BtPieceSet const &other);
+    bool operator==(BtPieceSet const &other) const;
+    bool operator!=(BtPieceSet const &other) const;
+
+    /* Payload of bitfield message */
+    int wireSize() const;
+    void toWire(char *out) const;
+    QByteArray toWire() const;
+    /* False if size is not wireSize() or spare bits are set, a peer
+     * sending such bitfield should be dropped */
+    bool fromWire(const char *bits, int size);
+
+    QBitArray toBitArray() const;
+    static BtPieceSet fromBitArray(QBitArray const &);
+
+private:
+    QVector<quint64> words;
+    int Size;
+
+    /* Zero the spare bits of the last word */
+    void trim();
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTPIECESET_H__
@@ -0,0 +1,140 @@
+#pragma once
+
+#ifndef __BTPIPELINE_H__
+#define __BTPIPELINE_H__
+
+/* This is an implementation of request pipelining for one remote peer */
+
+/* A block is requested with 'request' and comes back in a 'piece' message
+ * one round trip later. With one request at a time a peer gives at most a
+ * block per RTT, 16 KiB per 100 ms is 160 KiB/s however fast it is. So we
+ * keep enough requests outstanding to cover the bandwidth-delay product:
+ *
+ *   depth = rate * RTT / BlockSize * DepthGain / 100 + DepthSlack
+ *
+ * - RTT is the smallest latency of a block seen in the last RttWindowMs.
+ *   The latency of most blocks also includes the time they wait behind
+ *   other blocks in the peer's queue, which grows with depth itself, so
+ *   the minimum is used to keep depth from feeding on itself.
+ *
+ * - Rate is the smoothed download rate from this peer. Depth a bit over
+ *   the product (DepthGain) lets the rate grow until the peer or the path
+ *   is the limit, then depth stays.
+ *
+ * - Before the rate is known, depth grows by one with every block, like
+ *   TCP slow start, so fast peers are not held at MinDepth for seconds.
+ *
+ * Depth never exceeds what the peer accepts ('reqq' of BEP 10).
+ * */
+
+#include <QElapsedTimer>
+#include <QVector>
+
+#include <BtDefs.h>
+#include <BtPeerWire.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+class BtPipeline {
+public:
+    static const int BlockSize = 1 << 14;
+    static const int MinDepth = 2;
+    /* Default 'reqq' of most clients */
+    static const int MaxDepth = 250;
+    /* In percent */
+    static const int DepthGain = 150;
+    static const int DepthSlack = 2;
+    static const int RttWindowMs = 10000;
+    static const int RateWindowMs = 1000;
+    static const int DefaultTimeoutMs = 30000;
+
+    explicit BtPipeline(int maxDepth = MaxDepth);
+
+    /* Requests the peer accepts at most */
+    void setMaxDepth(int);
+    int maxDepth() const;
+    void setTimeout(int ms);
+    /* With fast extension (BEP 6) choke does not drop requests, the peer
+     * rejects each one it drops */
+    void setFastExtension(bool);
+
+    /* Requests to keep outstanding now */
+    int depth() const;
+    int outstanding() const;
+    /* How many more requests may go out now */
+    int wanted() const;
+    bool isRequested(BtBlockRequest const &) const;
+
+    /* Bytes per second */
+    qint64 rate() const;
+    /* ms, -1 before the first block */
+    int rtt() const;
+
+    /* Top up the pipeline: ask next for blocks and write their requests,
+     * until depth is reached or next returns false. next is a callable
+     * bool(BtBlockRequest &). Return number of requests written. */
+    template <typename NextBlock>
+    int fill(BtPeerWireWriter &writer, NextBlock next)
+    {
+        int n = 0;
+        BtBlockRequest r;
+        while(wanted() > 0 && next(r)) {
+            writer.request(r);
+            requested(r);
+            ++ n;
+        }
+        return n;
+    }
+
+    /* A request has been sent */
+    void requested(BtBlockRequest const &);
+    /* A block came, return false if it was not requested (e.g. it came
+     * after we cancelled it) */
+    bool received(quint32 index, quint32 begin, int length);
+    /* Forget a request, return false if it is not outstanding */
+    bool cancel(BtBlockRequest const &);
+    /* Peer rejected a request */
+    bool rejected(BtBlockRequest const &);
+    /* Write cancel for a request and forget it */
+    bool cancel(BtPeerWireWriter &, BtBlockRequest const &);
+
+    /* Peer choked us and dropped all our requests. Return them so that
+     * they can be asked from somebody else. Nothing is dropped with fast
+     * extension, rejects will come instead. */
+    QVector<BtBlockRequest> choked();
+    /* Requests outstanding longer than the timeout are cancelled (cancel
+     * is written) and returned */
+    QVector<BtBlockRequest> timedOut(BtPeerWireWriter &);
+    /* Drop everything, e.g. when the connection is closed */
+    QVector<BtBlockRequest> clear();
+
+private:
+    struct Pending {
+        BtBlockRequest request;
+        qint64 sentAt;
+    };
+
+    /* In the order they were sent, blocks mostly come back in that order */
+    QVector<Pending> pending;
+    QElapsedTimer clock;
+    int MaxDepthOfPeer;
+    int TimeoutMs;
+    int Depth;
+    bool fast;
+
+    /* Minimum latency in the current and the last window */
+    int minRtt;
+    int lastMinRtt;
+    qint64 rttWindowStart;
+
+    qint64 Rate;
+    qint64 rateBytes;
+    qint64 rateWindowStart;
+
+    int find(quint32 index, quint32 begin) const;
+    void sample(int latency, int length);
+    void updateDepth();
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTPIPELINE_H__
@@ -7,8 +7,27 @@
 #include <BtTracker.h>
 #include <BtDebug.h>
 #include <BtBencode.h>
+#include <BtPieceSet.h>
+#include <BtRc4.h>
+#include <BtPeerWire.h>
+#include <BtMse.h>
+#include <BtExtension.h>
+#include <BtPex.h>
+#include <BtPeerPool.h>
+#include <BtStorage.h>
+#include <BtPipeline.h>
+#include <BtPicker.h>
 #include <BtPeer.h>
+#include <BtTransferStats.h>
+#include <BtTokenBucket.h>
+#include <BtChoker.h>
+#include <BtConnection.h>
+#include <BtSwarm.h>
+#include <BtReactor.h>
+#include <BtListener.h>
+#include <BtAnnounce.h>
 #include <BtCore.h>
+#include <BtSession.h>
 #include <BtDefs.h>
 
 #endif // __BTQT_H__
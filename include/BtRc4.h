@@ -0,0 +1,43 @@
+#pragma once
+
+#ifndef __BTRC4_H__
+#define __BTRC4_H__
+
+/* This is an implementation of RC4, the stream cipher of MSE */
+
+/* RC4 is not a good cipher any more, MSE uses it to make the stream look
+ * random to traffic shapers, not to keep anything secret. What matters here
+ * is speed: apply() works in place on whole buffers with the state in
+ * locals, so an encrypted connection costs one pass over what it reads or
+ * writes and no copy.
+ * */
+
+#include <BtDefs.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+class BtRc4 {
+public:
+    /* MSE drops the first 1 KiB of keystream */
+    static const int Discard = 1024;
+
+    BtRc4();
+
+    /* Key it, then drop discard bytes of keystream */
+    void setKey(const char *key, int size, int discard = Discard);
+    bool isKeyed() const;
+
+    /* XOR keystream into data, encrypting and decrypting are the same */
+    void apply(char *data, int size);
+    /* Go past size bytes of keystream, e.g. of padding we don't read */
+    void skip(int size);
+
+private:
+    quint8 s[256];
+    quint8 i;
+    quint8 j;
+    bool keyed;
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTRC4_H__
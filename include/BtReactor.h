@@ -0,0 +1,148 @@
+#pragma once
+
+#ifndef __BTREACTOR_H__
+#define __BTREACTOR_H__
+
+/* This is an implementation of worker threads running the swarms */
+
+/* One event loop is enough for a few hundred sockets, not for thousands
+ * of them moving 10Gb/s. BtReactor runs N worker threads, each with its
+ * own event loop, and torrents are sharded across them: a BtSwarm, with
+ * its listening socket, its connections and its storage, is moved to
+ * one worker and lives there until it's deleted. Everything a swarm
+ * shares is per torrent, so workers never touch each other's state and
+ * nothing in the data path takes a lock.
+ *
+ * Other threads talk to a swarm only by posting functions to its worker.
+ * Posted functions go through a lock-free queue, many producers and the
+ * worker as its only consumer, and run in order on the worker's event
+ * loop. The worker is woken up once per batch: only the post that finds
+ * the queue idle wakes it, later ones join the same drain.
+ *
+ * What other threads read of a swarm (counters) is kept in atomics.
+ *
+ * Every worker has one timer firing once a second, for swarms to tick on
+ * instead of a timer each.
+ * */
+
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+
+#include <atomic>
+#include <functional>
+
+#include <BtDefs.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+/* Lock-free queue, any thread pushes and a single thread pops (Vyukov).
+ * The queue always holds a dummy node, a popped value moves out of the
+ * node after the dummy, and that node becomes the next dummy. */
+template <typename T>
+class BtMpscQueue {
+public:
+    BtMpscQueue() : head(new Node), tail(head.load()) {}
+    ~BtMpscQueue()
+    {
+        T value;
+        while(pop(value));
+        delete tail;
+    }
+
+    void push(T value)
+    {
+        Node *node = new Node;
+        node->value = std::move(value);
+        Node *prev = head.exchange(node, std::memory_order_acq_rel);
+        /* Until this store, pop() sees the queue end at prev */
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    /* Consumer only, false if empty (or a push is halfway) */
+    bool pop(T &value)
+    {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if(!next) return false;
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+private:
+    struct Node {
+        Node() : next(nullptr) {}
+        std::atomic<Node *> next;
+        T value;
+    };
+
+    std::atomic<Node *> head;
+    Node *tail;
+
+    BtMpscQueue(BtMpscQueue const &) = delete;
+    BtMpscQueue &operator=(BtMpscQueue const &) = delete;
+};
+
+/* Lives in its thread, runs what is posted to it */
+class BtReactorWorker : public QObject {
+    Q_OBJECT
+
+public:
+    BtReactorWorker();
+
+    /* From any thread */
+    void post(std::function<void()>);
+
+    /* Objects attached to this worker */
+    std::atomic<int> load;
+    /* Started on the worker's thread */
+    QTimer ticker;
+
+private slots:
+    void drain();
+
+private:
+    BtMpscQueue<std::function<void()>> tasks;
+    /* A drain is queued on the event loop and has not started yet */
+    std::atomic<bool> scheduled;
+};
+
+class BtReactor : public QObject {
+    Q_OBJECT
+
+public:
+    static const int TickMs = 1000;
+
+    /* threads <= 0 is one per core */
+    explicit BtReactor(int threads = 0, QObject *parent = 0);
+    /* Stops the workers, objects still attached must be gone by then */
+    ~BtReactor();
+
+    /* Reactor shared by all torrents of this process */
+    static BtReactor *shared();
+
+    int threadCount() const;
+    QThread *workerThread(int worker) const;
+    /* Fires every TickMs on the worker's thread */
+    QTimer *ticker(int worker) const;
+    /* Move object, with its children, to the least loaded worker.
+     * Call it from the thread object lives in, return the worker. */
+    int attach(QObject *);
+    /* Object of the worker is deleted, or moved away */
+    void detach(int worker);
+
+    /* Run function on the worker's thread later, in order of posting */
+    void post(int worker, std::function<void()>);
+    /* Run function on the worker's thread and wait for it. On the worker
+     * itself it runs at once, before anything posted earlier. */
+    void run(int worker, std::function<void()>);
+
+private:
+    QVector<QThread *> threads;
+    QVector<BtReactorWorker *> workers;
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTREACTOR_H__
@@ -0,0 +1,137 @@
+#pragma once
+
+#ifndef __BTSESSION_H__
+#define __BTSESSION_H__
+
+/* This is an implementation of a session running many torrents */
+
+/* A BtCore on its own has a peer id, a listening port, a timer and
+ * a connection limit of its own. BtSession owns many torrents and
+ * shares everything that is not per torrent among them:
+ *
+ * - one peer id and one listening port, incoming peers are routed to
+ *   torrents by BtListener
+ * - one announce scheduler, announces to a tracker are coalesced across
+ *   torrents
+ * - one BtReactor, whose worker threads run the swarms and do their disk
+ *   I/O, each ticking its swarms on one timer
+ * - one connection limit over all swarms
+ * - one upload and one download rate limit over all swarms, torrents and
+ *   peers may have lower limits of their own
+ *
+ * Shutting down stops every torrent at once: swarms flush their files on
+ * their own workers, and the stopped announces go out together.
+ * shutdownFinished() follows once all of them are done,
+ * BtCore::StopAnnounceTimeoutMs at most however many torrents there are.
+ * Nothing blocks meanwhile, the event loop keeps running.
+ *
+ * What is left per torrent is its metainfo, pieces, tracker state and the
+ * connections it actually has. A stopped torrent has no socket and no
+ * timer, and its files are only opened once it's started.
+ * */
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QHostAddress>
+
+#include <BtDefs.h>
+#include <BtTorrent.h>
+#include <BtCore.h>
+#include <BtAnnounce.h>
+#include <BtReactor.h>
+#include <BtListener.h>
+#include <BtSwarm.h>
+#include <BtTokenBucket.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+class BtSession : public QObject {
+    Q_OBJECT
+
+public:
+    static const int DefaultMaxConnections = 500;
+
+    /* threads <= 0 is one worker per core */
+    explicit BtSession(quint16 listenPort, int threads = 0, QObject *parent = 0);
+    /* Torrents are deleted at once, stopped announces still going are
+     * dropped. Call shutdown() and wait for shutdownFinished() first. */
+    ~BtSession();
+
+    /* Stop every torrent, shutdownFinished() is emitted once their stopped
+     * announces are done. Incoming peers are refused from now on. */
+    void shutdown();
+
+    bool isListening() const;
+    quint16 port() const;
+    QByteArray peerId() const;
+
+    /* Settings of torrents added from now on */
+    void setDownloadDirectory(QString const &);
+    QString downloadDirectory() const;
+    /* Incoming peers follow it at once */
+    void setEncryptionPolicy(BtEncryptionPolicy);
+    BtEncryptionPolicy encryptionPolicy() const;
+    /* All torrents together */
+    void setMaxConnections(int);
+    int maxConnections() const;
+    int connectionCount() const;
+    /* Bytes a second of all torrents together, 0 is unlimited */
+    void setUploadRateLimit(qint64);
+    qint64 uploadRateLimit() const;
+    void setDownloadRateLimit(qint64);
+    qint64 downloadRateLimit() const;
+
+    /* Torrent is copied. Return 0 if it's added already, or is still
+     * being removed. */
+    BtCore *addTorrent(BtTorrent const &);
+    BtCore *torrent(QByteArray const &infoHash) const;
+    QList<BtCore *> torrents() const;
+    int torrentCount() const;
+    /* Stop it, it's deleted once trackers are told */
+    void removeTorrent(QByteArray const &infoHash);
+
+    /* What torrents share */
+    BtListener *listener();
+    BtAnnounceScheduler *scheduler();
+    BtReactor *reactor();
+    BtConnectionLimit *connectionLimit();
+    BtTokenBucket *uploadBucket();
+    BtTokenBucket *downloadBucket();
+    void globalAddresses(QHostAddress &ipv4, QHostAddress &ipv6) const;
+
+signals:
+    void shutdownFinished();
+
+private:
+    struct Entry {
+        /* BtCore keeps a reference to it */
+        BtTorrent *torrent;
+        BtCore *core;
+    };
+
+    QByteArray PeerId;
+    QString directory;
+    BtEncryptionPolicy policy;
+    QHostAddress ipv4;
+    QHostAddress ipv6;
+
+    BtReactor Reactor;
+    BtAnnounceScheduler Scheduler;
+    BtListener Listener;
+    BtConnectionLimit limit;
+    BtTokenBucket uploadLimit;
+    BtTokenBucket downloadLimit;
+    QHash<QByteArray, Entry> entries;
+    /* Removed, deleted when their stop is over */
+    QHash<QByteArray, Entry> removing;
+    /* Stops shutdown() waits for */
+    QSet<BtCore *> waiting;
+
+    /* Called by every core we own, out of its call stack */
+    void coreStopped(BtCore *);
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTSESSION_H__
@@ -0,0 +1,115 @@
+#pragma once
+
+#ifndef __BTSTORAGE_H__
+#define __BTSTORAGE_H__
+
+/* This is an implementation of torrent data storage */
+
+/* Pieces are cut from the concatenation of all files of a torrent, so one
+ * block may start in a file and end in the next one.
+ *
+ * For sending, BtStorage maps the pieces asked for into memory
+ * (QFile::map, so it's the page cache itself) and hands out a block as a
+ * few slices of the mappings. Seeding then sends the slices to the socket
+ * as they are, and the data never goes through a buffer of ours. Only a
+ * few pieces are mapped at a time, so a torrent larger than the address
+ * space works too.
+ *
+ * Received blocks are written to the files with plain writes. A full disk
+ * then fails the write, where storing to a mapping would kill the process
+ * with SIGBUS.
+ * */
+
+#include <QFile>
+#include <QString>
+#include <QList>
+#include <QVector>
+
+#include <BtDefs.h>
+#include <BtTorrent.h>
+#include <BtPeerWire.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+class BtStorage {
+public:
+    /* Pieces kept mapped, the least recently used goes first */
+    static const int MappedPieces = 8;
+
+    /* Files go to directory/name for single-file torrents, and to
+     * directory/name/path for multiple-files ones */
+    BtStorage(BtTorrent const &, QString const &directory);
+    ~BtStorage();
+
+    /* Create missing files with their full length, sparse.
+     * Return false if any of them can not be opened. */
+    bool open();
+    /* Write what we wrote back to the disk, and wait for it */
+    void flush();
+    void close();
+    bool isOpen() const;
+    /* Some file had data before open(), so pieces may be there already */
+    bool hadData() const;
+    /* Of every file as it is on disk, -1 for missing ones. Resume data
+     * is good only while they stay the same. */
+    QList<qint64> fileTimes() const;
+
+    int pieceCount() const;
+    /* The last piece is usually shorter */
+    qint64 pieceSize(int index) const;
+
+    /* Slices of mapped files covering the block, at most max of them.
+     * They are good until the next call, which may unmap them.
+     * Return number of slices, -1 if the block is out of range, needs
+     * more than max slices or can not be mapped. */
+    int slices(quint32 index, quint32 begin, int length,
+            BtIoSlice *slices, int max) const;
+    /* Write a block to the files, false if it's not all written */
+    bool writeBlock(quint32 index, quint32 begin, const char *data, int length);
+    /* SHA-1 of a piece as it is in the files, empty if out of range */
+    QByteArray pieceHash(int index) const;
+
+private:
+    struct File {
+        QFile *file;
+        /* Offset in the whole torrent */
+        qint64 offset;
+        qint64 length;
+    };
+
+    /* The part of one file that is in a piece */
+    struct Window {
+        int file;
+        /* Offset in the file */
+        qint64 from;
+        qint64 size;
+        uchar *map;
+    };
+
+    struct MappedPiece {
+        int index;
+        QVector<Window> windows;
+    };
+
+    QVector<File> files;
+    /* Most recently used first */
+    mutable QList<MappedPiece> mapped;
+    QString directory;
+    QString name;
+    qint64 totalLength;
+    qint64 PieceLength;
+    int PieceCount;
+    bool opened;
+    bool existing;
+
+    /* Index of the file containing offset */
+    int fileAt(qint64 offset) const;
+    /* Check block and get its offset in the whole torrent */
+    bool blockOffset(quint32 index, quint32 begin, int length, qint64 &offset) const;
+    /* Mapping of a piece, 0 if it can not be mapped */
+    MappedPiece const *mapPiece(int index) const;
+    void unmap(MappedPiece const &) const;
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTSTORAGE_H__
@@ -0,0 +1,267 @@
+#pragma once
+
+#ifndef __BTSWARM_H__
+#define __BTSWARM_H__
+
+/* This is an implementation of the connection engine of one torrent */
+
+/* BtSwarm owns the connections of a torrent and what they share:
+ *
+ * - storage, the pieces we have and the picker
+ * - pieces being downloaded, block by block. A block is free, requested
+ *   or received, and blocks of a connection that goes away (choked,
+ *   timed out, closed) become free for the next one asking.
+ * - end-game: once every block we lack is requested, a peer asking for
+ *   more gets blocks already requested from others, up to EndgameRequests
+ *   copies of each. The first copy to come wins and the others are
+ *   cancelled, so the last pieces don't wait on the slowest peer.
+ * - BtPeerPool, peers from trackers and PEX we may connect to
+ * - the listening socket for incoming peers, unless a BtListener shared
+ *   by torrents routes them here
+ *
+ * A paused swarm keeps its connections and what it knows of the peers,
+ * but chokes everybody and asks for nothing. Stopping closes the
+ * connections, writes the files back and saves which pieces we have to
+ * a resume file next to them, so the next start() does not hash the
+ * files again (unless they changed on disk since).
+ *
+ * Everything runs on the event loop of the thread the swarm lives in,
+ * usually a BtReactor worker. Only the byte counters may be read from
+ * other threads, anything else has to be posted to the swarm's thread.
+ * Once a second the swarm connects to more candidates (up to the
+ * connection limit, a few at a time), lets BtChoker decide who gets the
+ * upload slots, and lets every connection do its timers.
+ * */
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTimer>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QVector>
+#include <QScopedPointer>
+
+#include <atomic>
+
+#include <BtDefs.h>
+#include <BtTorrent.h>
+#include <BtEndpoint.h>
+#include <BtPieceSet.h>
+#include <BtPicker.h>
+#include <BtStorage.h>
+#include <BtConnection.h>
+#include <BtChoker.h>
+#include <BtTokenBucket.h>
+#include <BtTransferStats.h>
+#include <BtPeerPool.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+/* Connections allowed to swarms together, on whatever thread they are */
+class BtConnectionLimit {
+public:
+    explicit BtConnectionLimit(int maximum);
+
+    void setMaximum(int);
+    int maximum() const;
+    int count() const;
+    /* Take one connection, false if there is none left */
+    bool acquire();
+    void release();
+
+private:
+    std::atomic<int> Maximum;
+    std::atomic<int> Count;
+};
+
+class BtSwarm : public QObject {
+    Q_OBJECT
+
+public:
+    static const int TickMs = 1000;
+    static const int DefaultMaxConnections = 50;
+    /* New outgoing connections a tick */
+    static const int ConnectsPerTick = 8;
+    /* Requests of one block outstanding at once, in end-game */
+    static const int EndgameRequests = 3;
+    /* Connections out of tokens try again this much later */
+    static const int BandwidthRetryMs = 50;
+
+    BtSwarm(BtTorrent const &, QByteArray const &peerId, quint16 listenPort,
+            QObject *parent = 0);
+    ~BtSwarm();
+
+    /* Where the files go, before start() */
+    void setDirectory(QString const &);
+    void setMaxConnections(int);
+    int maxConnections() const;
+    void setUploadSlots(int);
+    int uploadSlots() const;
+    void setEncryptionPolicy(BtEncryptionPolicy);
+    BtEncryptionPolicy encryptionPolicy() const;
+    /* Listen on listenPort by ourselves, on by default. Off when peers
+     * come from a BtListener through acceptIncoming(). */
+    void setListening(bool);
+    /* Shared with other swarms, before start() */
+    void setConnectionLimit(BtConnectionLimit *);
+    /* Tick on a timer of our thread shared with other swarms, instead of
+     * our own one */
+    void setTicker(QTimer *);
+    /* Bytes a second, 0 is unlimited. Buckets of the torrent take from
+     * parent ones (the session's) if given, and every connection has
+     * buckets of its own taking from the torrent's. */
+    void setRateLimits(qint64 upload, qint64 download);
+    void setPeerRateLimits(qint64 upload, qint64 download);
+    void setParentBuckets(BtTokenBucket *upload, BtTokenBucket *download);
+    /* On by default, off is for measuring what it gives */
+    void setEndgame(bool);
+    bool isEndgame() const;
+
+    /* Open storage, find pieces we have, listen and start connecting.
+     * Return false if storage can not be opened. */
+    bool start();
+    /* Close every connection and stop listening, flush and close the
+     * storage and save resume data */
+    void stop();
+    bool isRunning() const;
+    /* Choke everybody and stop requesting, connections stay */
+    void pause();
+    void resume();
+    bool isPaused() const;
+
+    /* Peers to connect to, connected ones are skipped */
+    void addCandidates(QVector<BtPeerEndpoint> const &, BtPeerSource);
+    /* Socket from BtListener, already in our thread */
+    void acceptIncoming(QTcpSocket *, BtStreamStart const &);
+    int candidateCount() const;
+    int connectionCount() const;
+
+    BtPieceSet const &pieces() const;
+    bool isComplete() const;
+    /* Bytes of blocks, from any thread */
+    qint64 downloaded() const;
+    qint64 uploaded() const;
+    /* Bytes of pieces we don't have, from any thread. It's the whole
+     * torrent until start() has checked the files. */
+    qint64 left() const;
+    /* Sum of every connection's, ticked by the swarm */
+    BtTransferStats &transferStats();
+
+    /* What connections ask for */
+    BtTorrent const &torrent() const;
+    QByteArray infoHash() const;
+    QByteArray peerId() const;
+    quint16 listenPort() const;
+    BtStorage &storage();
+    /* Listen endpoints of active connections, refreshed every tick */
+    QVector<BtPeerEndpoint> const &connectedEndpoints() const;
+    BtTokenBucket &uploadBucket();
+    BtTokenBucket &downloadBucket();
+    qint64 peerUploadRate() const;
+    qint64 peerDownloadRate() const;
+
+    /* What connections report */
+    /* Handshake is done, return false to drop the connection */
+    bool connectionReady(BtConnection *);
+    void connectionClosed(BtConnection *);
+    void peerHas(BtConnection *, int index);
+    void peerInterested(BtConnection *);
+    /* Bitfield or have all */
+    void peerHasPieces(BtConnection *);
+    /* Next block to request from the connection, false if none */
+    bool nextBlock(BtConnection *, BtBlockRequest &);
+    /* False if the block is not one we wait for, or can not be written */
+    bool blockReceived(BtConnection *, BtBlockView const &);
+    /* Requests that will not be answered, blocks are free again */
+    void blocksReturned(QVector<BtBlockRequest> const &);
+    /* Out of tokens, call bandwidthAvailable() a bit later */
+    void waitForBandwidth(BtConnection *);
+
+signals:
+    void pieceCompleted(int index);
+    void finished();
+
+private:
+    enum BlockState : quint8 {
+        BlockFree,
+        BlockRequested,
+        BlockReceived
+    };
+    struct Partial {
+        QVector<quint8> blocks;
+        /* Connections a requested block is requested from */
+        QVector<quint8> copies;
+        int requested;
+        int received;
+    };
+
+    BtTorrent const &Torrent;
+    QByteArray InfoHash;
+    QList<QByteArray> hashes;
+    QByteArray PeerId;
+    quint16 ListenPort;
+    QString directory;
+    int MaxConnections;
+    BtConnectionLimit *limit;
+    BtEncryptionPolicy policy;
+    bool listening;
+    bool running;
+    bool paused;
+    bool endgame;
+
+    QScopedPointer<BtStorage> Storage;
+    BtPieceSet Pieces;
+    BtPicker picker;
+    QHash<int, Partial> partials;
+    /* Connections counted by the picker as seeds */
+    QSet<BtConnection *> seeds;
+    BtChoker choker;
+    BtTokenBucket uploadLimit;
+    BtTokenBucket downloadLimit;
+    qint64 peerUpload;
+    qint64 peerDownload;
+
+    /* Children, they move to the swarm's thread with it */
+    QTcpServer server;
+    QTimer timer;
+    bool sharedTicker;
+    /* Single shot, only while some connection waits for tokens */
+    QTimer bandwidthTimer;
+    QSet<BtConnection *> throttled;
+    QList<BtConnection *> connections;
+    /* Every connection, connecting ones too, by where we connected */
+    QHash<BtPeerEndpoint, BtConnection *> byEndpoint;
+    QVector<BtPeerEndpoint> Connected;
+
+    BtPeerPool pool;
+
+    BtTransferStats stats;
+    std::atomic<qint64> Left;
+
+    void tick();
+    void retryThrottled();
+    void acceptConnections();
+    void connectCandidates();
+    /* Room for one more connection, taken from limit too */
+    bool admit();
+    void checkPieces();
+    /* Pieces we have, from the resume file, false if it's not there or
+     * the files changed. It's removed once read, a crash checks again. */
+    bool loadResume();
+    void saveResume();
+    QString resumePath() const;
+    /* A piece we have is verified, by hash or by resume data */
+    void havePiece(int index);
+    void pieceDone(int index);
+    void updateInterest(BtConnection *);
+    int blockCount(int index) const;
+    /* Every block we lack is requested from somebody */
+    bool allRequested() const;
+    /* Block already requested from others, for end-game */
+    bool duplicateBlock(BtConnection *, BtBlockRequest &);
+    void setRequest(BtBlockRequest &, int index, int block) const;
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTSWARM_H__
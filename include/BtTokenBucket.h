@@ -0,0 +1,79 @@
+#pragma once
+
+#ifndef __BTTOKENBUCKET_H__
+#define __BTTOKENBUCKET_H__
+
+/* This is an implementation of hierarchical token buckets */
+
+/* A bucket fills up at its rate (bytes a second), up to half a second of
+ * it, and bytes are sent or read only with tokens taken out of it.
+ * Buckets form a tree, global -> torrent -> peer, and taking from a
+ * bucket takes as much from every bucket above it, so the tightest
+ * one on the way wins.
+ *
+ * Buckets are refilled lazily from a clock when tokens are taken, no
+ * timer runs for them. The global bucket is taken from by every worker
+ * thread, so tokens are atomics and nothing is locked.
+ *
+ * Taking costs a few atomics per level, so connections take a grant of
+ * at least Grant bytes at a time and spend it on many messages.
+ * */
+
+#include <QElapsedTimer>
+
+#include <atomic>
+
+#include <BtDefs.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+class BtTokenBucket {
+public:
+    /* Smallest grant worth taking */
+    static const int Grant = 1 << 14;
+    /* Tokens kept, in ms of the rate */
+    static const int BurstMs = 500;
+    /* Refilling more often gives nothing but rounding */
+    static const int RefillMs = 5;
+
+    explicit BtTokenBucket(BtTokenBucket *parent = 0);
+
+    void setParent(BtTokenBucket *);
+    BtTokenBucket *parent() const;
+    /* Bytes a second, 0 is unlimited */
+    void setRate(qint64);
+    qint64 rate() const;
+
+    /* Take up to n tokens from this bucket and the ones above it, return
+     * how many are taken */
+    qint64 take(qint64 n);
+
+private:
+    BtTokenBucket *Parent;
+    std::atomic<qint64> Rate;
+    std::atomic<qint64> tokens;
+    /* ms of clock */
+    std::atomic<qint64> refilled;
+    QElapsedTimer clock;
+
+    void refill(qint64 rate);
+};
+
+/* Tokens of a connection in one direction, taken a grant at a time */
+class BtBandwidth {
+public:
+    BtBandwidth();
+
+    BtTokenBucket &bucket();
+    /* Spend n bytes, false if there are not enough tokens yet */
+    bool spend(qint64 n);
+    /* How many of n bytes can be spent now, up to n, they are spent */
+    qint64 spendUpTo(qint64 n);
+
+private:
+    BtTokenBucket Bucket;
+    qint64 quota;
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTTOKENBUCKET_H__
@@ -144,6 +144,8 @@ public:
     QString name() const;
     qint64 pieceLength() const;
     QList<QByteArray> pieces() const;
+    /* Number of pieces, without building the list of hashes */
+    int pieceCount() const;
     /* When it's a single-file torrent, return empty QList
      * else return with files
      * */
@@ -159,6 +161,9 @@ public:
      * and return -1 when type is int, false when bool
      * */
     QList<QString> announceList() const;
+    /* Tiers of 'announce-list', see BEP 12.
+     * When there's no 'announce-list', it's a single tier of 'announce' */
+    QList<QList<QString>> announceTiers() const;
     bool isPrivate() const;
     QList<QString> httpseeds() const;
     /* For DHT */
@@ -68,6 +68,9 @@
  * - trackerid: Optional. If a previous announce contained a tracker id, it
  *   should be set here.
  *
+ * - ipv4, ipv6: Optional, BEP 7. Our IPv4 or IPv6 address, when the tracker
+ *   can't see it because we announce over the other address family.
+ *
  * no_peer_id, compact, numwant is under consideration.
  */
 
@@ -77,6 +80,11 @@
 #include <QHostAddress>
 #include <QNetworkRequest>
 #include <QUrl>
+#include <QObject>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QVector>
+#include <BtEndpoint.h>
 
 NAMESPACE_BEGIN(BtQt)
 /* Download event */
@@ -116,14 +124,21 @@ private:
     bool compact;
     bool no_peer_id;
     int numwant;
+    QByteArray key;
+    /* BEP 7, our addresses of the other family, so that a tracker reached
+     * over one family can hand us out over both */
+    QHostAddress ipv4;
+    QHostAddress ipv6;
 
 
-    /* This request will be built when first toRequestData is called!
-     * Every time new data setted, this request will be cleared.
-     * Next time toRequest called, it will be generated automatically.
+    /* The request is announced again and again with only uploaded,
+     * downloaded, left and event changed. Everything else is percent-encoded
+     * into this prefix when first toRequestData is called, and it's cleared
+     * only when one of them is setted.
+     * The changing fields are formatted on the stack for every request.
      * */
-    QByteArray requestData;
-    bool requestDataGenerated;
+    QByteArray requestPrefix;
+    bool requestPrefixGenerated;
 public:
     BtTrackerRequest();
     /* ip is optional, so it's the default value of QHostAddress when not
@@ -143,6 +158,9 @@ public:
     void setCompact(bool);
     void setNoPeerId(bool);
     void setNumwant(int);
+    void setKey(QByteArray const &);
+    void setIPv4(QHostAddress const &);
+    void setIPv6(QHostAddress const &);
 
     /* I think it's not necessary to expose all data to access. */
     QByteArray getInfoHash() const;
@@ -152,6 +170,9 @@ public:
     bool isCompact() const;
     bool isNoPeerId() const;
     int getNumwant() const;
+    QByteArray getKey() const;
+    QHostAddress getIPv4() const;
+    QHostAddress getIPv6() const;
 
 #ifndef QT_NO_DEBUG
     /* display what is in this request */
@@ -160,9 +181,15 @@ public:
 
     /* Get request consists of info_hash, peer_id, ip, port, uploaded,
      * downloaded, left and event */
-    const QByteArray& toRequestData() const;
+    QByteArray toRequestData() const;
 };
 
+/* Provide a function to generate the 'key' of tracker requests, never fails.
+ * It's 8 random hexadecimal digits, generated once for a torrent.
+ * Don't forget to do qsrand() before call this function.
+ * */
+QByteArray generateTrackerKey();
+
 /* Provide a function to send request to the tracker server
  * It will throw exceptions when error following errors occured:
  * - Socket connect failed
@@ -171,6 +198,60 @@ public:
  * */
 QByteArray sendTrackerRequest(BtTrackerRequest const &, QUrl trackerUrl);
 
+/* Asynchronous version of sendTrackerRequest.
+ * It never blocks, so many announces can be in flight at the same time on
+ * one event loop. Either finished() or failed() is emitted exactly once,
+ * unless abort() is called first.
+ * */
+class BtHttpAnnounce : public QObject {
+    Q_OBJECT
+
+public:
+    /* query is BtTrackerRequest::toRequestData(), so that one request
+     * sent to many trackers is only built once */
+    BtHttpAnnounce(QByteArray const &query, QUrl const &trackerUrl,
+            QObject *parent = 0);
+    ~BtHttpAnnounce();
+
+    /* Connect over this address family only, AnyIPProtocol by default */
+    void setProtocol(QAbstractSocket::NetworkLayerProtocol);
+    QAbstractSocket::NetworkLayerProtocol protocol() const;
+
+    /* Give up if there's no complete reply in timeout ms */
+    void start(int timeout = 15000);
+    /* Close the connection silently */
+    void abort();
+
+    QUrl url() const;
+    bool isRunning() const;
+
+signals:
+    /* reply is the body of HTTP reply */
+    void finished(QByteArray const &reply);
+    void failed();
+
+private slots:
+    void connected();
+    void readyRead();
+    void disconnected();
+    void socketError(QAbstractSocket::SocketError);
+    void timeout();
+
+private:
+    QByteArray query;
+    QUrl trackerUrl;
+    QTcpSocket socket;
+    QTimer timer;
+    QByteArray reply;
+    QAbstractSocket::NetworkLayerProtocol family;
+    bool running;
+
+    /* Emit finished() if reply is complete, or failed() if closed is true
+     * and the reply is still not complete */
+    void checkReply(bool closed);
+    void fail();
+};
+
 NAMESPACE_END(BtQt)
 
 /* There some facts of tracker response:
@@ -211,6 +292,10 @@ NAMESPACE_END(BtQt)
  *   bytes. First 4 bytes are the IP address and last 2 bytes are the port
  *   number. All in network (big endian) notation.
  *
+ * - peers6: (binary model, BEP 7) Same as above for IPv6, a string
+ *   consisting of multiples of 18 bytes, 16 bytes of IP address and 2 bytes
+ *   of port number.
+ *
  * Implementer's Note: Even 30 peers is plenty, the official client version
  * 3 in fact only actively forms new connections if it has less than 30
  * peers and will refuse connections if it has 55. This value is important
@@ -226,10 +311,21 @@ NAMESPACE_END(BtQt)
 
 NAMESPACE_BEGIN(BtQt)
 
+class BtTrackerResponse;
+
 /* Provide a function to deal with the response received from tracker server
  * It will throw exceptions when error following errors occured
+ * - The response is not a bencoded dictionary
+ * - A value has an unexpected type, or the data is truncated
+ *
+ * The response is parsed in a single pass straight into BtTrackerResponse,
+ * no QVariant or QMap is built on the way. Keys may come in any order,
+ * unknown keys are skipped. Peers may be:
+ * - compact 'peers' (6 bytes each, BEP 23)
+ * - compact 'peers6' (18 bytes each, BEP 7)
+ * - dictionary model 'peers', peers with a DNS name are ignored
  * */
-QMap<QString, QVariant> parseTrackerResponse(QByteArray const &);
+BtTrackerResponse parseTrackerResponse(QByteArray const &);
 
 class BtTrackerResponse {
 private:
@@ -239,14 +335,18 @@ private:
     QByteArray TrackerId;
     int Complete;
     int InComplete;
-    QList<QMap<QString, QVariant>> Peers;
+    /* Peers of both families in one packed vector */
+    QVector<BtPeerEndpoint> Peers;
     /* Optional */
     int MinInterval;
     QString failureReason;
     QString warningMessage;
 
+    friend BtTrackerResponse parseTrackerResponse(QByteArray const &);
+
 public:
-    BtTrackerResponse(QMap<QString, QVariant> const &);
+    /* An empty response */
+    BtTrackerResponse();
 
     /* Methods */
     /* All functions will return empty value(int: -1, bool: false)
@@ -256,7 +356,7 @@ public:
     QByteArray trackerId() const;
     int complete() const;
     int incomplete() const;
-    auto peers()->decltype(Peers) const;
+    QVector<BtPeerEndpoint> const &peers() const;
     int minInterval() const;
 
     /* Show if there's error.
@@ -266,6 +366,10 @@ public:
     bool warned(QString &warning) const;
 
     bool isEmpty() const;
+
+    /* Take peers of another response of the same tracker, e.g. the one
+     * got over the other address family */
+    void mergePeers(BtTrackerResponse const &);
 #ifndef QT_NO_DEBUG
     /* display what is in this request */
     void display() const;
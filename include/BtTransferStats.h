@@ -0,0 +1,80 @@
+#pragma once
+
+#ifndef __BTTRANSFERSTATS_H__
+#define __BTTRANSFERSTATS_H__
+
+/* This is an implementation of byte counters and transfer rates */
+
+/* Bytes are counted in each direction twice:
+ *
+ * - payload, the data of blocks, what trackers and the choker want
+ * - wire, everything read from or written to the socket, MSE and
+ *   message headers included
+ *
+ * Protocol bytes are wire minus payload. A connection counts into its
+ * own counters and they add to the torrent's too, so the torrent is
+ * always the sum of its connections, closed ones included.
+ *
+ * Counters are relaxed atomics. They are only added to by the thread
+ * running the connections, any thread may read them and nothing waits.
+ *
+ * tick() once a second turns what was added since the last tick into
+ * a rate, smoothed exponentially: each second weighs 1/SmoothingTicks,
+ * so about the last 20 seconds count, as the original client averaged
+ * over. Until SmoothingTicks seconds have passed the rate is the plain
+ * average, so it does not start from zero.
+ * */
+
+#include <QtGlobal>
+
+#include <atomic>
+
+#include <BtDefs.h>
+
+NAMESPACE_BEGIN(BtQt)
+
+class BtTransferStats {
+public:
+    enum Counter {
+        PayloadDownload,
+        WireDownload,
+        PayloadUpload,
+        WireUpload,
+        CounterCount
+    };
+
+    static const int SmoothingTicks = 20;
+
+    explicit BtTransferStats(BtTransferStats *parent = 0);
+
+    void setParent(BtTransferStats *);
+    /* Added to parent too */
+    void add(Counter, qint64 bytes);
+    /* On the thread adding, once a second, parent is not ticked */
+    void tick();
+    /* On the same thread, when ticks stop: rates drop to 0 and are
+     * smoothed from scratch once ticks start again */
+    void clearRates();
+
+    /* From any thread */
+    qint64 total(Counter) const;
+    /* Bytes per second */
+    qint64 rate(Counter) const;
+    /* Wire bytes that are not payload */
+    qint64 protocolDownloaded() const;
+    qint64 protocolUploaded() const;
+
+private:
+    BtTransferStats *Parent;
+    std::atomic<qint64> totals[CounterCount];
+    std::atomic<qint64> rates[CounterCount];
+    /* Of the thread ticking */
+    qint64 lastTotals[CounterCount];
+    int ticks;
+
+    BtTransferStats(BtTransferStats const &) = delete;
+    BtTransferStats &operator=(BtTransferStats const &) = delete;
+};
+NAMESPACE_END(BtQt)
+
+#endif // __BTTRANSFERSTATS_H__
@@ -0,0 +1,558 @@
+#include <BtAnnounce.h>
+#include <BtDebug.h>
+#include <QCoreApplication>
+#include <QDebug>
+
+#include <algorithm>
+
+using namespace BtQt;
+
+const int BtAnnounceScheduler::TickMs;
+const int BtAnnounceScheduler::WheelSize;
+const int BtAnnounceScheduler::DefaultInterval;
+const int BtAnnounceScheduler::BackoffBase;
+const int BtAnnounceScheduler::BackoffMax;
+
+/* Seconds to ticks of the wheel */
+static inline qint64 secondsToTicks(qint64 seconds)
+{
+    return seconds * 1000 / BtAnnounceScheduler::TickMs;
+}
+
+/* Random value in [0, range) */
+static inline qint64 jitter(qint64 range)
+{
+    if(range <= 0) return 0;
+    return qrand() % range;
+}
+
+BtAnnounceScheduler::BtAnnounceScheduler(QObject *parent)
+    : QObject(parent), linked(0), lastTick(0), StartSpread(5), Wakeups(0)
+{
+    wheel.fill(-1, WheelSize);
+    slotSize.fill(0, WheelSize);
+
+    timer.setSingleShot(true);
+    timer.setTimerType(Qt::CoarseTimer);
+    connect(&timer, &QTimer::timeout, this, &BtAnnounceScheduler::tick);
+    clock.start();
+}
+
+BtAnnounceScheduler::~BtAnnounceScheduler()
+{
+    timer.stop();
+}
+
+BtAnnounceScheduler *BtAnnounceScheduler::shared()
+{
+    /* Parented to the application, so it goes away with the event loop */
+    static BtAnnounceScheduler *scheduler =
+        new BtAnnounceScheduler(QCoreApplication::instance());
+    return scheduler;
+}
+
+qint64 BtAnnounceScheduler::currentTick() const
+{
+    return clock.elapsed() / TickMs;
+}
+
+int BtAnnounceScheduler::jobFor(BtAnnounceTarget *target, QString const &tracker)
+{
+    int idx = jobIndex.value(JobKey(target, tracker), -1);
+    if(idx != -1) return idx;
+
+    if(!freeJobs.isEmpty()) {
+        idx = freeJobs.takeLast();
+    } else {
+        idx = jobs.size();
+        jobs.append(Job());
+    }
+
+    Job &job = jobs[idx];
+    job.target = target;
+    job.tracker = tracker;
+    job.event = BtTrackerDownloadEvent::empty;
+    job.due = 0;
+    job.prev = job.next = -1;
+    job.inWheel = false;
+    job.inUse = true;
+
+    jobIndex.insert(JobKey(target, tracker), idx);
+    targetTrackers[target].append(tracker);
+    return idx;
+}
+
+void BtAnnounceScheduler::releaseJob(int idx)
+{
+    Job &job = jobs[idx];
+    if(job.inWheel) unlink(idx);
+
+    jobIndex.remove(JobKey(job.target, job.tracker));
+    auto it = targetTrackers.find(job.target);
+    if(it != targetTrackers.end()) {
+        it.value().removeOne(job.tracker);
+        if(it.value().isEmpty()) targetTrackers.erase(it);
+    }
+
+    job.inUse = false;
+    job.target = 0;
+    job.tracker.clear();
+    freeJobs.append(idx);
+}
+
+void BtAnnounceScheduler::link(int idx, qint64 due)
+{
+    /* Nothing is in the wheel, so no slot is waiting to be processed.
+     * Move the hand to now to avoid catching up on empty slots. */
+    if(linked == 0) lastTick = qMax(lastTick, currentTick() - 1);
+    /* Slots up to lastTick have been processed */
+    if(due <= lastTick) due = lastTick + 1;
+
+    Job &job = jobs[idx];
+    Q_ASSERT(!job.inWheel);
+    int slot = due % WheelSize;
+
+    job.due = due;
+    job.prev = -1;
+    job.next = wheel[slot];
+    if(job.next != -1) jobs[job.next].prev = idx;
+    wheel[slot] = idx;
+    ++ slotSize[slot];
+    ++ linked;
+    job.inWheel = true;
+
+    ++ trackers[job.tracker].dueTicks[due];
+}
+
+void BtAnnounceScheduler::unlink(int idx)
+{
+    Job &job = jobs[idx];
+    Q_ASSERT(job.inWheel);
+    int slot = job.due % WheelSize;
+
+    if(job.prev != -1) jobs[job.prev].next = job.next;
+    else wheel[slot] = job.next;
+    if(job.next != -1) jobs[job.next].prev = job.prev;
+    job.prev = job.next = -1;
+    -- slotSize[slot];
+    -- linked;
+    job.inWheel = false;
+
+    auto state = trackers.find(job.tracker);
+    if(state != trackers.end()) {
+        auto count = state.value().dueTicks.find(job.due);
+        if(count != state.value().dueTicks.end() && -- count.value() <= 0) {
+            state.value().dueTicks.erase(count);
+        }
+    }
+}
+
+qint64 BtAnnounceScheduler::coalesce(QString const &tracker, qint64 earliest,
+        qint64 latest) const
+{
+    auto state = trackers.constFind(tracker);
+    if(state != trackers.constEnd()) {
+        /* Nearest announce to this tracker not before earliest */
+        auto it = state.value().dueTicks.lowerBound(earliest);
+        if(it != state.value().dueTicks.constEnd() && it.key() <= latest)
+            return it.key();
+    }
+    return latest;
+}
+
+void BtAnnounceScheduler::arm()
+{
+    /* Wake up for the nearest non-empty slot only */
+    for(qint64 t = lastTick + 1; t <= lastTick + WheelSize; ++ t) {
+        if(slotSize[t % WheelSize] == 0) continue;
+
+        qint64 ms = t * TickMs - clock.elapsed();
+        timer.start(int(qMax<qint64>(ms, 0)));
+        return;
+    }
+    timer.stop();
+}
+
+void BtAnnounceScheduler::add(BtAnnounceTarget *target, QUrl const &trackerUrl,
+        BtTrackerDownloadEvent event)
+{
+    QString tracker = trackerUrl.toString();
+    int idx = jobFor(target, tracker);
+    if(jobs[idx].inWheel) unlink(idx);
+    jobs[idx].event = event;
+
+    qint64 now = currentTick();
+    qint64 earliest = qMax(now, trackers.value(tracker).blockedUntil);
+    qint64 latest = earliest + jitter(secondsToTicks(StartSpread));
+
+    link(idx, coalesce(tracker, earliest, latest));
+    arm();
+}
+
+void BtAnnounceScheduler::announceNow(BtAnnounceTarget *target,
+        QUrl const &trackerUrl, BtTrackerDownloadEvent event)
+{
+    int idx = jobFor(target, trackerUrl.toString());
+    if(jobs[idx].inWheel) unlink(idx);
+    jobs[idx].event = event;
+
+    link(idx, currentTick());
+    arm();
+}
+
+void BtAnnounceScheduler::remove(BtAnnounceTarget *target)
+{
+    /* Copy, releaseJob() modifies the list */
+    QList<QString> trackerList = targetTrackers.value(target);
+    for(auto tracker : trackerList) {
+        int idx = jobIndex.value(JobKey(target, tracker), -1);
+        if(idx != -1) releaseJob(idx);
+    }
+    arm();
+}
+
+void BtAnnounceScheduler::remove(BtAnnounceTarget *target,
+        QUrl const &trackerUrl)
+{
+    int idx = jobIndex.value(JobKey(target, trackerUrl.toString()), -1);
+    if(idx == -1) return;
+    releaseJob(idx);
+    arm();
+}
+
+void BtAnnounceScheduler::announced(BtAnnounceTarget *target,
+        QUrl const &trackerUrl, BtTrackerResponse const &response)
+{
+    QString tracker = trackerUrl.toString();
+    int idx = jobIndex.value(JobKey(target, tracker), -1);
+    /* Removed while in flight */
+    if(idx == -1) return;
+
+    TrackerState &state = trackers[tracker];
+    state.failures = 0;
+    state.blockedUntil = 0;
+
+    if(jobs[idx].event == BtTrackerDownloadEvent::stopped) {
+        releaseJob(idx);
+        arm();
+        return;
+    }
+    if(jobs[idx].inWheel) unlink(idx);
+    jobs[idx].event = BtTrackerDownloadEvent::empty;
+
+    qint64 interval = response.interval() > 0 ?
+        response.interval() : DefaultInterval;
+    qint64 minInterval = response.minInterval() > 0 ?
+        qMin<qint64>(response.minInterval(), interval) : 0;
+
+    /* Allow to be a little early to join another announce to the same
+     * tracker, but never earlier than min interval. The jitter makes
+     * torrents started together drift apart in a few rounds. */
+    qint64 now = currentTick();
+    qint64 earliest = now + secondsToTicks(
+            qMax(minInterval, interval - interval / 8));
+    qint64 latest = now + secondsToTicks(interval + jitter(interval / 8 + 1));
+
+    link(idx, coalesce(tracker, earliest, latest));
+    arm();
+}
+
+void BtAnnounceScheduler::announceFailed(BtAnnounceTarget *target,
+        QUrl const &trackerUrl)
+{
+    QString tracker = trackerUrl.toString();
+    int idx = jobIndex.value(JobKey(target, tracker), -1);
+    if(idx == -1) return;
+
+    /* Nobody waits for a 'stopped' that can not be delivered */
+    if(jobs[idx].event == BtTrackerDownloadEvent::stopped) {
+        releaseJob(idx);
+        arm();
+        return;
+    }
+    if(jobs[idx].inWheel) unlink(idx);
+
+    /* Many torrents fail on the same tracker in one burst, count it once */
+    qint64 now = currentTick();
+    TrackerState &state = trackers[tracker];
+    if(now >= state.blockedUntil) {
+        ++ state.failures;
+        qint64 backoff = qMin<qint64>(
+                qint64(BackoffBase) << qMin(state.failures - 1, 16),
+                BackoffMax);
+        state.blockedUntil = now + secondsToTicks(backoff);
+#ifndef QT_NO_DEBUG
+        qDebug() << "Tracker" << tracker << "failed" << state.failures
+            << "times, retry in" << backoff << "seconds";
+#endif // QT_NO_DEBUG
+    }
+
+    qint64 backoff = state.blockedUntil - now;
+    link(idx, coalesce(tracker, state.blockedUntil,
+                state.blockedUntil + jitter(backoff / 4 + 1)));
+    arm();
+}
+
+void BtAnnounceScheduler::tick()
+{
+    ++ Wakeups;
+    qint64 now = currentTick();
+
+    /* Catch up every slot since the last tick, a whole round at most */
+    QVector<int> due;
+    qint64 from = qMax(lastTick + 1, now - WheelSize + 1);
+    for(qint64 t = from; t <= now; ++ t) {
+        int idx = wheel[t % WheelSize];
+        while(idx != -1) {
+            int next = jobs[idx].next;
+            if(jobs[idx].due <= now) {
+                unlink(idx);
+                due.append(idx);
+            }
+            idx = next;
+        }
+    }
+    lastTick = qMax(lastTick, now);
+
+    /* Announces to the same tracker go out back to back */
+    std::sort(due.begin(), due.end(), [this](int a, int b) {
+        return jobs[a].tracker < jobs[b].tracker;
+    });
+
+    /* Targets may report synchronously and reschedule (or remove) jobs,
+     * so take copies before calling out */
+    struct Call {
+        BtAnnounceTarget *target;
+        QString tracker;
+        BtTrackerDownloadEvent event;
+    };
+    QVector<Call> calls;
+    calls.reserve(due.size());
+    for(auto idx : due) {
+        Call c = { jobs[idx].target, jobs[idx].tracker, jobs[idx].event };
+        calls.append(c);
+    }
+
+    QUrl trackerUrl;
+    QString lastTracker;
+    for(auto const &c : calls) {
+        int idx = jobIndex.value(JobKey(c.target, c.tracker), -1);
+        /* Removed or rescheduled by an earlier call */
+        if(idx == -1 || jobs[idx].inWheel) continue;
+
+        if(c.tracker != lastTracker) {
+            trackerUrl = QUrl(c.tracker);
+            lastTracker = c.tracker;
+        }
+        c.target->announce(trackerUrl, c.event);
+    }
+
+    arm();
+}
+
+void BtAnnounceScheduler::setStartSpread(int seconds)
+{
+    StartSpread = qMax(seconds, 0);
+}
+
+int BtAnnounceScheduler::startSpread() const
+{
+    return StartSpread;
+}
+
+int BtAnnounceScheduler::pending() const
+{
+    return jobIndex.size();
+}
+
+quint64 BtAnnounceScheduler::wakeups() const
+{
+    return Wakeups;
+}
+
+BtTierAnnounce::BtTierAnnounce(QObject *parent)
+    : QObject(parent), timeout(15000), currentTier(0), firstTier(0), dualStack(false),
+    won(false), haveFallback(false)
+{
+
+}
+
+BtTierAnnounce::~BtTierAnnounce()
+{
+    cancelRunning();
+}
+
+void BtTierAnnounce::setTiers(QList<QList<QString>> const &tierList)
+{
+    cancelRunning();
+    Tiers.clear();
+    for(auto tier : tierList) {
+        QList<QUrl> urls;
+        for(auto url : tier) {
+            /* Shuffle, as BEP 12 says */
+            urls.insert(urls.isEmpty() ? 0 : qrand() % (urls.size() + 1),
+                    QUrl(url));
+        }
+        Tiers.append(urls);
+    }
+}
+
+QList<QList<QUrl>> BtTierAnnounce::tiers() const
+{
+    return Tiers;
+}
+
+void BtTierAnnounce::setDualStack(bool dualStack)
+{
+    this->dualStack = dualStack;
+}
+
+bool BtTierAnnounce::isDualStack() const
+{
+    return dualStack;
+}
+
+void BtTierAnnounce::start(BtTrackerRequest const &req, int timeout,
+        QUrl const &tracker)
+{
+    cancelRunning();
+    /* Built once, shared by every tracker */
+    query = req.toRequestData();
+    this->timeout = timeout;
+    won = false;
+
+    if(Tiers.isEmpty()) {
+        qDebug() << "There's no tracker to announce to!";
+        emit failed();
+        return;
+    }
+    firstTier = 0;
+    for(int i = 0; i < Tiers.size() && !tracker.isEmpty(); ++ i) {
+        if(Tiers.at(i).contains(tracker)) {
+            firstTier = i;
+            break;
+        }
+    }
+    startTier(firstTier);
+}
+
+void BtTierAnnounce::abort()
+{
+    cancelRunning();
+}
+
+bool BtTierAnnounce::isRunning() const
+{
+    return !running.isEmpty();
+}
+
+void BtTierAnnounce::startTier(int tier)
+{
+    currentTier = tier;
+    haveFallback = false;
+
+    for(auto url : Tiers.at(tier)) {
+        /* An address literal has only one family anyway */
+        QHostAddress literal;
+        bool both = dualStack && !literal.setAddress(url.host());
+        for(int f = 0; f < (both ? 2 : 1); ++ f) {
+            BtHttpAnnounce *a = new BtHttpAnnounce(query, url, this);
+            if(both) {
+                a->setProtocol(f == 0 ? QAbstractSocket::IPv4Protocol
+                        : QAbstractSocket::IPv6Protocol);
+            }
+            connect(a, &BtHttpAnnounce::finished, this,
+                    [this, a](QByteArray const &reply) { requestFinished(a, reply); });
+            connect(a, &BtHttpAnnounce::failed, this,
+                    [this, a]() { requestFailed(a); });
+            running.append(a);
+        }
+    }
+    /* Started after all are in the list, none of them fails synchronously */
+    for(auto a : running) a->start(timeout);
+}
+
+void BtTierAnnounce::release(BtHttpAnnounce *a)
+{
+    running.removeOne(a);
+    a->disconnect(this);
+    a->abort();
+    /* We may be inside one of its signals */
+    a->deleteLater();
+}
+
+void BtTierAnnounce::cancelRunning()
+{
+    while(!running.isEmpty()) release(running.first());
+}
+
+void BtTierAnnounce::requestFinished(BtHttpAnnounce *a, QByteArray const &reply)
+{
+    QUrl tracker = a->url();
+    release(a);
+
+    BtTrackerResponse r;
+    try {
+        r = parseTrackerResponse(reply);
+    } catch (int e) {
+        qDebug() << "Can not parse response of tracker" << tracker;
+        if(!won && running.isEmpty()) tierDone();
+        return;
+    }
+
+    QString reason;
+    if(r.isEmpty() || r.failed(reason)) {
+        if(!reason.isEmpty()) qDebug() << "Tracker" << tracker << "failed:" << reason;
+    } else if(won) {
+        /* The other family of the winner */
+        emit alsoAnnounced(tracker, r);
+        return;
+    } else if(!r.peers().isEmpty()) {
+        /* First good peer set, the slower ones are not needed */
+        win(tracker, r);
+        return;
+    } else if(!haveFallback) {
+        haveFallback = true;
+        fallbackTracker = tracker;
+        fallback = r;
+    }
+
+    if(!won && running.isEmpty()) tierDone();
+}
+
+void BtTierAnnounce::requestFailed(BtHttpAnnounce *a)
+{
+    release(a);
+    if(!won && running.isEmpty()) tierDone();
+}
+
+void BtTierAnnounce::tierDone()
+{
+    if(haveFallback) {
+        win(fallbackTracker, fallback);
+        return;
+    }
+    int next = (currentTier + 1) % Tiers.size();
+    if(next != firstTier) {
+        startTier(next);
+        return;
+    }
+    emit failed();
+}
+
+void BtTierAnnounce::win(QUrl const &tracker, BtTrackerResponse const &response)
+{
+    /* Keep the request to the winner over the other family */
+    for(auto a : QList<BtHttpAnnounce *>(running)) {
+        if(a->url() != tracker) release(a);
+    }
+    won = true;
+    haveFallback = false;
+
+    /* Move the winner to the front of its tier */
+    QList<QUrl> &tier = Tiers[currentTier];
+    int idx = tier.indexOf(tracker);
+    if(idx > 0) tier.move(idx, 0);
+
+    emit finished(tracker, response);
+}
@@ -316,3 +316,75 @@ void BtQt::BtEncodeBencodeMap(QMap<QString, QVariant> const &data, QByteArray &r
     }
     ret.append('e');
 }
+
+static inline void expect(bool ok, const char *what)
+{
+    if(!ok) {
+        qDebug() << "[Bencode]" << what;
+        throw -1;
+    }
+}
+
+qint64 BtBencodeCursor::readInteger()
+{
+    expect(p < end && *p == 'i', "integer expected");
+    ++ p;
+    bool negative = false;
+    if(p < end && *p == '-') {
+        negative = true;
+        ++ p;
+    }
+    const char *digits = p;
+    qint64 v = 0;
+    while(p < end && *p >= '0' && *p <= '9') {
+        expect(v <= (Q_INT64_C(0x7fffffffffffffff) - 9) / 10, "integer overflow");
+        v = v * 10 + (*p - '0');
+        ++ p;
+    }
+    expect(p > digits && p < end && *p == 'e', "broken integer");
+    ++ p;
+    return negative ? -v : v;
+}
+
+int BtBencodeCursor::readString(const char *&str)
+{
+    const char *digits = p;
+    qint64 len = 0;
+    while(p < end && *p >= '0' && *p <= '9') {
+        len = len * 10 + (*p - '0');
+        expect(len <= end - digits, "string is longer than the data");
+        ++ p;
+    }
+    expect(p > digits && p < end && *p == ':', "string expected");
+    ++ p;
+    expect(len <= end - p, "truncated string");
+    str = p;
+    p += len;
+    return int(len);
+}
+
+void BtBencodeCursor::skipValue(int depth)
+{
+    expect(p < end, "truncated value");
+    expect(depth < 32, "too deep");
+    const char *str;
+    switch(*p) {
+        case 'i':
+            readInteger();
+            break;
+        case 'l':
+        case 'd':
+            /* Keys of a dictionary are strings, skip them as values */
+            ++ p;
+            while(true) {
+                expect(p < end, "truncated list or dictionary");
+                if(*p == 'e') break;
+                skipValue(depth + 1);
+            }
+            ++ p;
+            break;
+        default:
+            readString(str);
+            break;
+    }
+}
@@ -0,0 +1,115 @@
+#include <BtChoker.h>
+#include <BtConnection.h>
+#include <QSet>
+#include <QVector>
+#include <QPair>
+
+#include <algorithm>
+
+using namespace BtQt;
+
+const int BtChoker::DefaultSlots;
+const int BtChoker::RechokeTicks;
+const int BtChoker::OptimisticTicks;
+const int BtChoker::NewPeerMs;
+
+BtChoker::BtChoker(int uploadSlots)
+    : Slots(qMax(1, uploadSlots)), ticks(0), Optimistic(0)
+{
+}
+
+void BtChoker::setUploadSlots(int count)
+{
+    Slots = qMax(1, count);
+}
+
+int BtChoker::uploadSlots() const
+{
+    return Slots;
+}
+
+BtConnection *BtChoker::optimistic() const
+{
+    return Optimistic;
+}
+
+void BtChoker::tick(QList<BtConnection *> const &connections, bool seeding)
+{
+    ++ ticks;
+    if(ticks % RechokeTicks == 0)
+        rechoke(connections, seeding, ticks % OptimisticTicks == 0);
+}
+
+void BtChoker::rechoke(QList<BtConnection *> const &connections, bool seeding,
+        bool rotate)
+{
+    typedef QPair<qint64, BtConnection *> Rank;
+    QVector<Rank> ranking;
+    for(auto c : connections) {
+        if(!c->isActive()) continue;
+        ranking.append(Rank(seeding ? c->uploadRate() : c->downloadRate(), c));
+    }
+    std::sort(ranking.begin(), ranking.end(), [](Rank const &a, Rank const &b) {
+                return a.first > b.first;
+            });
+
+    /* Regular slots, uninterested peers on the way are unchoked for free */
+    QSet<BtConnection *> unchoked;
+    int downloaders = 0;
+    for(auto const &r : ranking) {
+        if(downloaders == Slots - 1) break;
+        unchoked.insert(r.second);
+        if(r.second->peerInterested()) ++ downloaders;
+    }
+
+    /* The optimistic one stays for its round, unless it's not one any more */
+    if(rotate || !Optimistic || !Optimistic->peerInterested()
+            || unchoked.contains(Optimistic)) {
+        QList<BtConnection *> rest;
+        for(auto const &r : ranking) {
+            if(!unchoked.contains(r.second)) rest.append(r.second);
+        }
+        pickOptimistic(rest);
+    }
+
+    for(auto const &r : ranking) {
+        BtConnection *c = r.second;
+        if(unchoked.contains(c) || c == Optimistic) c->unchoke();
+        else c->choke();
+    }
+}
+
+void BtChoker::pickOptimistic(QList<BtConnection *> const &candidates)
+{
+    int total = 0;
+    for(auto c : candidates) {
+        if(c->peerInterested()) total += c->connectedMs() < NewPeerMs ? 3 : 1;
+    }
+    Optimistic = 0;
+    if(total == 0) return;
+
+    int pick = qrand() % total;
+    for(auto c : candidates) {
+        if(!c->peerInterested()) continue;
+        pick -= c->connectedMs() < NewPeerMs ? 3 : 1;
+        if(pick < 0) {
+            Optimistic = c;
+            return;
+        }
+    }
+}
+
+void BtChoker::interested(QList<BtConnection *> const &connections, BtConnection *peer)
+{
+    if(!peer->amChoking()) return;
+    int downloaders = 0;
+    for(auto c : connections) {
+        if(c->isActive() && !c->amChoking() && c->peerInterested()) ++ downloaders;
+    }
+    if(downloaders < Slots) peer->unchoke();
+}
+
+void BtChoker::remove(BtConnection *c)
+{
+    if(Optimistic == c) Optimistic = 0;
+}
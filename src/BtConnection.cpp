@@ -0,0 +1,699 @@
+#include <BtConnection.h>
+#include <BtSwarm.h>
+#include <QTimer>
+#include <QDebug>
+
+using namespace BtQt;
+
+const int BtConnection::HandshakeTimeoutMs;
+const int BtConnection::IdleTimeoutMs;
+const int BtConnection::KeepAliveMs;
+const int BtConnection::SendWatermark;
+const int BtConnection::MaxBlockLength;
+const int BtConnection::ReadBufferSize;
+const int BtConnection::AllowedFastCount;
+const int BtConnection::MaxSuggested;
+
+/* Blocks of one request may span this many files */
+static const int MaxSlices = 16;
+
+BtConnection::BtConnection(BtSwarm &swarm, BtPeerEndpoint const &endpoint,
+        BtEncryptionPolicy policy)
+    : QObject(&swarm), swarm(swarm), socket(new QTcpSocket(this)),
+    Endpoint(endpoint), outgoing(true), connectionState(State::connecting),
+    policy(policy), framer(this), writer(sendBuffer),
+    mseBuffer(BtMseHandshake::KeySize + BtMseHandshake::MaxPad)
+{
+    init();
+    socket->connectToHost(Endpoint.address(), Endpoint.port);
+}
+
+BtConnection::BtConnection(BtSwarm &swarm, QTcpSocket *socket,
+        BtEncryptionPolicy policy)
+    : QObject(&swarm), swarm(swarm), socket(socket),
+    Endpoint(BtPeerEndpoint::fromAddress(socket->peerAddress(), socket->peerPort())),
+    outgoing(false), connectionState(State::handshaking), policy(policy),
+    framer(this), writer(sendBuffer),
+    mseBuffer(BtMseHandshake::KeySize + BtMseHandshake::MaxPad)
+{
+    socket->setParent(this);
+    init();
+    /* Responder takes a plain handshake too, unless encryption is forced */
+    if(policy != BtEncryptionPolicy::disabled) {
+        connectionState = State::encrypting;
+        mse.reset(new BtMseHandshake(QList<QByteArray>() << swarm.infoHash(), policy));
+        mse->start(sendBuffer);
+    }
+    /* Bytes may be there already, read them once we are in the swarm */
+    QTimer::singleShot(0, this, &BtConnection::readSocket);
+}
+
+BtConnection::BtConnection(BtSwarm &swarm, QTcpSocket *socket,
+        BtStreamStart const &start, BtEncryptionPolicy policy)
+    : QObject(&swarm), swarm(swarm), socket(socket),
+    Endpoint(BtPeerEndpoint::fromAddress(socket->peerAddress(), socket->peerPort())),
+    outgoing(false), connectionState(State::handshaking), policy(policy),
+    framer(this), writer(sendBuffer),
+    mseBuffer(BtMseHandshake::KeySize + BtMseHandshake::MaxPad)
+{
+    socket->setParent(this);
+    init();
+    /* Read by the listener, for us */
+    stats.add(BtTransferStats::WireDownload, start.head.size() + start.rest.size());
+    QTimer::singleShot(0, this, [this, start]() {
+                if(startStream(start)) readSocket();
+            });
+}
+
+BtConnection::~BtConnection()
+{
+}
+
+void BtConnection::init()
+{
+    pieces = BtPieceSet(swarm.torrent().pieceCount());
+    allowedFromPeer = BtPieceSet(pieces.size());
+    fastPieces = BtPieceSet(pieces.size());
+    piecesKnown = false;
+    AmChoking = true;
+    AmInterested = false;
+    PeerChoking = true;
+    PeerInterested = false;
+
+    stats.setParent(&swarm.transferStats());
+    sending.bucket().setParent(&swarm.uploadBucket());
+    sending.bucket().setRate(swarm.peerUploadRate());
+    receiving.bucket().setParent(&swarm.downloadBucket());
+    receiving.bucket().setRate(swarm.peerDownloadRate());
+
+    pex.setId(extensions.add(BtPex::Name, &pex));
+    connect(&pex, &BtPex::peersAdded, this,
+            [this](QVector<BtPeerEndpoint> const &peers) {
+                swarm.addCandidates(peers, BtPeerSource::pex);
+            });
+
+    connectSocket();
+    started.start();
+    lastReceived.start();
+    lastSent.start();
+}
+
+void BtConnection::connectSocket()
+{
+    /* Bytes we don't read because of rate limits stay in the kernel, and
+     * TCP slows the peer down */
+    socket->setReadBufferSize(ReadBufferSize);
+    connect(socket, &QTcpSocket::connected, this, &BtConnection::connected);
+    connect(socket, &QTcpSocket::readyRead, this, &BtConnection::readSocket);
+    connect(socket, &QTcpSocket::bytesWritten, this, [this]() { serveUploads(); });
+    connect(socket, &QTcpSocket::disconnected, this, [this]() {
+                peerFailed("Peer closed the connection");
+            });
+    connect(socket, static_cast<void (QAbstractSocket::*)(QAbstractSocket::SocketError)>(
+                &QAbstractSocket::error), this, [this]() { socketError(); });
+}
+
+BtConnection::State BtConnection::state() const
+{
+    return connectionState;
+}
+
+bool BtConnection::isActive() const
+{
+    return connectionState == State::active;
+}
+
+bool BtConnection::isOutgoing() const
+{
+    return outgoing;
+}
+
+bool BtConnection::isEncrypted() const
+{
+    return writer.isEncrypted();
+}
+
+BtPeerEndpoint BtConnection::endpoint() const
+{
+    return Endpoint;
+}
+
+BtPeerEndpoint BtConnection::listenEndpoint() const
+{
+    if(outgoing) return Endpoint;
+    BtPeerEndpoint e = Endpoint;
+    e.port = extensions.peerListenPort();
+    return e;
+}
+
+QByteArray BtConnection::peerId() const
+{
+    return PeerId;
+}
+
+BtPieceSet const &BtConnection::peerPieces() const
+{
+    return pieces;
+}
+
+BtPieceSet const &BtConnection::requestablePieces() const
+{
+    return PeerChoking ? fastPieces : pieces;
+}
+
+QVector<int> const &BtConnection::suggestedPieces() const
+{
+    return suggested;
+}
+
+bool BtConnection::isSeed() const
+{
+    return piecesKnown && pieces.isFull();
+}
+
+bool BtConnection::amChoking() const
+{
+    return AmChoking;
+}
+
+bool BtConnection::amInterested() const
+{
+    return AmInterested;
+}
+
+bool BtConnection::peerChoking() const
+{
+    return PeerChoking;
+}
+
+bool BtConnection::peerInterested() const
+{
+    return PeerInterested;
+}
+
+BtPipeline const &BtConnection::pipeline() const
+{
+    return Pipeline;
+}
+
+qint64 BtConnection::downloaded() const
+{
+    return stats.total(BtTransferStats::PayloadDownload);
+}
+
+qint64 BtConnection::uploaded() const
+{
+    return stats.total(BtTransferStats::PayloadUpload);
+}
+
+qint64 BtConnection::downloadRate() const
+{
+    return stats.rate(BtTransferStats::PayloadDownload);
+}
+
+qint64 BtConnection::uploadRate() const
+{
+    return stats.rate(BtTransferStats::PayloadUpload);
+}
+
+BtTransferStats const &BtConnection::transferStats() const
+{
+    return stats;
+}
+
+qint64 BtConnection::connectedMs() const
+{
+    return started.elapsed();
+}
+
+void BtConnection::connected()
+{
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    if(policy == BtEncryptionPolicy::disabled) {
+        connectionState = State::handshaking;
+        sendHandshake();
+        return;
+    }
+    connectionState = State::encrypting;
+    mse.reset(new BtMseHandshake(swarm.infoHash(), policy));
+    if(!mse->start(sendBuffer)) {
+        peerFailed(QString("MSE: %1").arg(mse->errorString()));
+        return;
+    }
+    flush();
+}
+
+void BtConnection::sendHandshake()
+{
+    char reserved[8] = { 0 };
+    setExtension(reserved, BtExtensionBit::fast);
+    setExtension(reserved, BtExtensionBit::extensionProtocol);
+    writer.handshake(swarm.infoHash(), swarm.peerId(), reserved);
+    flush();
+}
+
+void BtConnection::updateFastPieces()
+{
+    fastPieces = allowedFromPeer;
+    fastPieces &= pieces;
+}
+
+void BtConnection::flush()
+{
+    if(sendBuffer.isEmpty() || connectionState == State::closed) return;
+    qint64 written = writer.flush(socket);
+    if(written < 0) {
+        close("Can not write to socket");
+        return;
+    }
+    stats.add(BtTransferStats::WireUpload, written);
+    lastSent.start();
+}
+
+void BtConnection::readSocket()
+{
+    if(connectionState == State::closed) return;
+    if(socket->bytesAvailable() > 0) lastReceived.start();
+    if(mse) {
+        readEncryptionHandshake();
+        return;
+    }
+    qint64 max = -1;
+    if(connectionState == State::active) {
+        qint64 available = socket->bytesAvailable();
+        max = receiving.spendUpTo(available);
+        if(max < available) swarm.waitForBandwidth(this);
+    }
+    /* Handlers only queue what they send, it goes out at once here */
+    qint64 read;
+    bool ok = framer.readFrom(socket, max, read);
+    stats.add(BtTransferStats::WireDownload, read);
+    if(!ok) {
+        close(framer.errorString());
+        return;
+    }
+    flush();
+}
+
+void BtConnection::bandwidthAvailable()
+{
+    readSocket();
+    serveUploads();
+}
+
+void BtConnection::setRateLimits(qint64 upload, qint64 download)
+{
+    sending.bucket().setRate(upload);
+    receiving.bucket().setRate(download);
+}
+
+void BtConnection::readEncryptionHandshake()
+{
+    qint64 available = socket->bytesAvailable();
+    if(available > 0) {
+        char *p = mseBuffer.reserve(int(available));
+        qint64 got = socket->read(p, available);
+        if(got > 0) {
+            mseBuffer.commit(int(got));
+            stats.add(BtTransferStats::WireDownload, got);
+        }
+    }
+    bool ok = mse->received(mseBuffer, sendBuffer);
+    flush();
+    if(!ok) {
+        peerFailed(QString("MSE: %1").arg(mse->errorString()));
+        return;
+    }
+    if(!mse->isDone()) return;
+
+    /* IA is decrypted already, what follows is still as it came */
+    BtStreamStart start;
+    start.infoHash = mse->infoHash();
+    start.encrypted = mse->isEncrypted();
+    start.encryptor = mse->encryptor();
+    start.decryptor = mse->decryptor();
+    start.head = mse->initialPayload();
+    start.rest = QByteArray(mseBuffer.data(), mseBuffer.size());
+    mse.reset();
+    mseBuffer.clear();
+    if(startStream(start)) readSocket();
+}
+
+bool BtConnection::startStream(BtStreamStart const &start)
+{
+    if(start.encrypted) writer.setEncryption(start.encryptor);
+    connectionState = State::handshaking;
+    if(outgoing) sendHandshake();
+    bool fed = start.head.isEmpty() || framer.feed(start.head.constData(), start.head.size());
+    if(start.encrypted) framer.setDecryption(start.decryptor);
+    if(fed && !start.rest.isEmpty()) fed = framer.feed(start.rest.constData(), start.rest.size());
+    if(!fed) {
+        close(framer.errorString());
+        return false;
+    }
+    flush();
+    return connectionState != State::closed;
+}
+
+void BtConnection::choke()
+{
+    if(AmChoking || !isActive()) return;
+    AmChoking = true;
+    writer.choke();
+    /* With fast extension every dropped request is rejected, and the
+     * allowed fast ones are still served */
+    if(framer.fastExtension()) {
+        QVector<BtBlockRequest> kept;
+        for(auto const &r : uploads) {
+            if(allowedToPeer.contains(int(r.index))) kept.append(r);
+            else writer.rejectRequest(r);
+        }
+        uploads.swap(kept);
+    } else {
+        uploads.clear();
+    }
+    flush();
+}
+
+void BtConnection::unchoke()
+{
+    if(!AmChoking || !isActive()) return;
+    AmChoking = false;
+    writer.unchoke();
+    flush();
+}
+
+void BtConnection::setInterested(bool interested)
+{
+    if(AmInterested == interested || !isActive()) return;
+    AmInterested = interested;
+    if(interested) writer.interested();
+    else writer.notInterested();
+    flush();
+    if(interested) requestBlocks();
+}
+
+void BtConnection::sendHave(int index)
+{
+    if(!isActive()) return;
+    writer.have(quint32(index));
+    flush();
+}
+
+void BtConnection::requestBlocks()
+{
+    if(!isActive() || !AmInterested || (PeerChoking && fastPieces.isNone())) return;
+    Pipeline.fill(writer, [this](BtBlockRequest &r) { return swarm.nextBlock(this, r); });
+    flush();
+}
+
+bool BtConnection::cancelRequest(BtBlockRequest const &r)
+{
+    if(!isActive() || !Pipeline.cancel(writer, r)) return false;
+    flush();
+    return true;
+}
+
+void BtConnection::serveUploads()
+{
+    while(!uploads.isEmpty() && connectionState == State::active
+            && sendBuffer.size() + socket->bytesToWrite() < SendWatermark) {
+        BtBlockRequest r = uploads.first();
+        BtIoSlice slices[MaxSlices];
+        int n = swarm.storage().slices(r.index, r.begin, int(r.length), slices, MaxSlices);
+        if(n < 0) {
+            /* Nothing to send and no token spent, the peer should not
+             * wait for it */
+            uploads.removeFirst();
+            if(framer.fastExtension()) {
+                writer.rejectRequest(r);
+                flush();
+            }
+            continue;
+        }
+        if(!sending.spend(r.length)) {
+            swarm.waitForBandwidth(this);
+            return;
+        }
+        uploads.removeFirst();
+        /* What is queued goes out first, in the same write */
+        qint64 wire = sendBuffer.size() + BtWireSize::pieceHeader + r.length;
+        if(!writer.sendPiece(socket, r.index, r.begin, slices, n)) {
+            close("Can not write to socket");
+            return;
+        }
+        lastSent.start();
+        stats.add(BtTransferStats::PayloadUpload, r.length);
+        stats.add(BtTransferStats::WireUpload, wire);
+    }
+}
+
+void BtConnection::tick()
+{
+    if(connectionState == State::closed) return;
+    stats.tick();
+    if(!isActive()) {
+        if(started.elapsed() > HandshakeTimeoutMs) close("Handshake timed out");
+        return;
+    }
+    if(lastReceived.elapsed() > IdleTimeoutMs) {
+        close("Peer is idle");
+        return;
+    }
+
+    QVector<BtBlockRequest> lost = Pipeline.timedOut(writer);
+    if(!lost.isEmpty()) swarm.blocksReturned(lost);
+    pex.update(writer, extensions, swarm.connectedEndpoints(), listenEndpoint());
+    if(sendBuffer.isEmpty() && lastSent.elapsed() > KeepAliveMs) writer.keepAlive();
+    requestBlocks();
+    flush();
+}
+
+bool BtConnection::retryPlain()
+{
+    if(!outgoing || policy != BtEncryptionPolicy::enabled
+            || connectionState != State::encrypting) {
+        return false;
+    }
+    qDebug() << "MSE to" << Endpoint.address() << "failed, trying in plain";
+    socket->disconnect(this);
+    socket->abort();
+    socket->deleteLater();
+    socket = new QTcpSocket(this);
+    connectSocket();
+
+    policy = BtEncryptionPolicy::disabled;
+    connectionState = State::connecting;
+    mse.reset();
+    mseBuffer.clear();
+    sendBuffer.clear();
+    framer.reset();
+    started.start();
+    lastReceived.start();
+    socket->connectToHost(Endpoint.address(), Endpoint.port);
+    return true;
+}
+
+void BtConnection::socketError()
+{
+    peerFailed(socket->errorString());
+}
+
+void BtConnection::peerFailed(QString const &reason)
+{
+    /* Peers not speaking MSE usually hang up on it */
+    if(retryPlain()) return;
+    close(reason);
+}
+
+void BtConnection::close(QString const &reason)
+{
+    if(connectionState == State::closed) return;
+    connectionState = State::closed;
+    /* We may be in a callback of framer, nothing more is dispatched */
+    framer.abort(reason);
+    QVector<BtBlockRequest> lost = Pipeline.clear();
+    if(!lost.isEmpty()) swarm.blocksReturned(lost);
+    uploads.clear();
+
+    socket->disconnect(this);
+    socket->abort();
+    swarm.connectionClosed(this);
+    deleteLater();
+}
+
+void BtConnection::handshakeReceived(BtHandshakeView const &h)
+{
+    if(QByteArray::fromRawData(h.infoHash, 20) != swarm.infoHash()) {
+        close("Peer wants another torrent");
+        return;
+    }
+    PeerId = QByteArray(h.peerId, 20);
+    if(PeerId == swarm.peerId()) {
+        close("Connected to ourselves");
+        return;
+    }
+    bool fast = supportsExtension(h.reserved, BtExtensionBit::fast);
+    framer.setFastExtension(fast);
+    framer.setExtensionProtocol(supportsExtension(h.reserved,
+                BtExtensionBit::extensionProtocol));
+    Pipeline.setFastExtension(fast);
+    if(!outgoing) sendHandshake();
+
+    connectionState = State::active;
+    if(!swarm.connectionReady(this)) {
+        close("Already connected to this peer");
+        return;
+    }
+
+    if(framer.extensionProtocol()) extensions.writeHandshake(writer, swarm.listenPort());
+    BtPieceSet const &have = swarm.pieces();
+    if(fast && have.isFull()) writer.haveAll();
+    else if(fast && have.isNone()) writer.haveNone();
+    else if(!have.isNone()) writer.bitfield(have);
+    if(fast) {
+        allowedToPeer = allowedFastSet(socket->peerAddress(), swarm.infoHash(),
+                have.size(), AllowedFastCount);
+        for(int index : allowedToPeer) writer.allowedFast(quint32(index));
+    }
+}
+
+void BtConnection::keepAliveReceived()
+{
+}
+
+void BtConnection::chokeReceived()
+{
+    PeerChoking = true;
+    QVector<BtBlockRequest> lost = Pipeline.choked();
+    if(!lost.isEmpty()) swarm.blocksReturned(lost);
+    /* Allowed fast pieces can still be asked for */
+    requestBlocks();
+}
+
+void BtConnection::unchokeReceived()
+{
+    PeerChoking = false;
+    requestBlocks();
+}
+
+void BtConnection::interestedReceived()
+{
+    if(PeerInterested) return;
+    PeerInterested = true;
+    swarm.peerInterested(this);
+}
+
+void BtConnection::notInterestedReceived()
+{
+    PeerInterested = false;
+}
+
+void BtConnection::haveReceived(quint32 index)
+{
+    /* Unsigned, an index over 2^31 must not turn negative */
+    if(index >= quint32(pieces.size())) {
+        close("Have of a piece out of range");
+        return;
+    }
+    piecesKnown = true;
+    if(pieces.test(index)) return;
+    pieces.set(index);
+    if(allowedFromPeer.test(int(index))) fastPieces.set(int(index));
+    swarm.peerHas(this, int(index));
+}
+
+void BtConnection::bitfieldReceived(const char *bits, int size)
+{
+    /* Only right after handshake, a late one would be counted twice */
+    if(piecesKnown) return;
+    if(!pieces.fromWire(bits, size)) {
+        close("Broken bitfield");
+        return;
+    }
+    piecesKnown = true;
+    updateFastPieces();
+    swarm.peerHasPieces(this);
+}
+
+void BtConnection::haveAllReceived()
+{
+    if(piecesKnown) return;
+    pieces.fill(true);
+    piecesKnown = true;
+    updateFastPieces();
+    swarm.peerHasPieces(this);
+}
+
+void BtConnection::haveNoneReceived()
+{
+    piecesKnown = true;
+}
+
+void BtConnection::requestReceived(BtBlockRequest const &r)
+{
+    bool fast = framer.fastExtension();
+    bool valid = r.index < quint32(swarm.pieces().size()) && swarm.pieces().test(int(r.index))
+        && r.length > 0 && r.length <= quint32(MaxBlockLength)
+        && r.begin + qint64(r.length) <= swarm.storage().pieceSize(r.index);
+    bool allowed = !AmChoking || (fast && allowedToPeer.contains(int(r.index)));
+    if(!valid || !allowed || uploads.size() >= BtExtensionTable::DefaultRequestQueue) {
+        if(fast) writer.rejectRequest(r);
+        return;
+    }
+    uploads.append(r);
+    serveUploads();
+}
+
+void BtConnection::pieceReceived(BtBlockView const &b)
+{
+    Pipeline.received(b.index, b.begin, b.length);
+    /* Blocks we did not want are only wire bytes, trackers and the
+     * choker see what we kept */
+    if(swarm.blockReceived(this, b)) stats.add(BtTransferStats::PayloadDownload, b.length);
+    requestBlocks();
+}
+
+void BtConnection::cancelReceived(BtBlockRequest const &r)
+{
+    for(int i = 0; i < uploads.size(); ++ i) {
+        BtBlockRequest const &u = uploads.at(i);
+        if(u.index == r.index && u.begin == r.begin && u.length == r.length) {
+            uploads.remove(i);
+            return;
+        }
+    }
+}
+
+void BtConnection::rejectReceived(BtBlockRequest const &r)
+{
+    if(Pipeline.rejected(r)) swarm.blocksReturned(QVector<BtBlockRequest>() << r);
+}
+
+void BtConnection::suggestReceived(quint32 index)
+{
+    /* Only a hint, a bad one is ignored */
+    if(index >= quint32(pieces.size()) || suggested.contains(int(index))) return;
+    if(suggested.size() >= MaxSuggested) suggested.removeFirst();
+    suggested.append(int(index));
+}
+
+void BtConnection::allowedFastReceived(quint32 index)
+{
+    if(index >= quint32(pieces.size())) return;
+    allowedFromPeer.set(int(index));
+    if(!pieces.test(int(index))) return;
+    fastPieces.set(int(index));
+    requestBlocks();
+}
+
+void BtConnection::extendedReceived(const char *payload, int size)
+{
+    if(!extensions.dispatch(payload, size)) {
+        close("Broken extended message");
+        return;
+    }
+    if(quint8(payload[0]) == BtExtensionTable::HandshakeId) {
+        Pipeline.setMaxDepth(qMin(extensions.peerRequestQueue(), int(BtPipeline::MaxDepth)));
+    }
+}
@@ -1,70 +1,313 @@
 #include <BtCore.h>
+#include <BtSession.h>
 #include <QFile>
 
 #include <QTcpSocket>
 #include <QUdpSocket>
+#include <QNetworkInterface>
 using namespace BtQt;
 
-BtCore::BtCore(BtTorrent const &torrent, int listenPort)
-    : torrent(torrent), uploaded(0), downloaded(0)
+const int BtCore::StopAnnounceTimeoutMs;
+
+/* Globally routable addresses of this host, at most one of each family.
+ * Trackers only see the address we connect from, so the other one has to
+ * be told with ipv4= / ipv6= (BEP 7). */
+void BtCore::globalAddresses(QHostAddress &ipv4, QHostAddress &ipv6)
+{
+    for(auto address : QNetworkInterface::allAddresses()) {
+        if(address.isLoopback()) continue;
+        if(address.protocol() == QAbstractSocket::IPv4Protocol) {
+            quint32 ip = address.toIPv4Address();
+            /* 10/8, 172.16/12, 192.168/16, 169.254/16 */
+            if((ip >> 24) == 10 || (ip >> 20) == 0xac1 || (ip >> 16) == 0xc0a8
+                    || (ip >> 16) == 0xa9fe) continue;
+            if(ipv4.isNull()) ipv4 = address;
+        } else if(address.protocol() == QAbstractSocket::IPv6Protocol) {
+            Q_IPV6ADDR ip = address.toIPv6Address();
+            /* Only 2000::/3 is global unicast */
+            if((ip[0] & 0xe0) != 0x20) continue;
+            if(ipv6.isNull()) ipv6 = address;
+        }
+    }
+}
+
+BtCore::BtCore(BtTorrent const &torrent, int listenPort,
+        BtAnnounceScheduler *scheduler, BtReactor *reactor)
+    : torrent(torrent), reactor(reactor ? reactor : BtReactor::shared()), listener(0),
+    scheduler(scheduler ? scheduler : BtAnnounceScheduler::shared()), downloading(false),
+    lifecycle(BtTorrentState::stopped)
+{
+    QHostAddress ipv4, ipv6;
+    globalAddresses(ipv4, ipv6);
+    init(generatePeerId(), quint16(listenPort), ipv4, ipv6);
+}
+
+BtCore::BtCore(BtTorrent const &torrent, BtListener *listener,
+        BtAnnounceScheduler *scheduler, BtReactor *reactor)
+    : BtCore(torrent, listener->port(), scheduler, reactor)
+{
+    this->listener = listener;
+    listener->add(torrent.infoHash(), this);
+    BtSwarm *s = swarm;
+    this->reactor->post(worker, [s]() { s->setListening(false); });
+}
+
+BtCore::BtCore(BtTorrent const &torrent, BtSession &session)
+    : torrent(torrent), reactor(session.reactor()), listener(session.listener()),
+    scheduler(session.scheduler()), downloading(false),
+    lifecycle(BtTorrentState::stopped)
 {
-    localPeer = QSharedPointer<BtLocalPeer>::create(torrent, generatePeerId()
-            , QHostAddress("0.0.0.0"), listenPort);
+    QHostAddress ipv4, ipv6;
+    session.globalAddresses(ipv4, ipv6);
+    init(session.peerId(), listener->port(), ipv4, ipv6);
+    listener->add(torrent.infoHash(), this);
+
+    BtSwarm *s = swarm;
+    QTimer *ticker = reactor->ticker(worker);
+    BtConnectionLimit *limit = session.connectionLimit();
+    BtEncryptionPolicy policy = session.encryptionPolicy();
+    QString directory = session.downloadDirectory();
+    BtTokenBucket *upload = session.uploadBucket();
+    BtTokenBucket *download = session.downloadBucket();
+    reactor->post(worker, [=]() {
+                s->setListening(false);
+                s->setTicker(ticker);
+                s->setConnectionLimit(limit);
+                s->setEncryptionPolicy(policy);
+                s->setDirectory(directory);
+                s->setParentBuckets(upload, download);
+            });
+}
+
+void BtCore::init(QByteArray const &peerId, quint16 port,
+        QHostAddress const &ipv4, QHostAddress const &ipv6)
+{
+    swarm = new BtSwarm(torrent, peerId, port);
+    worker = reactor->attach(swarm);
+
+    trackerRequest.setInfoHash(torrent.infoHash());
+    trackerRequest.setPeerId(peerId);
+    trackerRequest.setPort(port);
+    trackerRequest.setKey(generateTrackerKey());
+    trackerRequest.setCompact(true);
+    trackerRequest.setIPv4(ipv4);
+    trackerRequest.setIPv6(ipv6);
+
+    auto tiers = torrent.announceTiers();
+    trackers.setTiers(tiers);
+    trackers.setDualStack(!ipv6.isNull());
+    if(!tiers.isEmpty()) announceUrl = QUrl(tiers.first().first());
+    QObject::connect(&trackers, &BtTierAnnounce::finished,
+            [this](QUrl const &tracker, BtTrackerResponse const &r) {
+                trackerAnnounced(tracker, r);
+            });
+    QObject::connect(&trackers, &BtTierAnnounce::alsoAnnounced,
+            [this](QUrl const &tracker, BtTrackerResponse const &r) {
+                trackerState[tracker.toString()].mergePeers(r);
+                addCandidates(r.peers());
+            });
+    QObject::connect(&trackers, &BtTierAnnounce::failed,
+            [this]() { trackerFailed(); });
+    stopTimer.setSingleShot(true);
+    QObject::connect(&stopTimer, &QTimer::timeout, [this]() {
+                trackers.abort();
+                stopped();
+            });
+    /* Queued to our thread, dropped if trackers is gone */
+    QObject::connect(swarm, &BtSwarm::finished, &trackers, [this]() {
+                if(lifecycle != BtTorrentState::running && lifecycle != BtTorrentState::paused)
+                    return;
+                this->scheduler->announceNow(this, announceUrl,
+                        BtTrackerDownloadEvent::completed);
+            });
 }
 
 BtCore::~BtCore()
 {
-    localPeer.clear();
+    if(listener) listener->remove(torrent.infoHash());
+    scheduler->remove(this);
+    BtSwarm *s = swarm;
+    reactor->run(worker, [s]() { delete s; });
+    reactor->detach(worker);
+    trackers.abort();
+}
+
+void BtCore::setDownloadDirectory(QString const &directory)
+{
+    BtSwarm *s = swarm;
+    reactor->post(worker, [s, directory]() { s->setDirectory(directory); });
+}
+
+void BtCore::setRateLimits(qint64 upload, qint64 download)
+{
+    BtSwarm *s = swarm;
+    reactor->post(worker, [=]() { s->setRateLimits(upload, download); });
+}
+
+void BtCore::setPeerRateLimits(qint64 upload, qint64 download)
+{
+    BtSwarm *s = swarm;
+    reactor->post(worker, [=]() { s->setPeerRateLimits(upload, download); });
+}
+
+qint64 BtCore::downloaded() const
+{
+    return swarm->downloaded();
+}
+
+qint64 BtCore::uploaded() const
+{
+    return swarm->uploaded();
+}
+
+qint64 BtCore::left() const
+{
+    return swarm->left();
+}
+
+BtTransferStats const &BtCore::transferStats() const
+{
+    return swarm->transferStats();
 }
 
 void BtCore::start()
 {
-    auto r = contactWithTracker(torrent.announce());
-    if(!r.isEmpty()) trackerState.append(r);
-    else return;
+    if(lifecycle == BtTorrentState::running) return;
+    if(lifecycle == BtTorrentState::paused) {
+        BtSwarm *s = swarm;
+        reactor->post(worker, [s]() { s->resume(); });
+        lifecycle = BtTorrentState::running;
+        return;
+    }
+    if(announceUrl.isEmpty()) {
+        qDebug() << "Torrent" << torrent.name() << "has no tracker!";
+        return;
+    }
+    /* The stopped announce is not needed any more */
+    if(lifecycle == BtTorrentState::stopping) {
+        stopTimer.stop();
+        trackers.abort();
+    }
+    lifecycle = BtTorrentState::running;
+    /* The first announce goes out soon, and the scheduler keeps
+     * re-announcing as the tracker asks */
+    scheduler->add(this, announceUrl);
+}
 
-    startDownload();
+BtTorrentState BtCore::state() const
+{
+    return lifecycle;
 }
 
-void BtCore::pause()
+void BtCore::announce(QUrl const &tracker, BtTrackerDownloadEvent e)
 {
+    announceUrl = tracker;
+    contactWithTracker(e);
+}
 
+void BtCore::incoming(QTcpSocket *socket, BtStreamStart const &start)
+{
+    BtSwarm *s = swarm;
+    socket->moveToThread(reactor->workerThread(worker));
+    reactor->post(worker, [s, socket, start]() { s->acceptIncoming(socket, start); });
 }
 
-void BtCore::stop()
+void BtCore::trackerAnnounced(QUrl const &tracker, BtTrackerResponse const &r)
 {
+    if(lifecycle == BtTorrentState::stopping) {
+        stopped();
+        return;
+    }
+    if(lifecycle == BtTorrentState::stopped) return;
+    trackerState.insert(tracker.toString(), r);
+    /* Another tracker of the tiers answered, the scheduler follows it so
+     * that its interval and backoff are the ones we go by */
+    if(tracker != announceUrl) {
+        scheduler->remove(this, announceUrl);
+        scheduler->add(this, tracker, BtTrackerDownloadEvent::empty);
+        announceUrl = tracker;
+    }
+    scheduler->announced(this, announceUrl, r);
+    addCandidates(r.peers());
 
+    if(!downloading) {
+        downloading = true;
+        startDownload();
+    }
 }
 
-BtTrackerResponse BtCore::contactWithTracker(QUrl trackerUrl,
-        int numwant, BtTrackerDownloadEvent e) const
-{
-    BtTrackerRequest rq(
-            torrent.infoHash(),
-            localPeer->getPeerId(),
-            localPeer->getPort(),
-            uploaded,
-            downloaded,
-            torrent.length() - downloaded
-            );
-    rq.setNumwant(numwant);
-    rq.setEvent(e);
-    try {
-        BtTrackerResponse r(
-                parseTrackerResponse(sendTrackerRequest(
-                        rq,
-                        trackerUrl
-                        )
-                    )
-                );
-        return r;
-    } catch (int e) {
-        qDebug() << "Can not communicate with tracker: " << torrent.announce();
-        return BtTrackerResponse(QMap<QString, QVariant>());
+void BtCore::trackerFailed()
+{
+    if(lifecycle == BtTorrentState::stopping) {
+        stopped();
+        return;
     }
+    if(lifecycle == BtTorrentState::stopped) return;
+    qDebug() << "Can not communicate with any tracker of" << torrent.name();
+    scheduler->announceFailed(this, announceUrl);
+}
+
+void BtCore::pause()
+{
+    if(lifecycle != BtTorrentState::running) return;
+    BtSwarm *s = swarm;
+    reactor->post(worker, [s]() { s->pause(); });
+    lifecycle = BtTorrentState::paused;
+}
+
+void BtCore::stop()
+{
+    if(lifecycle == BtTorrentState::stopped || lifecycle == BtTorrentState::stopping) return;
+    /* Closing connections and flushing the files is the swarm's business,
+     * the announce goes out meanwhile */
+    BtSwarm *s = swarm;
+    reactor->post(worker, [s]() { s->stop(); });
+    downloading = false;
+    scheduler->remove(this);
+    trackers.abort();
+    if(announceUrl.isEmpty()) {
+        lifecycle = BtTorrentState::stopped;
+        if(onStopped) onStopped();
+        return;
+    }
+    lifecycle = BtTorrentState::stopping;
+    contactWithTracker(BtTrackerDownloadEvent::stopped, 0, StopAnnounceTimeoutMs);
+    stopTimer.start(StopAnnounceTimeoutMs);
+}
+
+void BtCore::stopped()
+{
+    if(lifecycle != BtTorrentState::stopping) return;
+    stopTimer.stop();
+    lifecycle = BtTorrentState::stopped;
+    if(onStopped) onStopped();
+}
+
+void BtCore::setStoppedCallback(std::function<void()> callback)
+{
+    onStopped = callback;
+}
+
+void BtCore::contactWithTracker(BtTrackerDownloadEvent e, int numwant, int timeout)
+{
+    trackerRequest.setUploaded(swarm->uploaded());
+    trackerRequest.setDownloaded(swarm->downloaded());
+    trackerRequest.setLeft(swarm->left());
+    trackerRequest.setNumwant(numwant);
+    trackerRequest.setEvent(e);
+    trackers.start(trackerRequest, timeout, announceUrl);
 }
 
 void BtCore::startDownload()
 {
+    BtSwarm *s = swarm;
+    reactor->post(worker, [s]() {
+                if(!s->start()) qDebug() << "Can not open files of" << s->torrent().name();
+            });
+}
 
+void BtCore::addCandidates(QVector<BtPeerEndpoint> const &peers)
+{
+    BtSwarm *s = swarm;
+    reactor->post(worker, [s, peers]() { s->addCandidates(peers, BtPeerSource::tracker); });
 }
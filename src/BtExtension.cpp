@@ -0,0 +1,198 @@
+#include <BtExtension.h>
+#include <BtBencode.h>
+#include <QDebug>
+
+#include <cstring>
+
+using namespace BtQt;
+
+const quint8 BtExtensionTable::HandshakeId;
+const int BtExtensionTable::MaxExtensions;
+const int BtExtensionTable::DefaultRequestQueue;
+
+BtExtensionTable::BtExtensionTable()
+    : count(0), handshaked(false), reqq(DefaultRequestQueue), listenPort(0)
+{
+}
+
+quint8 BtExtensionTable::add(QByteArray const &name, BtExtensionHandler *handler)
+{
+    if(count == MaxExtensions) {
+        qDebug() << "Too many extensions," << name << "is not added";
+        return 0;
+    }
+    Entry &e = entries[count ++];
+    e.name = name;
+    e.handler = handler;
+    e.peerId = 0;
+    return quint8(count);
+}
+
+int BtExtensionTable::size() const
+{
+    return count;
+}
+
+QByteArray BtExtensionTable::handshake(quint16 listenPort,
+        QMap<QString, QVariant> const &extra) const
+{
+    QMap<QString, QVariant> m;
+    for(int i = 0; i < count; ++ i) {
+        m.insert(QString::fromUtf8(entries[i].name), QVariant(i + 1));
+    }
+
+    QMap<QString, QVariant> dict = extra;
+    dict.insert("m", m);
+    if(listenPort) dict.insert("p", QVariant(int(listenPort)));
+    dict.insert("v", QVariant(QString("%1 %2").arg(application).arg(version).toUtf8()));
+    dict.insert("reqq", QVariant(int(DefaultRequestQueue)));
+
+    QByteArray ret;
+    BtEncodeBencodeMap(dict, ret);
+    return ret;
+}
+
+void BtExtensionTable::writeHandshake(BtPeerWireWriter &writer, quint16 listenPort,
+        QMap<QString, QVariant> const &extra) const
+{
+    QByteArray payload = handshake(listenPort, extra);
+    writer.extended(HandshakeId, payload.constData(), payload.size());
+}
+
+bool BtExtensionTable::dispatch(const char *payload, int size)
+{
+    if(size < 1) return false;
+    quint8 id = quint8(payload[0]);
+    if(id == HandshakeId) return handshakeReceived(payload + 1, size - 1);
+    /* An id we never gave out, peer is confused but harmless */
+    if(id > count) return true;
+    entries[id - 1].handler->received(payload + 1, size - 1);
+    return true;
+}
+
+/* Integer or string at the cursor, as BtDecodeBencodeDictionary gives
+ * them (integers as their digits). False for a list or dictionary. */
+static bool readScalar(BtBencodeCursor &c, QVariant &v)
+{
+    if(c.p == c.end) throw -1;
+    if(*c.p == 'i') {
+        v = QByteArray::number(c.readInteger());
+        return true;
+    }
+    if(*c.p < '0' || *c.p > '9') return false;
+    const char *str;
+    int len = c.readString(str);
+    v = QByteArray(str, len);
+    return true;
+}
+
+bool BtExtensionTable::handshakeReceived(const char *payload, int size)
+{
+    /* Peer bytes only go through the bounds-checked cursor. We keep the
+     * values at the top and in m, anything nested deeper is skipped. */
+    QMap<QString, QVariant> dict;
+    QMap<QString, QVariant> m;
+    BtBencodeCursor c = { payload, payload + size };
+    try {
+        if(c.p == c.end || *c.p != 'd') throw -1;
+        ++ c.p;
+        while(true) {
+            if(c.p == c.end) throw -1;
+            if(*c.p == 'e') break;
+            const char *key;
+            int klen = c.readString(key);
+            QVariant v;
+            if(bencodeKeyIs(key, klen, "m") && c.p < c.end && *c.p == 'd') {
+                ++ c.p;
+                while(true) {
+                    if(c.p == c.end) throw -1;
+                    if(*c.p == 'e') break;
+                    const char *name;
+                    int nlen = c.readString(name);
+                    if(readScalar(c, v)) m.insert(QString::fromUtf8(name, nlen), v);
+                    else c.skipValue();
+                }
+                ++ c.p;
+                dict.insert("m", m);
+            } else if(readScalar(c, v)) {
+                dict.insert(QString::fromUtf8(key, klen), v);
+            } else {
+                c.skipValue();
+            }
+        }
+    } catch (int e) {
+        qDebug() << "Broken extended handshake";
+        return false;
+    }
+
+    /* Peer may send it again to change ids, so m is the whole truth */
+    for(int i = 0; i < count; ++ i) {
+        Entry &e = entries[i];
+        QString name = QString::fromUtf8(e.name);
+        bool ok = false;
+        int id = m.value(name).toByteArray().toInt(&ok);
+        quint8 was = e.peerId;
+        e.peerId = ok && id > 0 && id < 256 ? quint8(id) : 0;
+        if(e.peerId && !was) e.handler->peerHandshake(dict);
+    }
+
+    bool ok = false;
+    if(dict.contains("reqq")) {
+        int q = dict.value("reqq").toByteArray().toInt(&ok);
+        if(ok && q > 0) reqq = q;
+    }
+    if(dict.contains("v")) client = QString::fromUtf8(dict.value("v").toByteArray());
+    if(dict.contains("p")) {
+        int p = dict.value("p").toByteArray().toInt(&ok);
+        if(ok && p > 0 && p < 65536) listenPort = quint16(p);
+    }
+    QByteArray ip = dict.value("yourip").toByteArray();
+    if(ip.size() == 4) {
+        yourip = QHostAddress(qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(ip.constData())));
+    } else if(ip.size() == 16) {
+        Q_IPV6ADDR ip6;
+        memcpy(ip6.c, ip.constData(), 16);
+        yourip = QHostAddress(ip6);
+    }
+
+    handshaked = true;
+    return true;
+}
+
+bool BtExtensionTable::peerSupports(quint8 id) const
+{
+    return id >= 1 && id <= count && entries[id - 1].peerId != 0;
+}
+
+bool BtExtensionTable::write(BtPeerWireWriter &writer, quint8 id,
+        const char *payload, int size) const
+{
+    if(!peerSupports(id)) return false;
+    writer.extended(entries[id - 1].peerId, payload, size);
+    return true;
+}
+
+bool BtExtensionTable::peerHandshaked() const
+{
+    return handshaked;
+}
+
+int BtExtensionTable::peerRequestQueue() const
+{
+    return reqq;
+}
+
+QString BtExtensionTable::peerClient() const
+{
+    return client;
+}
+
+quint16 BtExtensionTable::peerListenPort() const
+{
+    return listenPort;
+}
+
+QHostAddress BtExtensionTable::yourIp() const
+{
+    return yourip;
+}
@@ -0,0 +1,201 @@
+#include <BtListener.h>
+#include <QDebug>
+
+#include <cstring>
+
+using namespace BtQt;
+
+const int BtListener::RoutingSize;
+const int BtListener::HandshakeTimeoutMs;
+const int BtListener::MaxPending;
+
+static const char protocolHandshake[] = "\x13" "BitTorrent protocol";
+static const int ProtocolSize = sizeof(protocolHandshake) - 1;
+
+BtListener::BtListener(QObject *parent)
+    : QObject(parent), server(this), timer(this),
+    policy(BtEncryptionPolicy::enabled)
+{
+    connect(&server, &QTcpServer::newConnection, this, &BtListener::acceptConnections);
+    connect(&timer, &QTimer::timeout, this, &BtListener::dropStale);
+}
+
+BtListener::~BtListener()
+{
+    close();
+}
+
+bool BtListener::listen(quint16 port, QHostAddress const &address)
+{
+    if(server.isListening()) server.close();
+    if(!server.listen(address, port)) {
+        qDebug() << "Can not listen on port" << port << server.errorString();
+        return false;
+    }
+    timer.start(1000);
+    return true;
+}
+
+void BtListener::close()
+{
+    server.close();
+    timer.stop();
+    for(auto socket : pending.keys()) drop(socket);
+}
+
+bool BtListener::isListening() const
+{
+    return server.isListening();
+}
+
+quint16 BtListener::port() const
+{
+    return server.serverPort();
+}
+
+QString BtListener::errorString() const
+{
+    return server.errorString();
+}
+
+void BtListener::setEncryptionPolicy(BtEncryptionPolicy policy)
+{
+    this->policy = policy;
+}
+
+BtEncryptionPolicy BtListener::encryptionPolicy() const
+{
+    return policy;
+}
+
+void BtListener::add(QByteArray const &infoHash, BtListenTarget *target)
+{
+    targets.insert(infoHash, target);
+    obfuscated.insert(BtMseHandshake::obfuscatedHash(infoHash), infoHash);
+}
+
+void BtListener::remove(QByteArray const &infoHash)
+{
+    if(targets.remove(infoHash))
+        obfuscated.remove(BtMseHandshake::obfuscatedHash(infoHash));
+}
+
+int BtListener::torrentCount() const
+{
+    return targets.size();
+}
+
+void BtListener::acceptConnections()
+{
+    while(server.hasPendingConnections()) {
+        QTcpSocket *socket = server.nextPendingConnection();
+        if(targets.isEmpty() || pending.size() >= MaxPending) {
+            socket->abort();
+            socket->deleteLater();
+            continue;
+        }
+        Pending *p = new Pending;
+        p->since.start();
+        pending.insert(socket, p);
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]() { readPending(socket); });
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket]() { drop(socket); });
+        /* Bytes may be there already */
+        readPending(socket);
+    }
+}
+
+void BtListener::readPending(QTcpSocket *socket)
+{
+    Pending *p = pending.value(socket);
+    if(!p) return;
+    qint64 available = socket->bytesAvailable();
+    if(available > 0) {
+        qint64 got = socket->read(p->buffer.reserve(int(available)), available);
+        if(got > 0) p->buffer.commit(int(got));
+    }
+    if(p->mse) {
+        readEncrypted(socket, *p);
+        return;
+    }
+
+    /* A DH key may start with 19 too, it's plain only if pstr follows */
+    const char *data = p->buffer.data();
+    int size = p->buffer.size();
+    bool plain = size > 0 && data[0] == protocolHandshake[0];
+    if(plain && size < ProtocolSize) return;
+    plain = plain && memcmp(data, protocolHandshake, ProtocolSize) == 0;
+
+    if(plain) {
+        if(size < RoutingSize) return;
+        BtStreamStart start;
+        start.infoHash = QByteArray(data + 28, 20);
+        if(policy == BtEncryptionPolicy::forced || !targets.contains(start.infoHash)) {
+            drop(socket);
+            return;
+        }
+        start.head = QByteArray(data, size);
+        handOver(socket, start);
+        return;
+    }
+    if(policy == BtEncryptionPolicy::disabled) {
+        drop(socket);
+        return;
+    }
+    if(size == 0) return;
+    p->mse.reset(new BtMseHandshake(obfuscated, policy));
+    readEncrypted(socket, *p);
+}
+
+bool BtListener::readEncrypted(QTcpSocket *socket, Pending &p)
+{
+    BtWireBuffer out(BtMseHandshake::KeySize + BtMseHandshake::MaxPad);
+    bool ok = p.mse->received(p.buffer, out);
+    if(!out.isEmpty()) socket->write(out.data(), out.size());
+    if(!ok || (p.mse->isDone() && !targets.contains(p.mse->infoHash()))) {
+        drop(socket);
+        return false;
+    }
+    if(!p.mse->isDone()) return true;
+
+    BtStreamStart start;
+    start.infoHash = p.mse->infoHash();
+    start.encrypted = p.mse->isEncrypted();
+    start.encryptor = p.mse->encryptor();
+    start.decryptor = p.mse->decryptor();
+    start.head = p.mse->initialPayload();
+    start.rest = QByteArray(p.buffer.data(), p.buffer.size());
+    handOver(socket, start);
+    return true;
+}
+
+void BtListener::handOver(QTcpSocket *socket, BtStreamStart const &start)
+{
+    delete pending.take(socket);
+    socket->disconnect(this);
+    socket->setParent(0);
+    targets.value(start.infoHash)->incoming(socket, start);
+}
+
+void BtListener::drop(QTcpSocket *socket)
+{
+    delete pending.take(socket);
+    socket->disconnect(this);
+    socket->abort();
+    socket->deleteLater();
+}
+
+void BtListener::dropStale()
+{
+    for(auto it = pending.begin(); it != pending.end();) {
+        if(it.value()->since.elapsed() > HandshakeTimeoutMs) {
+            QTcpSocket *socket = it.key();
+            delete it.value();
+            it = pending.erase(it);
+            socket->disconnect(this);
+            socket->abort();
+            socket->deleteLater();
+        } else {
+            ++ it;
+        }
+    }
+}
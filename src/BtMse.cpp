@@ -0,0 +1,507 @@
+#include <BtMse.h>
+#include <QCryptographicHash>
+#include <QtEndian>
+#include <QDebug>
+
+#include <cstring>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <ntsecapi.h>
+#elif defined(Q_OS_UNIX)
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace BtQt;
+
+const int BtMseHandshake::KeySize;
+const int BtMseHandshake::MaxPad;
+const quint32 BtMseHandshake::CryptoPlaintext;
+const quint32 BtMseHandshake::CryptoRc4;
+
+/* Numbers modulo the 768-bit prime of MSE, as 24 32-bit limbs, lowest
+ * first. Only exponentiation is needed, it's done with Montgomery
+ * multiplication so there is no division anywhere. */
+static const int Limbs = 24;
+
+struct Modulus {
+    quint32 p[Limbs];
+    /* R^2 mod P, R = 2^768 */
+    quint32 r2[Limbs];
+    /* -P^-1 mod 2^32 */
+    quint32 n0;
+
+    Modulus();
+};
+
+static void fromBytes(quint32 *x, const uchar *bytes)
+{
+    for(int i = 0; i < Limbs; ++ i) {
+        x[i] = qFromBigEndian<quint32>(bytes + (Limbs - 1 - i) * 4);
+    }
+}
+
+static void toBytes(const quint32 *x, uchar *bytes)
+{
+    for(int i = 0; i < Limbs; ++ i) {
+        qToBigEndian<quint32>(x[i], bytes + (Limbs - 1 - i) * 4);
+    }
+}
+
+/* x >= y */
+static bool notLess(const quint32 *x, const quint32 *y)
+{
+    for(int i = Limbs - 1; i >= 0; -- i) {
+        if(x[i] != y[i]) return x[i] > y[i];
+    }
+    return true;
+}
+
+/* x -= y, mod 2^768 */
+static void subtract(quint32 *x, const quint32 *y)
+{
+    quint64 borrow = 0;
+    for(int i = 0; i < Limbs; ++ i) {
+        quint64 d = quint64(x[i]) - y[i] - borrow;
+        x[i] = quint32(d);
+        borrow = (d >> 32) & 1;
+    }
+}
+
+Modulus::Modulus()
+{
+    static const uchar prime[Limbs * 4] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xC9, 0x0F, 0xDA, 0xA2,
+        0x21, 0x68, 0xC2, 0x34, 0xC4, 0xC6, 0x62, 0x8B, 0x80, 0xDC, 0x1C, 0xD1,
+        0x29, 0x02, 0x4E, 0x08, 0x8A, 0x67, 0xCC, 0x74, 0x02, 0x0B, 0xBE, 0xA6,
+        0x3B, 0x13, 0x9B, 0x22, 0x51, 0x4A, 0x08, 0x79, 0x8E, 0x34, 0x04, 0xDD,
+        0xEF, 0x95, 0x19, 0xB3, 0xCD, 0x3A, 0x43, 0x1B, 0x30, 0x2B, 0x0A, 0x6D,
+        0xF2, 0x5F, 0x14, 0x37, 0x4F, 0xE1, 0x35, 0x6D, 0x6D, 0x51, 0xC2, 0x45,
+        0xE4, 0x85, 0xB5, 0x76, 0x62, 0x5E, 0x7E, 0xC6, 0xF4, 0x4C, 0x42, 0xE9,
+        0xA6, 0x3A, 0x36, 0x21, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, 0x05, 0x63,
+    };
+    fromBytes(p, prime);
+
+    /* Newton's iteration, each step doubles the correct low bits */
+    quint32 inverse = p[0];
+    for(int i = 0; i < 5; ++ i) inverse *= 2 - p[0] * inverse;
+    n0 = quint32(0) - inverse;
+
+    /* 2^1536 mod P by doubling 1, once at startup */
+    memset(r2, 0, sizeof(r2));
+    r2[0] = 1;
+    for(int n = 0; n < 2 * Limbs * 32; ++ n) {
+        quint32 carry = 0;
+        for(int i = 0; i < Limbs; ++ i) {
+            quint32 next = r2[i] >> 31;
+            r2[i] = (r2[i] << 1) | carry;
+            carry = next;
+        }
+        if(carry || notLess(r2, p)) subtract(r2, p);
+    }
+}
+
+static Modulus const &modulus()
+{
+    static const Modulus m;
+    return m;
+}
+
+/* r = a * b / R mod P, r may be a or b */
+static void montMul(quint32 *r, const quint32 *a, const quint32 *b)
+{
+    Modulus const &m = modulus();
+    quint32 t[Limbs + 2];
+    memset(t, 0, sizeof(t));
+    for(int i = 0; i < Limbs; ++ i) {
+        quint64 c = 0;
+        for(int j = 0; j < Limbs; ++ j) {
+            quint64 x = quint64(t[j]) + quint64(a[j]) * b[i] + c;
+            t[j] = quint32(x);
+            c = x >> 32;
+        }
+        quint64 x = quint64(t[Limbs]) + c;
+        t[Limbs] = quint32(x);
+        t[Limbs + 1] = quint32(x >> 32);
+
+        quint32 u = t[0] * m.n0;
+        x = quint64(t[0]) + quint64(u) * m.p[0];
+        c = x >> 32;
+        for(int j = 1; j < Limbs; ++ j) {
+            x = quint64(t[j]) + quint64(u) * m.p[j] + c;
+            t[j - 1] = quint32(x);
+            c = x >> 32;
+        }
+        x = quint64(t[Limbs]) + c;
+        t[Limbs - 1] = quint32(x);
+        t[Limbs] = t[Limbs + 1] + quint32(x >> 32);
+    }
+    if(t[Limbs] || notLess(t, m.p)) subtract(t, m.p);
+    memcpy(r, t, Limbs * 4);
+}
+
+/* base^exponent mod P, base is KeySize bytes big-endian */
+static QByteArray powMod(const char *base, QByteArray const &exponent)
+{
+    Modulus const &m = modulus();
+    quint32 one[Limbs] = { 1 };
+    quint32 b[Limbs], acc[Limbs];
+    fromBytes(b, reinterpret_cast<const uchar *>(base));
+    montMul(b, b, m.r2);
+    montMul(acc, one, m.r2);
+    for(int i = 0; i < exponent.size(); ++ i) {
+        for(int bit = 7; bit >= 0; -- bit) {
+            montMul(acc, acc, acc);
+            if((uchar(exponent.at(i)) >> bit) & 1) montMul(acc, acc, b);
+        }
+    }
+    montMul(acc, acc, one);
+
+    QByteArray ret(BtMseHandshake::KeySize, Qt::Uninitialized);
+    toBytes(acc, reinterpret_cast<uchar *>(ret.data()));
+    return ret;
+}
+
+/* Keys and pads, from the random source of the system. Nothing weaker
+ * will do for the DH key, without it the handshake fails. */
+static bool randomBytes(char *data, int size)
+{
+#if defined(Q_OS_WIN)
+    return RtlGenRandom(data, ULONG(size));
+#elif defined(Q_OS_UNIX)
+    /* Opened once, reading it is fine from every worker at once */
+    static int fd = ::open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return false;
+    while(size > 0) {
+        ssize_t n = ::read(fd, data, size_t(size));
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        data += n;
+        size -= int(n);
+    }
+    return true;
+#else
+    Q_UNUSED(data);
+    Q_UNUSED(size);
+    return false;
+#endif
+}
+
+static QByteArray hash(const char *tag, QByteArray const &a,
+        QByteArray const &b = QByteArray())
+{
+    QCryptographicHash h(QCryptographicHash::Sha1);
+    h.addData(tag, 4);
+    h.addData(a);
+    h.addData(b);
+    return h.result();
+}
+
+static void put(BtWireBuffer &out, const char *data, int size)
+{
+    memcpy(out.reserve(size), data, size);
+    out.commit(size);
+}
+
+static const char protocolHandshake[] = "\x13" "BitTorrent protocol";
+
+BtMseHandshake::BtMseHandshake(QByteArray const &infoHash, BtEncryptionPolicy policy,
+        QByteArray const &initialPayload)
+    : state(State::start), policy(policy), initiator(true), skey(infoHash),
+    ia(initialPayload), provide(0), select(0), padLength(0), iaLength(0),
+    plaintext(false)
+{
+}
+
+BtMseHandshake::BtMseHandshake(QList<QByteArray> const &infoHashes,
+        BtEncryptionPolicy policy)
+    : state(State::start), policy(policy), initiator(false),
+    provide(0), select(0), padLength(0), iaLength(0), plaintext(false)
+{
+    for(auto const &infoHash : infoHashes)
+        this->infoHashes.insert(obfuscatedHash(infoHash), infoHash);
+}
+
+BtMseHandshake::BtMseHandshake(QHash<QByteArray, QByteArray> const &infoHashes,
+        BtEncryptionPolicy policy)
+    : state(State::start), policy(policy), initiator(false),
+    infoHashes(infoHashes), provide(0), select(0), padLength(0), iaLength(0),
+    plaintext(false)
+{
+}
+
+QByteArray BtMseHandshake::obfuscatedHash(QByteArray const &infoHash)
+{
+    return hash("req2", infoHash);
+}
+
+bool BtMseHandshake::isInitiator() const
+{
+    return initiator;
+}
+
+quint32 BtMseHandshake::crypto() const
+{
+    switch(policy) {
+        case BtEncryptionPolicy::forced:
+            return CryptoRc4;
+        case BtEncryptionPolicy::enabled:
+            return CryptoRc4 | CryptoPlaintext;
+        default:
+            return CryptoPlaintext;
+    }
+}
+
+bool BtMseHandshake::writeKey(BtWireBuffer &out)
+{
+    /* 160 bits is what the spec asks for */
+    privateKey = QByteArray(20, Qt::Uninitialized);
+    char pad[MaxPad];
+    quint16 n;
+    if(!randomBytes(privateKey.data(), privateKey.size())
+            || !randomBytes(reinterpret_cast<char *>(&n), sizeof(n)))
+        return fail("No random source for the key");
+    n %= MaxPad + 1;
+    if(!randomBytes(pad, n)) return fail("No random source for the pad");
+
+    char two[KeySize] = { 0 };
+    two[KeySize - 1] = 2;
+    QByteArray y = powMod(two, privateKey);
+    put(out, y.constData(), y.size());
+    put(out, pad, n);
+    return true;
+}
+
+void BtMseHandshake::setKeys()
+{
+    QByteArray keyA = hash("keyA", secret, skey);
+    QByteArray keyB = hash("keyB", secret, skey);
+    sendCipher.setKey((initiator ? keyA : keyB).constData(), 20);
+    receiveCipher.setKey((initiator ? keyB : keyA).constData(), 20);
+}
+
+int BtMseHandshake::synchronize(BtWireBuffer &in)
+{
+    const char *data = in.data();
+    int last = qMin(in.size() - sync.size(), int(MaxPad));
+    for(int k = 0; k <= last; ++ k) {
+        if(memcmp(data + k, sync.constData(), sync.size()) == 0) {
+            in.consume(k);
+            return 1;
+        }
+    }
+    return last == MaxPad ? -1 : 0;
+}
+
+bool BtMseHandshake::start(BtWireBuffer &out)
+{
+    if(state != State::start) return state != State::failed;
+    if(initiator) {
+        if(!writeKey(out)) return false;
+        state = State::waitYb;
+    } else {
+        state = State::waitYa;
+    }
+    return true;
+}
+
+bool BtMseHandshake::received(BtWireBuffer &in, BtWireBuffer &out)
+{
+    if(state == State::start) start(out);
+    for(;;) {
+        switch(state) {
+            case State::waitYb: {
+                if(in.size() < KeySize) return true;
+                secret = powMod(in.data(), privateKey);
+                in.consume(KeySize);
+                setKeys();
+
+                QByteArray req1 = hash("req1", secret);
+                QByteArray req2 = hash("req2", skey);
+                QByteArray req3 = hash("req3", secret);
+                for(int i = 0; i < req2.size(); ++ i) req2[i] = req2.at(i) ^ req3.at(i);
+                put(out, req1.constData(), req1.size());
+                put(out, req2.constData(), req2.size());
+
+                /* VC, crypto_provide, len(PadC) = 0, len(IA) */
+                char *p = out.reserve(16 + ia.size());
+                memset(p, 0, 8);
+                qToBigEndian<quint32>(crypto(), reinterpret_cast<uchar *>(p + 8));
+                qToBigEndian<quint16>(0, reinterpret_cast<uchar *>(p + 12));
+                qToBigEndian<quint16>(quint16(ia.size()), reinterpret_cast<uchar *>(p + 14));
+                memcpy(p + 16, ia.constData(), ia.size());
+                sendCipher.apply(p, 16 + ia.size());
+                out.commit(16 + ia.size());
+
+                /* B's VC, encrypted, is after PadB */
+                BtRc4 probe = receiveCipher;
+                sync = QByteArray(8, '\0');
+                probe.apply(sync.data(), sync.size());
+                state = State::waitVc;
+                break;
+            }
+            case State::waitVc: {
+                int found = synchronize(in);
+                if(found < 0) return fail("No verification constant from peer");
+                if(!found || in.size() < 14) return true;
+                char head[14];
+                memcpy(head, in.data(), sizeof(head));
+                receiveCipher.apply(head, sizeof(head));
+                in.consume(sizeof(head));
+                select = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(head + 8));
+                padLength = qFromBigEndian<quint16>(reinterpret_cast<const uchar *>(head + 12));
+                if((select != CryptoRc4 && select != CryptoPlaintext) || !(select & crypto()))
+                    return fail("Peer selected a method we did not provide");
+                if(padLength > MaxPad) return fail("PadD is too long");
+                state = State::waitPadD;
+                break;
+            }
+            case State::waitPadD:
+                if(in.size() < padLength) return true;
+                receiveCipher.skip(padLength);
+                in.consume(padLength);
+                state = State::done;
+                break;
+            case State::waitYa: {
+                /* A plain BitTorrent handshake starts with 19 */
+                if(!in.isEmpty() && in.data()[0] == protocolHandshake[0]) {
+                    if(in.size() < int(sizeof(protocolHandshake) - 1)) return true;
+                    if(memcmp(in.data(), protocolHandshake, sizeof(protocolHandshake) - 1) == 0) {
+                        if(policy == BtEncryptionPolicy::forced)
+                            return fail("Plain handshake while encryption is forced");
+                        plaintext = true;
+                        state = State::done;
+                        break;
+                    }
+                }
+                if(policy == BtEncryptionPolicy::disabled)
+                    return fail("Not a plain handshake while encryption is disabled");
+                if(in.size() < KeySize) return true;
+                if(!writeKey(out)) return false;
+                secret = powMod(in.data(), privateKey);
+                in.consume(KeySize);
+                sync = hash("req1", secret);
+                state = State::waitReq;
+                break;
+            }
+            case State::waitReq: {
+                int found = synchronize(in);
+                if(found < 0) return fail("No req1 hash from peer");
+                if(!found || in.size() < 20 + 20 + 14) return true;
+
+                /* HASH('req2', SKEY) xor HASH('req3', S) */
+                QByteArray req2 = hash("req3", secret);
+                const char *req = in.data() + 20;
+                for(int i = 0; i < req2.size(); ++ i) req2[i] = req2.at(i) ^ req[i];
+                skey = infoHashes.value(req2);
+                if(skey.isEmpty()) return fail("Peer wants a torrent we don't have");
+                setKeys();
+
+                char head[14];
+                memcpy(head, in.data() + 40, sizeof(head));
+                receiveCipher.apply(head, sizeof(head));
+                in.consume(40 + sizeof(head));
+                static const char vc[8] = { 0 };
+                if(memcmp(head, vc, 8) != 0) return fail("Bad verification constant");
+                provide = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(head + 8));
+                padLength = qFromBigEndian<quint16>(reinterpret_cast<const uchar *>(head + 12));
+                if(padLength > MaxPad) return fail("PadC is too long");
+                state = State::waitPadC;
+                break;
+            }
+            case State::waitPadC: {
+                if(in.size() < padLength + 2) return true;
+                receiveCipher.skip(padLength);
+                char length[2];
+                memcpy(length, in.data() + padLength, 2);
+                receiveCipher.apply(length, 2);
+                in.consume(padLength + 2);
+                iaLength = qFromBigEndian<quint16>(reinterpret_cast<const uchar *>(length));
+                state = State::waitIA;
+                break;
+            }
+            case State::waitIA: {
+                if(in.size() < iaLength) return true;
+                ia = QByteArray(in.data(), iaLength);
+                receiveCipher.apply(ia.data(), ia.size());
+                in.consume(iaLength);
+
+                quint32 common = provide & crypto();
+                if(common & CryptoRc4) select = CryptoRc4;
+                else if(common & CryptoPlaintext) select = CryptoPlaintext;
+                else return fail("No crypto method in common");
+
+                /* VC, crypto_select, len(PadD) = 0 */
+                char *p = out.reserve(14);
+                memset(p, 0, 8);
+                qToBigEndian<quint32>(select, reinterpret_cast<uchar *>(p + 8));
+                qToBigEndian<quint16>(0, reinterpret_cast<uchar *>(p + 12));
+                sendCipher.apply(p, 14);
+                out.commit(14);
+                state = State::done;
+                break;
+            }
+            case State::done:
+                return true;
+            case State::failed:
+                return false;
+            default:
+                return true;
+        }
+    }
+}
+
+bool BtMseHandshake::isDone() const
+{
+    return state == State::done;
+}
+
+bool BtMseHandshake::hasFailed() const
+{
+    return state == State::failed;
+}
+
+QString BtMseHandshake::errorString() const
+{
+    return ErrorString;
+}
+
+bool BtMseHandshake::isPlaintext() const
+{
+    return plaintext;
+}
+
+bool BtMseHandshake::isEncrypted() const
+{
+    return state == State::done && !plaintext && select == CryptoRc4;
+}
+
+QByteArray BtMseHandshake::infoHash() const
+{
+    return skey;
+}
+
+QByteArray BtMseHandshake::initialPayload() const
+{
+    return ia;
+}
+
+BtRc4 const &BtMseHandshake::encryptor() const
+{
+    return sendCipher;
+}
+
+BtRc4 const &BtMseHandshake::decryptor() const
+{
+    return receiveCipher;
+}
+
+bool BtMseHandshake::fail(QString const &reason)
+{
+    qDebug() << "MSE:" << reason;
+    state = State::failed;
+    ErrorString = reason;
+    return false;
+}
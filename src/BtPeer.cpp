@@ -26,7 +26,7 @@ BtPeer::BtPeer(BtTorrent const &torrentRef)
     : AmChoking(false), AmInterested(false), PeerChoking(false),
     PeerInterested(false), torrentRef(torrentRef)
 {
-    pieces.resize(torrentRef.pieceLength());
+    pieces.resize(torrentRef.pieceCount());
 }
 
 BtPeer::BtPeer(BtTorrent const &torrentRef, QByteArray const &peer_id,
@@ -35,7 +35,7 @@ BtPeer::BtPeer(BtTorrent const &torrentRef, QByteArray const &peer_id,
     AmInterested(false), PeerChoking(false), PeerInterested(false),
     torrentRef(torrentRef)
 {
-    pieces.resize(torrentRef.pieceLength());
+    pieces.resize(torrentRef.pieceCount());
 }
 
 void BtPeer::setPeerId(QByteArray const &peer_id)
@@ -60,7 +60,7 @@ void BtPeer::setTorrentRef(BtTorrent const &torrentRef)
 
 void BtPeer::pieceOk(int idx)
 {
-    pieces.setBit(idx);
+    pieces.set(idx);
 }
 
 QByteArray BtPeer::getPeerId() const
@@ -104,13 +104,18 @@ bool BtPeer::peerInterested() const
 }
 
 QBitArray BtPeer::getPieceBitArray() const
+{
+    return pieces.toBitArray();
+}
+
+BtPieceSet const &BtPeer::getPieceSet() const
 {
     return pieces;
 }
 
 bool BtPeer::havePiece(int idx) const
 {
-    return pieces.testBit(idx);
+    return idx >= 0 && idx < pieces.size() && pieces.test(idx);
 }
 
 BtRemotePeer::BtRemotePeer(BtTorrent const &torrentRef) :
@@ -127,140 +132,362 @@ BtRemotePeer::BtRemotePeer(BtTorrent const &torrentRef, QByteArray const &peer_i
 }
 
 BtLocalPeer::BtLocalPeer(BtTorrent const &torrentRef) :
-    BtPeer(torrentRef), torrent(torrentRef)
+    BtPeer(torrentRef), torrent(torrentRef), framer(this),
+    writer(sendBuffer), mseBuffer(BtMseHandshake::KeySize + BtMseHandshake::MaxPad)
 {
     torrent = torrentRef;
     setTorrentRef(torrent);
+    connect(&tcpSocket, &QTcpSocket::readyRead, this, &BtLocalPeer::readSocket);
 }
 
 BtLocalPeer::BtLocalPeer(BtTorrent const &torrentRef, QByteArray const &peer_id,
         QHostAddress const &ip, quint16 port)
-    : BtPeer(torrentRef, peer_id, ip, port), torrent(torrentRef)
+    : BtPeer(torrentRef, peer_id, ip, port), torrent(torrentRef), framer(this),
+    writer(sendBuffer), mseBuffer(BtMseHandshake::KeySize + BtMseHandshake::MaxPad)
 {
     setTorrentRef(torrent);
+    connect(&tcpSocket, &QTcpSocket::readyRead, this, &BtLocalPeer::readSocket);
 }
 
-/* Convert an integer to four big-endian bytes */
-static QByteArray bigEndianFourBytesInteger(int integer)
+/* Serialize one message with writer, for the QByteArray API.
+ * Connections queue into their send buffer with wire() instead. */
+template <typename F>
+static QByteArray message(int size, F write)
 {
-    union {
-        int i;
-        quint8 s[4];
-    } converter;
-
-    converter.i = integer;
-    QByteArray ret;
-    ret.append(converter.s[3])
-        .append(converter.s[2])
-        .append(converter.s[1])
-        .append(converter.s[0]);
-    return ret;
+    BtWireBuffer out(size);
+    BtPeerWireWriter writer(out);
+    write(writer);
+    return QByteArray(out.data(), out.size());
 }
 
 QByteArray BtLocalPeer::handshake() const
 {
-    QByteArray ret("\x13");
-    qDebug() << int('\x13');
-    ret.append("BitTorrent protocol")
-        .append("\x0\x0\x0\x0\x0\x0\x0\x0")
-        .append(torrentRef.infoHash())
-        .append(peer_id);
-    Q_ASSERT(ret.size() == 68);
-    return ret;
+    char reserved[8] = { 0 };
+    setExtension(reserved, BtExtensionBit::fast);
+    setExtension(reserved, BtExtensionBit::extensionProtocol);
+    return message(BtWireSize::handshake, [&](BtPeerWireWriter &w) {
+            w.handshake(torrentRef.infoHash(), peer_id, reserved);
+        });
 }
 
 QByteArray BtLocalPeer::keepAlive() const
 {
-    return bigEndianFourBytesInteger(0);
+    return message(BtWireSize::keepAlive, [](BtPeerWireWriter &w) { w.keepAlive(); });
 }
 
 QByteArray BtLocalPeer::choke() const
 {
-    return bigEndianFourBytesInteger(1).append('0');
+    return message(BtWireSize::state, [](BtPeerWireWriter &w) { w.choke(); });
 }
 
 QByteArray BtLocalPeer::unchoke() const
 {
-    return bigEndianFourBytesInteger(1).append('1');
+    return message(BtWireSize::state, [](BtPeerWireWriter &w) { w.unchoke(); });
 }
 
 QByteArray BtLocalPeer::interested() const
 {
-    return bigEndianFourBytesInteger(1).append('2');
+    return message(BtWireSize::state, [](BtPeerWireWriter &w) { w.interested(); });
 }
 
 QByteArray BtLocalPeer::notInterested() const
 {
-    return bigEndianFourBytesInteger(1).append('3');
+    return message(BtWireSize::state, [](BtPeerWireWriter &w) { w.notInterested(); });
 }
 
 QByteArray BtLocalPeer::have(int index) const
 {
-    return bigEndianFourBytesInteger(5).append('4')
-        .append(bigEndianFourBytesInteger(index));
-}
-
-/* pend 0 to the spare bits */
-static QByteArray bitsToBytes(QBitArray bits)
-{
-    QByteArray bytes;
-    bytes.resize(bits.size() / 8 + 1);
-    bytes.fill(0);
-    for(auto b = 0; b < bits.size(); ++ b)
-        bytes[b / 8] = bytes.at(b / 8) | ((bits[b]?1:0) << (b % 8));
-    return bytes;
+    return message(BtWireSize::have, [index](BtPeerWireWriter &w) { w.have(index); });
 }
 
 QByteArray BtLocalPeer::bitfield() const
 {
-    return bigEndianFourBytesInteger(1 + pieces.size()).append('5')
-        .append(bitsToBytes(pieces));
+    return message(BtWireSize::bitfield(pieces.size()), [this](BtPeerWireWriter &w) {
+            w.bitfield(pieces);
+        });
 }
 
 QByteArray BtLocalPeer::request(int index, qint64 begin, qint64 length) const
 {
-    return bigEndianFourBytesInteger(13).append('6')
-        .append(bigEndianFourBytesInteger(index))
-        .append(bigEndianFourBytesInteger(begin))
-        .append(bigEndianFourBytesInteger(length));
+    BtBlockRequest r = { quint32(index), quint32(begin), quint32(length) };
+    return message(BtWireSize::request, [&r](BtPeerWireWriter &w) { w.request(r); });
 }
 
 QByteArray BtLocalPeer::piece(int index, qint64 begin, qint64 length,
         QByteArray const& pieceData) const
 {
-    return bigEndianFourBytesInteger(9 + length).append('7')
-        .append(bigEndianFourBytesInteger(index))
-        .append(bigEndianFourBytesInteger(begin))
-        .append(pieceData.mid(begin, length));
+    Q_ASSERT(begin + length <= pieceData.size());
+    return message(BtWireSize::pieceHeader + length, [&](BtPeerWireWriter &w) {
+            w.piece(index, begin, pieceData.constData() + begin, length);
+        });
+}
+
+bool BtLocalPeer::sendPiece(BtStorage const &storage, int index, qint64 begin,
+        qint64 length)
+{
+    /* A block spans a few files at most */
+    BtIoSlice slices[8];
+    int n = storage.slices(index, begin, length, slices, 8);
+    if(n < 0) return false;
+    return writer.sendPiece(&tcpSocket, index, begin, slices, n);
 }
 
 QByteArray BtLocalPeer::cancel(int index, qint64 begin, qint64 length) const
 {
-    return bigEndianFourBytesInteger(13).append('8')
-        .append(bigEndianFourBytesInteger(index))
-        .append(bigEndianFourBytesInteger(begin))
-        .append(bigEndianFourBytesInteger(length));
+    BtBlockRequest r = { quint32(index), quint32(begin), quint32(length) };
+    return message(BtWireSize::cancel, [&r](BtPeerWireWriter &w) { w.cancel(r); });
 }
 
 QByteArray BtLocalPeer::port(quint16 listenPort) const
 {
-    return bigEndianFourBytesInteger(3).append('9')
-        .append(listenPort >> 8).append(listenPort & 0xff);
+    return message(BtWireSize::port, [listenPort](BtPeerWireWriter &w) {
+            w.port(listenPort);
+        });
 }
 
-bool BtLocalPeer::send(BtRemotePeer const &r, QByteArray const &message)
+QByteArray BtLocalPeer::suggest(int index) const
 {
-    return false;
+    return message(BtWireSize::suggest, [index](BtPeerWireWriter &w) { w.suggest(index); });
 }
 
-void BtLocalPeer::process(QByteArray const &message)
+QByteArray BtLocalPeer::haveAll() const
+{
+    return message(BtWireSize::haveAll, [](BtPeerWireWriter &w) { w.haveAll(); });
+}
+
+QByteArray BtLocalPeer::haveNone() const
+{
+    return message(BtWireSize::haveNone, [](BtPeerWireWriter &w) { w.haveNone(); });
+}
+
+QByteArray BtLocalPeer::rejectRequest(int index, qint64 begin, qint64 length) const
+{
+    BtBlockRequest r = { quint32(index), quint32(begin), quint32(length) };
+    return message(BtWireSize::rejectRequest, [&r](BtPeerWireWriter &w) {
+            w.rejectRequest(r);
+        });
+}
+
+QByteArray BtLocalPeer::allowedFast(int index) const
+{
+    return message(BtWireSize::allowedFast, [index](BtPeerWireWriter &w) {
+            w.allowedFast(index);
+        });
+}
+
+bool BtLocalPeer::fastExtension() const
+{
+    return framer.fastExtension();
+}
+
+bool BtLocalPeer::extensionProtocol() const
+{
+    return framer.extensionProtocol();
+}
+
+BtExtensionTable &BtLocalPeer::extensions()
+{
+    return extensionTable;
+}
+
+QByteArray BtLocalPeer::extendedHandshake() const
+{
+    QByteArray payload = extensionTable.handshake(peerPort);
+    return message(6 + payload.size(), [&payload](BtPeerWireWriter &w) {
+            w.extended(BtExtensionTable::HandshakeId, payload.constData(), payload.size());
+        });
+}
+
+BtPeerWireWriter &BtLocalPeer::wire()
 {
+    return writer;
+}
+
+bool BtLocalPeer::flush()
+{
+    return writer.flush(&tcpSocket) >= 0;
+}
+
+bool BtLocalPeer::send(BtRemotePeer const &, QByteArray const &message)
+{
+    if(tcpSocket.state() != QAbstractSocket::ConnectedState) return false;
+    writer.raw(message.constData(), message.size());
+    return flush();
+}
 
+void BtLocalPeer::process(QByteArray const &message)
+{
+    if(!framer.dispatchMessage(message.constData(), message.size()))
+        emit protocolError(framer.errorString());
 }
 
 void BtLocalPeer::received(QByteArray const &data)
 {
+    if(!framer.feed(data.constData(), data.size()))
+        emit protocolError(framer.errorString());
+}
+
+void BtLocalPeer::startEncryption(bool initiator, BtEncryptionPolicy policy)
+{
+    if(initiator) {
+        mse.reset(new BtMseHandshake(torrentRef.infoHash(), policy));
+    } else {
+        mse.reset(new BtMseHandshake(QList<QByteArray>() << torrentRef.infoHash(), policy));
+    }
+    mseBuffer.clear();
+    mse->start(sendBuffer);
+    flush();
+}
+
+bool BtLocalPeer::isEncrypted() const
+{
+    return framer.isEncrypted();
+}
+
+void BtLocalPeer::readEncryptionHandshake()
+{
+    qint64 available = tcpSocket.bytesAvailable();
+    if(available > 0) {
+        char *p = mseBuffer.reserve(int(available));
+        qint64 got = tcpSocket.read(p, available);
+        if(got > 0) mseBuffer.commit(int(got));
+    }
+    bool ok = mse->received(mseBuffer, sendBuffer);
+    flush();
+    if(!ok) {
+        emit protocolError(QString("MSE: %1").arg(mse->errorString()));
+        mse.reset();
+        tcpSocket.abort();
+        return;
+    }
+    if(!mse->isDone()) return;
+
+    /* IA is decrypted already, what follows is still as it came */
+    bool encrypted = mse->isEncrypted();
+    QByteArray ia = mse->initialPayload();
+    if(encrypted) writer.setEncryption(mse->encryptor());
+    bool fed = ia.isEmpty() || framer.feed(ia.constData(), ia.size());
+    if(encrypted) framer.setDecryption(mse->decryptor());
+    mse.reset();
+    emit encryptionDone(encrypted);
+
+    if(fed && !mseBuffer.isEmpty()) fed = framer.feed(mseBuffer.data(), mseBuffer.size());
+    mseBuffer.clear();
+    if(!fed) {
+        emit protocolError(framer.errorString());
+        tcpSocket.abort();
+        return;
+    }
+    readSocket();
+}
+
+void BtLocalPeer::readSocket()
+{
+    if(mse) {
+        readEncryptionHandshake();
+        return;
+    }
+    /* Straight from socket into the framer's buffer */
+    if(!framer.readFrom(&tcpSocket)) {
+        emit protocolError(framer.errorString());
+        tcpSocket.abort();
+    }
+}
+
+void BtLocalPeer::handshakeReceived(BtHandshakeView const &h)
+{
+    /* We always send the bit */
+    framer.setFastExtension(supportsExtension(h.reserved, BtExtensionBit::fast));
+    framer.setExtensionProtocol(supportsExtension(h.reserved,
+                BtExtensionBit::extensionProtocol));
+    emit handshaked(QByteArray(h.infoHash, 20), QByteArray(h.peerId, 20));
+}
+
+void BtLocalPeer::chokeReceived()
+{
+    PeerChoking = true;
+    emit chokeChanged(true);
+}
+
+void BtLocalPeer::unchokeReceived()
+{
+    PeerChoking = false;
+    emit chokeChanged(false);
+}
+
+void BtLocalPeer::interestedReceived()
+{
+    PeerInterested = true;
+    emit interestChanged(true);
+}
+
+void BtLocalPeer::notInterestedReceived()
+{
+    PeerInterested = false;
+    emit interestChanged(false);
+}
+
+void BtLocalPeer::haveReceived(quint32 index)
+{
+    emit peerHas(int(index));
+}
+
+void BtLocalPeer::bitfieldReceived(const char *bits, int size)
+{
+    emit peerBitfield(QByteArray::fromRawData(bits, size));
+}
+
+void BtLocalPeer::requestReceived(BtBlockRequest const &r)
+{
+    emit blockRequested(int(r.index), r.begin, r.length);
+}
+
+void BtLocalPeer::pieceReceived(BtBlockView const &b)
+{
+    /* No copy, the block is still in the receive buffer */
+    emit blockReceived(int(b.index), b.begin,
+            QByteArray::fromRawData(b.data, b.length));
+}
+
+void BtLocalPeer::cancelReceived(BtBlockRequest const &r)
+{
+    emit requestCancelled(int(r.index), r.begin, r.length);
+}
+
+void BtLocalPeer::portReceived(quint16 port)
+{
+    emit dhtPort(port);
+}
+
+void BtLocalPeer::suggestReceived(quint32 index)
+{
+    emit pieceSuggested(int(index));
+}
+
+void BtLocalPeer::haveAllReceived()
+{
+    emit peerHasAll();
+}
+
+void BtLocalPeer::haveNoneReceived()
+{
+    emit peerHasNone();
+}
 
+void BtLocalPeer::rejectReceived(BtBlockRequest const &r)
+{
+    emit requestRejected(int(r.index), r.begin, r.length);
+}
+
+void BtLocalPeer::allowedFastReceived(quint32 index)
+{
+    emit fastAllowed(int(index));
+}
+
+void BtLocalPeer::extendedReceived(const char *payload, int size)
+{
+    if(!extensionTable.dispatch(payload, size))
+        emit protocolError("Broken extended message");
 }
 
 
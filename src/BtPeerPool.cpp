@@ -0,0 +1,155 @@
+#include <BtPeerPool.h>
+
+using namespace BtQt;
+
+const int BtPeerPool::MaxPeers;
+const int BtPeerPool::MaxHalfOpen;
+const int BtPeerPool::MaxFailures;
+const int BtPeerPool::RetryMs;
+const int BtPeerPool::MaxRetryMs;
+const int BtPeerPool::ReconnectMs;
+
+/* Score goes in the high bits of a ready key, better is smaller */
+static const int ScoreShift = 40;
+static const int MaxScore = 64;
+
+BtPeerPool::BtPeerPool()
+    : HalfOpen(0), sequence(0)
+{
+    clock.start();
+}
+
+int BtPeerPool::score(Peer const &p)
+{
+    int s = 0;
+    if(p.sources & quint8(BtPeerSource::tracker)) s += 4;
+    if(p.sources & quint8(BtPeerSource::pex)) s += 2;
+    if(p.sources & quint8(BtPeerSource::dht)) s += 2;
+    if(p.wasConnected) s += 8;
+    return qBound(0, s - 2 * p.failures, MaxScore - 1);
+}
+
+void BtPeerPool::add(BtPeerEndpoint const &e, BtPeerSource source)
+{
+    auto it = peers.find(e);
+    if(it != peers.end()) {
+        Peer &p = it.value();
+        if(p.sources & quint8(source)) return;
+        p.sources |= quint8(source);
+        /* Rank changes with the score */
+        if(p.state == State::ready) {
+            unlink(e, p);
+            makeReady(e, p);
+        }
+        return;
+    }
+
+    Peer p;
+    p.sources = quint8(source);
+    p.failures = 0;
+    p.wasConnected = false;
+    p.key = 0;
+    if(peers.size() >= MaxPeers) {
+        /* Make room by forgetting the worst ready peer, if it's worse */
+        if(ready.isEmpty()) return;
+        auto worst = ready.end();
+        -- worst;
+        if(score(peers.value(worst.value())) >= score(p)) return;
+        peers.remove(worst.value());
+        ready.erase(worst);
+    }
+    peers.insert(e, p);
+    makeReady(e, peers[e]);
+}
+
+int BtPeerPool::size() const
+{
+    return peers.size();
+}
+
+int BtPeerPool::halfOpen() const
+{
+    return HalfOpen;
+}
+
+bool BtPeerPool::next(BtPeerEndpoint &e)
+{
+    if(HalfOpen >= MaxHalfOpen) return false;
+    wakeUp();
+    if(ready.isEmpty()) return false;
+    e = ready.first();
+    ready.erase(ready.begin());
+    peers[e].state = State::connecting;
+    ++ HalfOpen;
+    return true;
+}
+
+void BtPeerPool::putBack(BtPeerEndpoint const &e)
+{
+    auto it = peers.find(e);
+    if(it == peers.end() || it->state != State::connecting) return;
+    -- HalfOpen;
+    makeReady(e, it.value());
+}
+
+void BtPeerPool::connected(BtPeerEndpoint const &e)
+{
+    auto it = peers.find(e);
+    if(it == peers.end() || it->state != State::connecting) return;
+    -- HalfOpen;
+    it->state = State::connected;
+    it->failures = 0;
+    it->wasConnected = true;
+}
+
+void BtPeerPool::disconnected(BtPeerEndpoint const &e, bool blame)
+{
+    auto it = peers.find(e);
+    if(it == peers.end()) return;
+    Peer &p = it.value();
+    if(p.state == State::connected) {
+        makeWaiting(e, p, ReconnectMs);
+        return;
+    }
+    if(p.state != State::connecting) return;
+    -- HalfOpen;
+    if(!blame) {
+        makeReady(e, p);
+        return;
+    }
+    if(++ p.failures >= MaxFailures) {
+        peers.erase(it);
+        return;
+    }
+    makeWaiting(e, p, qMin<qint64>(qint64(RetryMs) << (p.failures - 1), MaxRetryMs));
+}
+
+void BtPeerPool::makeReady(BtPeerEndpoint const &e, Peer &p)
+{
+    p.state = State::ready;
+    p.key = (qint64(MaxScore - 1 - score(p)) << ScoreShift) | (sequence ++ & ((1LL << ScoreShift) - 1));
+    ready.insert(p.key, e);
+}
+
+void BtPeerPool::makeWaiting(BtPeerEndpoint const &e, Peer &p, qint64 ms)
+{
+    p.state = State::waiting;
+    p.key = clock.elapsed() + ms;
+    waiting.insert(p.key, e);
+}
+
+void BtPeerPool::unlink(BtPeerEndpoint const &e, Peer &p)
+{
+    if(p.state == State::ready) ready.remove(p.key);
+    else if(p.state == State::waiting) waiting.remove(p.key, e);
+}
+
+void BtPeerPool::wakeUp()
+{
+    qint64 now = clock.elapsed();
+    while(!waiting.isEmpty() && waiting.firstKey() <= now) {
+        BtPeerEndpoint e = waiting.first();
+        waiting.erase(waiting.begin());
+        makeReady(e, peers[e]);
+    }
+}
@@ -0,0 +1,666 @@
+#include <BtPeerWire.h>
+#include <QDebug>
+#include <QCryptographicHash>
+
+#include <cstring>
+
+#ifdef Q_OS_UNIX
+#include <sys/uio.h>
+#include <errno.h>
+#endif // Q_OS_UNIX
+
+using namespace BtQt;
+
+const int BtWireBuffer::DefaultCapacity;
+const int BtPeerWireFramer::HandshakeSize;
+const quint32 BtPeerWireFramer::MaxMessageLength;
+const int BtPeerWireFramer::ReadChunk;
+const int BtPeerWireWriter::MaxSlices;
+
+static const char protocolName[] = "BitTorrent protocol";
+
+static inline quint32 readUInt32(const char *p)
+{
+    return qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(p));
+}
+
+/* Byte of reserved and bit in it */
+static void extensionBit(BtExtensionBit e, int &byte, quint8 &mask)
+{
+    switch(e) {
+    case BtExtensionBit::dht:
+        byte = 7;
+        mask = 0x01;
+        break;
+    case BtExtensionBit::fast:
+        byte = 7;
+        mask = 0x04;
+        break;
+    case BtExtensionBit::extensionProtocol:
+        byte = 5;
+        mask = 0x10;
+        break;
+    }
+}
+
+bool BtQt::supportsExtension(const char *reserved, BtExtensionBit e)
+{
+    int byte = 0;
+    quint8 mask = 0;
+    extensionBit(e, byte, mask);
+    return quint8(reserved[byte]) & mask;
+}
+
+void BtQt::setExtension(char *reserved, BtExtensionBit e)
+{
+    int byte = 0;
+    quint8 mask = 0;
+    extensionBit(e, byte, mask);
+    reserved[byte] = char(quint8(reserved[byte]) | mask);
+}
+
+QVector<int> BtQt::allowedFastSet(QHostAddress const &ip, QByteArray const &infoHash,
+        int pieceCount, int k)
+{
+    QVector<int> ret;
+    if(ip.protocol() != QAbstractSocket::IPv4Protocol || pieceCount <= 0) return ret;
+    k = qMin(k, pieceCount);
+
+    /* x = (ip & 0xffffff00) + infohash, then hash it again and again and
+     * take every 4 bytes of the hash as a piece */
+    QByteArray x(4, 0);
+    qToBigEndian<quint32>(ip.toIPv4Address() & 0xffffff00,
+            reinterpret_cast<uchar *>(x.data()));
+    x.append(infoHash);
+    while(ret.size() < k) {
+        x = QCryptographicHash::hash(x, QCryptographicHash::Sha1);
+        for(int i = 0; i < 5 && ret.size() < k; ++ i) {
+            int index = int(readUInt32(x.constData() + i * 4) % quint32(pieceCount));
+            if(!ret.contains(index)) ret.append(index);
+        }
+    }
+    return ret;
+}
+
+BtWireBuffer::BtWireBuffer(int capacity)
+    : head(0), tail(0)
+{
+    storage.resize(capacity);
+}
+
+int BtWireBuffer::size() const
+{
+    return tail - head;
+}
+
+bool BtWireBuffer::isEmpty() const
+{
+    return head == tail;
+}
+
+int BtWireBuffer::capacity() const
+{
+    return storage.size();
+}
+
+const char *BtWireBuffer::data() const
+{
+    return storage.constData() + head;
+}
+
+char *BtWireBuffer::data()
+{
+    return storage.data() + head;
+}
+
+char *BtWireBuffer::reserve(int n)
+{
+    if(storage.size() - tail < n) {
+        int used = size();
+        if(storage.size() - used < n) {
+            int c = qMax(storage.size(), 64);
+            while(c - used < n) c *= 2;
+            storage.resize(c);
+        }
+        /* Wrap around, only the unfinished message moves */
+        if(head > 0) {
+            memmove(storage.data(), storage.constData() + head, used);
+            head = 0;
+            tail = used;
+        }
+    }
+    return storage.data() + tail;
+}
+
+void BtWireBuffer::commit(int n)
+{
+    Q_ASSERT(tail + n <= storage.size());
+    tail += n;
+}
+
+void BtWireBuffer::consume(int n)
+{
+    Q_ASSERT(n <= size());
+    head += n;
+    /* Empty, start over from the front for free */
+    if(head == tail) head = tail = 0;
+}
+
+void BtWireBuffer::clear()
+{
+    head = tail = 0;
+}
+
+static inline void writeUInt32(char *p, quint32 i)
+{
+    qToBigEndian<quint32>(i, reinterpret_cast<uchar *>(p));
+}
+
+/* Length prefix and id */
+static inline char *writeHeader(char *p, quint32 length, BtPeerMessageId id)
+{
+    writeUInt32(p, length);
+    p[4] = char(id);
+    return p + 5;
+}
+
+BtPeerWireWriter::BtPeerWireWriter(BtWireBuffer &out)
+    : out(out), encrypting(false), encrypted(0)
+{
+}
+
+void BtPeerWireWriter::handshake(QByteArray const &infoHash,
+        QByteArray const &peerId, const char *reserved)
+{
+    Q_ASSERT(infoHash.size() == 20 && peerId.size() == 20);
+    char *p = out.reserve(BtWireSize::handshake);
+    p[0] = char(sizeof(protocolName) - 1);
+    memcpy(p + 1, protocolName, sizeof(protocolName) - 1);
+    if(reserved) memcpy(p + 20, reserved, 8);
+    else memset(p + 20, 0, 8);
+    memcpy(p + 28, infoHash.constData(), 20);
+    memcpy(p + 48, peerId.constData(), 20);
+    out.commit(BtWireSize::handshake);
+}
+
+void BtPeerWireWriter::keepAlive()
+{
+    writeUInt32(out.reserve(BtWireSize::keepAlive), 0);
+    out.commit(BtWireSize::keepAlive);
+}
+
+void BtPeerWireWriter::stateMessage(BtPeerMessageId id)
+{
+    writeHeader(out.reserve(BtWireSize::state), 1, id);
+    out.commit(BtWireSize::state);
+}
+
+void BtPeerWireWriter::choke()
+{
+    stateMessage(BtPeerMessageId::choke);
+}
+
+void BtPeerWireWriter::unchoke()
+{
+    stateMessage(BtPeerMessageId::unchoke);
+}
+
+void BtPeerWireWriter::interested()
+{
+    stateMessage(BtPeerMessageId::interested);
+}
+
+void BtPeerWireWriter::notInterested()
+{
+    stateMessage(BtPeerMessageId::notInterested);
+}
+
+void BtPeerWireWriter::have(quint32 index)
+{
+    char *p = writeHeader(out.reserve(BtWireSize::have), 5, BtPeerMessageId::have);
+    writeUInt32(p, index);
+    out.commit(BtWireSize::have);
+}
+
+void BtPeerWireWriter::bitfield(QBitArray const &bits)
+{
+    int size = BtWireSize::bitfield(bits.size());
+    char *p = writeHeader(out.reserve(size), size - 4, BtPeerMessageId::bitfield);
+    memset(p, 0, size - 5);
+    for(int i = 0; i < bits.size(); ++ i) {
+        if(bits.testBit(i)) p[i >> 3] |= char(0x80 >> (i & 7));
+    }
+    out.commit(size);
+}
+
+void BtPeerWireWriter::bitfield(const char *bits, int pieces)
+{
+    int size = BtWireSize::bitfield(pieces);
+    char *p = writeHeader(out.reserve(size), size - 4, BtPeerMessageId::bitfield);
+    memcpy(p, bits, size - 5);
+    /* Spare bits must be zero */
+    if(pieces & 7) p[size - 6] &= char(0xff << (8 - (pieces & 7)));
+    out.commit(size);
+}
+
+void BtPeerWireWriter::bitfield(BtPieceSet const &pieces)
+{
+    int size = 5 + pieces.wireSize();
+    char *p = writeHeader(out.reserve(size), size - 4, BtPeerMessageId::bitfield);
+    pieces.toWire(p);
+    out.commit(size);
+}
+
+void BtPeerWireWriter::blockMessage(BtPeerMessageId id, BtBlockRequest const &r)
+{
+    char *p = writeHeader(out.reserve(BtWireSize::request), 13, id);
+    writeUInt32(p, r.index);
+    writeUInt32(p + 4, r.begin);
+    writeUInt32(p + 8, r.length);
+    out.commit(BtWireSize::request);
+}
+
+void BtPeerWireWriter::request(BtBlockRequest const &r)
+{
+    blockMessage(BtPeerMessageId::request, r);
+}
+
+void BtPeerWireWriter::cancel(BtBlockRequest const &r)
+{
+    blockMessage(BtPeerMessageId::cancel, r);
+}
+
+void BtPeerWireWriter::pieceHeader(quint32 index, quint32 begin, int length)
+{
+    char *p = writeHeader(out.reserve(BtWireSize::pieceHeader), 9 + length,
+            BtPeerMessageId::piece);
+    writeUInt32(p, index);
+    writeUInt32(p + 4, begin);
+    out.commit(BtWireSize::pieceHeader);
+}
+
+void BtPeerWireWriter::piece(quint32 index, quint32 begin, const char *block, int length)
+{
+    /* One reserve for header and block, so they stay together */
+    char *p = writeHeader(out.reserve(BtWireSize::pieceHeader + length), 9 + length,
+            BtPeerMessageId::piece);
+    writeUInt32(p, index);
+    writeUInt32(p + 4, begin);
+    memcpy(p + 8, block, length);
+    out.commit(BtWireSize::pieceHeader + length);
+}
+
+bool BtPeerWireWriter::sendPiece(QAbstractSocket *socket, quint32 index,
+        quint32 begin, BtIoSlice const *slices, int count)
+{
+    int length = 0;
+    for(int i = 0; i < count; ++ i) length += slices[i].size;
+
+#ifdef Q_OS_UNIX
+    /* Going around Qt is only right when nothing is waiting before us */
+    qintptr fd = socket->socketDescriptor();
+    if(!encrypting && out.isEmpty() && socket->bytesToWrite() == 0 && fd != -1
+            && count <= MaxSlices) {
+        char header[BtWireSize::pieceHeader];
+        char *p = writeHeader(header, 9 + length, BtPeerMessageId::piece);
+        writeUInt32(p, index);
+        writeUInt32(p + 4, begin);
+
+        struct iovec iov[1 + MaxSlices];
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        for(int i = 0; i < count; ++ i) {
+            iov[i + 1].iov_base = const_cast<char *>(slices[i].data);
+            iov[i + 1].iov_len = slices[i].size;
+        }
+        ssize_t sent;
+        do {
+            sent = ::writev(int(fd), iov, count + 1);
+        } while(sent < 0 && errno == EINTR);
+        if(sent < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            sent = 0;
+        }
+
+        /* Queue the rest, Qt sends it when socket is writable again */
+        qint64 skip = sent;
+        for(int i = 0; i < count + 1; ++ i) {
+            qint64 size = qint64(iov[i].iov_len);
+            if(skip >= size) {
+                skip -= size;
+                continue;
+            }
+            raw(static_cast<const char *>(iov[i].iov_base) + skip, int(size - skip));
+            skip = 0;
+        }
+        return flush(socket) >= 0;
+    }
+#endif // Q_OS_UNIX
+
+    pieceHeader(index, begin, length);
+    for(int i = 0; i < count; ++ i) raw(slices[i].data, slices[i].size);
+    return flush(socket) >= 0;
+}
+
+void BtPeerWireWriter::port(quint16 listenPort)
+{
+    char *p = writeHeader(out.reserve(BtWireSize::port), 3, BtPeerMessageId::port);
+    qToBigEndian<quint16>(listenPort, reinterpret_cast<uchar *>(p));
+    out.commit(BtWireSize::port);
+}
+
+void BtPeerWireWriter::raw(const char *data, int size)
+{
+    memcpy(out.reserve(size), data, size);
+    out.commit(size);
+}
+
+void BtPeerWireWriter::suggest(quint32 index)
+{
+    char *p = writeHeader(out.reserve(BtWireSize::suggest), 5, BtPeerMessageId::suggest);
+    writeUInt32(p, index);
+    out.commit(BtWireSize::suggest);
+}
+
+void BtPeerWireWriter::haveAll()
+{
+    stateMessage(BtPeerMessageId::haveAll);
+}
+
+void BtPeerWireWriter::haveNone()
+{
+    stateMessage(BtPeerMessageId::haveNone);
+}
+
+void BtPeerWireWriter::rejectRequest(BtBlockRequest const &r)
+{
+    blockMessage(BtPeerMessageId::rejectRequest, r);
+}
+
+void BtPeerWireWriter::allowedFast(quint32 index)
+{
+    char *p = writeHeader(out.reserve(BtWireSize::allowedFast), 5,
+            BtPeerMessageId::allowedFast);
+    writeUInt32(p, index);
+    out.commit(BtWireSize::allowedFast);
+}
+
+void BtPeerWireWriter::extended(quint8 id, const char *payload, int size)
+{
+    char *p = writeHeader(out.reserve(6 + size), 2 + size, BtPeerMessageId::extended);
+    p[0] = char(id);
+    memcpy(p + 1, payload, size);
+    out.commit(6 + size);
+}
+
+qint64 BtPeerWireWriter::flush(QIODevice *device)
+{
+    if(out.isEmpty()) return 0;
+    if(encrypting && encrypted < out.size()) {
+        cipher.apply(out.data() + encrypted, out.size() - encrypted);
+        encrypted = out.size();
+    }
+    qint64 written = device->write(out.data(), out.size());
+    if(written > 0) {
+        out.consume(int(written));
+        encrypted -= int(written);
+    }
+    return written;
+}
+
+void BtPeerWireWriter::setEncryption(BtRc4 const &rc4)
+{
+    cipher = rc4;
+    encrypting = true;
+    encrypted = out.size();
+}
+
+bool BtPeerWireWriter::isEncrypted() const
+{
+    return encrypting;
+}
+
+BtPeerWireFramer::BtPeerWireFramer(BtPeerWireHandler *handler, bool expectHandshake)
+    : handler(handler), handshaken(!expectHandshake), fast(false),
+    extension(false), error(false), decrypting(false)
+{
+}
+
+bool BtPeerWireFramer::readFrom(QIODevice *device)
+{
+    qint64 read;
+    return readFrom(device, -1, read);
+}
+
+bool BtPeerWireFramer::readFrom(QIODevice *device, qint64 max, qint64 &read)
+{
+    read = 0;
+    if(error) return false;
+    for(;;) {
+        qint64 available = device->bytesAvailable();
+        if(max >= 0) available = qMin(available, max - read);
+        if(available <= 0) break;
+        int n = int(qMin<qint64>(available, ReadChunk));
+        char *p = buffer.reserve(n);
+        qint64 got = device->read(p, n);
+        if(got <= 0) break;
+        read += got;
+        if(decrypting) cipher.apply(p, int(got));
+        buffer.commit(int(got));
+        /* Cut messages before reading more, so buffer stays small */
+        if(!dispatch()) return false;
+    }
+    return true;
+}
+
+bool BtPeerWireFramer::feed(const char *data, int size)
+{
+    if(error) return false;
+    char *p = buffer.reserve(size);
+    memcpy(p, data, size);
+    if(decrypting) cipher.apply(p, size);
+    buffer.commit(size);
+    return dispatch();
+}
+
+bool BtPeerWireFramer::dispatch()
+{
+    for(;;) {
+        if(error) return false;
+        if(!handshaken) {
+            if(buffer.size() < HandshakeSize) return true;
+            const char *p = buffer.data();
+            if(quint8(p[0]) != sizeof(protocolName) - 1
+                    || memcmp(p + 1, protocolName, sizeof(protocolName) - 1) != 0) {
+                return fail("Not a BitTorrent handshake");
+            }
+            BtHandshakeView h;
+            h.reserved = p + 20;
+            h.infoHash = p + 28;
+            h.peerId = p + 48;
+            handshaken = true;
+            handler->handshakeReceived(h);
+            buffer.consume(HandshakeSize);
+            continue;
+        }
+
+        if(buffer.size() < 4) return true;
+        quint32 length = readUInt32(buffer.data());
+        if(length > MaxMessageLength) {
+            return fail(QString("Message of %1 bytes is too long").arg(length));
+        }
+        int frame = 4 + int(length);
+        if(buffer.size() < frame) {
+            /* Make sure the rest will land right after it */
+            buffer.reserve(frame - buffer.size());
+            return true;
+        }
+        if(!dispatchMessage(buffer.data() + 4, int(length))) return false;
+        buffer.consume(frame);
+    }
+}
+
+bool BtPeerWireFramer::dispatchMessage(const char *message, int size)
+{
+    if(error) return false;
+    if(size == 0) {
+        handler->keepAliveReceived();
+        return true;
+    }
+
+    quint8 id = quint8(message[0]);
+    const char *payload = message + 1;
+    int n = size - 1;
+    if(!fast && id >= quint8(BtPeerMessageId::suggest)
+            && id <= quint8(BtPeerMessageId::allowedFast)) {
+        handler->unknownReceived(id, payload, n);
+        return true;
+    }
+    switch(BtPeerMessageId(id)) {
+    case BtPeerMessageId::choke:
+    case BtPeerMessageId::unchoke:
+    case BtPeerMessageId::interested:
+    case BtPeerMessageId::notInterested:
+        if(n != 0) break;
+        if(id == quint8(BtPeerMessageId::choke)) handler->chokeReceived();
+        else if(id == quint8(BtPeerMessageId::unchoke)) handler->unchokeReceived();
+        else if(id == quint8(BtPeerMessageId::interested)) handler->interestedReceived();
+        else handler->notInterestedReceived();
+        return true;
+    case BtPeerMessageId::have:
+        if(n != 4) break;
+        handler->haveReceived(readUInt32(payload));
+        return true;
+    case BtPeerMessageId::bitfield:
+        handler->bitfieldReceived(payload, n);
+        return true;
+    case BtPeerMessageId::request:
+    case BtPeerMessageId::cancel:
+    case BtPeerMessageId::rejectRequest:
+        {
+            if(n != 12) break;
+            BtBlockRequest r;
+            r.index = readUInt32(payload);
+            r.begin = readUInt32(payload + 4);
+            r.length = readUInt32(payload + 8);
+            if(id == quint8(BtPeerMessageId::request)) handler->requestReceived(r);
+            else if(id == quint8(BtPeerMessageId::cancel)) handler->cancelReceived(r);
+            else handler->rejectReceived(r);
+            return true;
+        }
+    case BtPeerMessageId::piece:
+        {
+            if(n < 8) break;
+            BtBlockView b;
+            b.index = readUInt32(payload);
+            b.begin = readUInt32(payload + 4);
+            b.data = payload + 8;
+            b.length = n - 8;
+            handler->pieceReceived(b);
+            return true;
+        }
+    case BtPeerMessageId::port:
+        if(n != 2) break;
+        handler->portReceived(qFromBigEndian<quint16>(reinterpret_cast<const uchar *>(payload)));
+        return true;
+    case BtPeerMessageId::suggest:
+    case BtPeerMessageId::allowedFast:
+        if(n != 4) break;
+        if(id == quint8(BtPeerMessageId::suggest)) handler->suggestReceived(readUInt32(payload));
+        else handler->allowedFastReceived(readUInt32(payload));
+        return true;
+    case BtPeerMessageId::extended:
+        if(!extension) {
+            handler->unknownReceived(id, payload, n);
+            return true;
+        }
+        if(n < 1) break;
+        handler->extendedReceived(payload, n);
+        return true;
+    case BtPeerMessageId::haveAll:
+    case BtPeerMessageId::haveNone:
+        if(n != 0) break;
+        if(id == quint8(BtPeerMessageId::haveAll)) handler->haveAllReceived();
+        else handler->haveNoneReceived();
+        return true;
+    default:
+        handler->unknownReceived(id, payload, n);
+        return true;
+    }
+    return fail(QString("Message %1 has wrong length %2").arg(id).arg(size));
+}
+
+void BtPeerWireFramer::setFastExtension(bool fast)
+{
+    this->fast = fast;
+}
+
+bool BtPeerWireFramer::fastExtension() const
+{
+    return fast;
+}
+
+void BtPeerWireFramer::setExtensionProtocol(bool extension)
+{
+    this->extension = extension;
+}
+
+bool BtPeerWireFramer::extensionProtocol() const
+{
+    return extension;
+}
+
+bool BtPeerWireFramer::handshakeDone() const
+{
+    return handshaken;
+}
+
+bool BtPeerWireFramer::hasError() const
+{
+    return error;
+}
+
+QString BtPeerWireFramer::errorString() const
+{
+    return ErrorString;
+}
+
+int BtPeerWireFramer::pending() const
+{
+    return buffer.size();
+}
+
+void BtPeerWireFramer::reset(bool expectHandshake)
+{
+    buffer.clear();
+    handshaken = !expectHandshake;
+    fast = false;
+    extension = false;
+    error = false;
+    ErrorString.clear();
+    decrypting = false;
+}
+
+void BtPeerWireFramer::setDecryption(BtRc4 const &rc4)
+{
+    cipher = rc4;
+    decrypting = true;
+}
+
+bool BtPeerWireFramer::isEncrypted() const
+{
+    return decrypting;
+}
+
+void BtPeerWireFramer::abort(QString const &reason)
+{
+    if(!error) fail(reason);
+}
+
+bool BtPeerWireFramer::fail(QString const &reason)
+{
+    qDebug() << "Peer wire:" << reason;
+    error = true;
+    ErrorString = reason;
+    return false;
+}
@@ -0,0 +1,161 @@
+#include <BtPex.h>
+#include <BtBencode.h>
+#include <QDebug>
+
+using namespace BtQt;
+
+const char BtPex::Name[] = "ut_pex";
+const int BtPex::IntervalMs;
+const int BtPex::MaxPeers;
+const quint8 BtPex::FlagEncryption;
+const quint8 BtPex::FlagSeed;
+const quint8 BtPex::FlagOutgoing;
+
+BtPex::BtPex(QObject *parent)
+    : QObject(parent), Id(0)
+{
+}
+
+void BtPex::setId(quint8 id)
+{
+    Id = id;
+}
+
+quint8 BtPex::id() const
+{
+    return Id;
+}
+
+/* Append peers of a compact string, at most MaxPeers of them */
+static void appendCompact(QVector<BtPeerEndpoint> &out, const char *str, int len,
+        int size)
+{
+    if(len % size) throw -1;
+    int n = qMin(len / size, int(BtPex::MaxPeers));
+    for(int i = 0; i < n; ++ i, str += size) {
+        out.append(size == BtPeerEndpoint::CompactIPv4Size
+                ? BtPeerEndpoint::fromCompactIPv4(str)
+                : BtPeerEndpoint::fromCompactIPv6(str));
+    }
+}
+
+void BtPex::received(const char *payload, int size)
+{
+    /* Honest peers send once a minute, more is ignored rather than
+     * letting a peer flood the candidate pool */
+    if(lastReceived.isValid() && lastReceived.elapsed() < IntervalMs / 2) return;
+    lastReceived.start();
+
+    QVector<BtPeerEndpoint> added, dropped;
+    BtBencodeCursor c = { payload, payload + size };
+    try {
+        if(c.p == c.end || *c.p != 'd') throw -1;
+        ++ c.p;
+        while(c.p < c.end && *c.p != 'e') {
+            const char *key, *str;
+            int klen = c.readString(key);
+            int step = 0;
+            QVector<BtPeerEndpoint> *out = &added;
+            if(bencodeKeyIs(key, klen, "added")) {
+                step = BtPeerEndpoint::CompactIPv4Size;
+            } else if(bencodeKeyIs(key, klen, "added6")) {
+                step = BtPeerEndpoint::CompactIPv6Size;
+            } else if(bencodeKeyIs(key, klen, "dropped")) {
+                step = BtPeerEndpoint::CompactIPv4Size;
+                out = &dropped;
+            } else if(bencodeKeyIs(key, klen, "dropped6")) {
+                step = BtPeerEndpoint::CompactIPv6Size;
+                out = &dropped;
+            }
+            if(!step) {
+                c.skipValue();
+                continue;
+            }
+            int len = c.readString(str);
+            appendCompact(*out, str, len, step);
+        }
+    } catch (int e) {
+        qDebug() << "Broken ut_pex message";
+        return;
+    }
+
+    if(!added.isEmpty()) emit peersAdded(added);
+    if(!dropped.isEmpty()) emit peersDropped(dropped);
+}
+
+/* <len>:<compact peers of one family> */
+static void appendString(QByteArray &out, const char *key,
+        QVector<BtPeerEndpoint> const &peers, bool ipv4)
+{
+    int size = ipv4 ? BtPeerEndpoint::CompactIPv4Size : BtPeerEndpoint::CompactIPv6Size;
+    int n = 0;
+    for(auto const &e : peers) if(e.isIPv4() == ipv4) ++ n;
+    if(!n) return;
+
+    out.append(QByteArray::number(int(strlen(key)))).append(':').append(key);
+    out.append(QByteArray::number(n * size)).append(':');
+    int at = out.size();
+    out.resize(at + n * size);
+    char *o = out.data() + at;
+    for(auto const &e : peers) if(e.isIPv4() == ipv4) o += e.toCompact(o);
+}
+
+/* added.f / added6.f, we don't know flags of the peers we pass on */
+static void appendFlags(QByteArray &out, const char *key,
+        QVector<BtPeerEndpoint> const &peers, bool ipv4)
+{
+    int n = 0;
+    for(auto const &e : peers) if(e.isIPv4() == ipv4) ++ n;
+    if(!n) return;
+
+    out.append(QByteArray::number(int(strlen(key)))).append(':').append(key);
+    out.append(QByteArray::number(n)).append(':');
+    out.append(QByteArray(n, '\0'));
+}
+
+QByteArray BtPex::encode(QVector<BtPeerEndpoint> const &added,
+        QVector<BtPeerEndpoint> const &dropped)
+{
+    /* Keys of a dictionary must be sorted */
+    QByteArray ret;
+    ret.reserve(64 + (added.size() + dropped.size()) * (BtPeerEndpoint::CompactIPv6Size + 1));
+    ret.append('d');
+    appendString(ret, "added", added, true);
+    appendFlags(ret, "added.f", added, true);
+    appendString(ret, "added6", added, false);
+    appendFlags(ret, "added6.f", added, false);
+    appendString(ret, "dropped", dropped, true);
+    appendString(ret, "dropped6", dropped, false);
+    ret.append('e');
+    return ret;
+}
+
+bool BtPex::update(BtPeerWireWriter &writer, BtExtensionTable const &table,
+        QVector<BtPeerEndpoint> const &connected, BtPeerEndpoint const &self)
+{
+    if(!Id || !table.peerSupports(Id)) return false;
+    if(lastSent.isValid() && lastSent.elapsed() < IntervalMs) return false;
+
+    QSet<BtPeerEndpoint> now;
+    now.reserve(connected.size());
+    QVector<BtPeerEndpoint> added, dropped;
+    for(auto const &e : connected) {
+        if(e == self) continue;
+        now.insert(e);
+        if(added.size() < MaxPeers && !sent.contains(e)) added.append(e);
+    }
+    for(auto const &e : sent) {
+        if(dropped.size() == MaxPeers) break;
+        if(!now.contains(e)) dropped.append(e);
+    }
+    if(added.isEmpty() && dropped.isEmpty()) return false;
+
+    /* What did not fit waits for the next message */
+    for(auto const &e : added) sent.insert(e);
+    for(auto const &e : dropped) sent.remove(e);
+
+    QByteArray payload = encode(added, dropped);
+    table.write(writer, Id, payload.constData(), payload.size());
+    lastSent.start();
+    return true;
+}
@@ -0,0 +1,159 @@
+#include <BtPicker.h>
+
+#include <QtGlobal>
+
+using namespace BtQt;
+
+BtPicker::BtPicker(int pieceCount)
+{
+    reset(pieceCount);
+}
+
+void BtPicker::reset(int pieceCount)
+{
+    count.fill(0, pieceCount);
+    position.fill(-1, pieceCount);
+    flags.fill(0, pieceCount);
+    buckets.clear();
+    seeds = 0;
+    for(int i = 0; i < pieceCount; ++ i) insert(i);
+}
+
+int BtPicker::pieceCount() const
+{
+    return count.size();
+}
+
+void BtPicker::insert(int index)
+{
+    int b = count.at(index);
+    if(buckets.size() <= b) buckets.resize(b + 1);
+    QVector<int> &bucket = buckets[b];
+    bucket.append(index);
+    position[index] = bucket.size() - 1;
+
+    /* Random order among pieces of the same availability, so that peers
+     * do not all go for the same 'rarest' piece */
+    int other = qrand() % bucket.size();
+    if(other != position.at(index)) {
+        int swapped = bucket.at(other);
+        bucket[position.at(index)] = swapped;
+        position[swapped] = position.at(index);
+        bucket[other] = index;
+        position[index] = other;
+    }
+}
+
+void BtPicker::remove(int index)
+{
+    int p = position.at(index);
+    if(p < 0) return;
+    QVector<int> &bucket = buckets[count.at(index)];
+    int last = bucket.last();
+    bucket[p] = last;
+    position[last] = p;
+    bucket.removeLast();
+    position[index] = -1;
+}
+
+void BtPicker::setCount(int index, int to)
+{
+    if(position.at(index) < 0) {
+        count[index] = to;
+        return;
+    }
+    remove(index);
+    count[index] = to;
+    insert(index);
+}
+
+void BtPicker::peerHas(int index)
+{
+    if(index < 0 || index >= count.size()) return;
+    setCount(index, count.at(index) + 1);
+}
+
+void BtPicker::peerBitfield(BtPieceSet const &bits)
+{
+    int n = qMin(bits.size(), count.size());
+    for(int i = bits.findFirst(); i >= 0 && i < n; i = bits.findFirst(i + 1)) {
+        setCount(i, count.at(i) + 1);
+    }
+}
+
+void BtPicker::peerLost(BtPieceSet const &bits)
+{
+    int n = qMin(bits.size(), count.size());
+    for(int i = bits.findFirst(); i >= 0 && i < n; i = bits.findFirst(i + 1)) {
+        if(count.at(i) > 0) setCount(i, count.at(i) - 1);
+    }
+}
+
+void BtPicker::seedJoined()
+{
+    ++ seeds;
+}
+
+void BtPicker::seedLeft()
+{
+    if(seeds > 0) -- seeds;
+}
+
+void BtPicker::weHave(int index)
+{
+    if(index < 0 || index >= count.size()) return;
+    flags[index] |= Have;
+    remove(index);
+}
+
+void BtPicker::setWanted(int index, bool wanted)
+{
+    if(index < 0 || index >= count.size()) return;
+    if(wanted) {
+        flags[index] &= ~Unwanted;
+        if(!(flags.at(index) & (Have | Busy)) && position.at(index) < 0) insert(index);
+    } else {
+        flags[index] |= Unwanted;
+        remove(index);
+    }
+}
+
+void BtPicker::setBusy(int index, bool busy)
+{
+    if(index < 0 || index >= count.size()) return;
+    if(busy) {
+        flags[index] |= Busy;
+        remove(index);
+    } else {
+        flags[index] &= ~Busy;
+        if(!(flags.at(index) & (Have | Unwanted)) && position.at(index) < 0) insert(index);
+    }
+}
+
+int BtPicker::availability(int index) const
+{
+    return count.at(index) + seeds;
+}
+
+bool BtPicker::isWanted(int index) const
+{
+    return !(flags.at(index) & (Have | Unwanted));
+}
+
+bool BtPicker::allBusy() const
+{
+    for(auto const &bucket : buckets) {
+        if(!bucket.isEmpty()) return false;
+    }
+    return true;
+}
+
+int BtPicker::pick(BtPieceSet const &peerHas, bool isSeed) const
+{
+    for(int b = isSeed ? 0 : 1; b < buckets.size(); ++ b) {
+        for(auto index : buckets.at(b)) {
+            if(index < peerHas.size() && peerHas.test(index)) return index;
+        }
+    }
+    return -1;
+}
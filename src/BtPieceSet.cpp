@@ -0,0 +1,216 @@
+#include <BtPieceSet.h>
+
+#include <QtAlgorithms>
+#include <QtEndian>
+
+#include <cstring>
+
+using namespace BtQt;
+
+/* Highest set bit counts as 0, word must not be zero */
+static inline int leadingZeros(quint64 word)
+{
+#if defined(Q_CC_GNU)
+    return __builtin_clzll(word);
+#else
+    int n = 0;
+    while(!(word & (quint64(1) << 63))) {
+        word <<= 1;
+        ++ n;
+    }
+    return n;
+#endif
+}
+
+static inline int wordCount(int size)
+{
+    return (size + 63) >> 6;
+}
+
+BtPieceSet::BtPieceSet()
+    : Size(0)
+{
+}
+
+BtPieceSet::BtPieceSet(int size, bool value)
+    : words(wordCount(size), value ? ~quint64(0) : 0), Size(size)
+{
+    trim();
+}
+
+int BtPieceSet::size() const
+{
+    return Size;
+}
+
+void BtPieceSet::resize(int size)
+{
+    /* Spare bits are zero already, new words too */
+    words.resize(wordCount(size));
+    Size = size;
+    trim();
+}
+
+void BtPieceSet::fill(bool value)
+{
+    words.fill(value ? ~quint64(0) : 0);
+    trim();
+}
+
+void BtPieceSet::trim()
+{
+    int spare = words.size() * 64 - Size;
+    if(spare > 0) words.last() &= ~quint64(0) << spare;
+}
+
+int BtPieceSet::count() const
+{
+    int n = 0;
+    for(auto w : words) n += qPopulationCount(w);
+    return n;
+}
+
+bool BtPieceSet::isFull() const
+{
+    return count() == Size;
+}
+
+bool BtPieceSet::isNone() const
+{
+    for(auto w : words) if(w) return false;
+    return true;
+}
+
+int BtPieceSet::findFirst(int from) const
+{
+    if(from >= Size) return -1;
+    int i = from >> 6;
+    /* Drop bits before from */
+    quint64 w = words.at(i) & (~quint64(0) >> (from & 63));
+    for(;;) {
+        if(w) return (i << 6) + leadingZeros(w);
+        if(++ i == words.size()) return -1;
+        w = words.at(i);
+    }
+}
+
+bool BtPieceSet::anyAndNot(BtPieceSet const &other) const
+{
+    Q_ASSERT(other.Size == Size);
+    for(int i = 0; i < words.size(); ++ i) {
+        if(words.at(i) & ~other.words.at(i)) return true;
+    }
+    return false;
+}
+
+int BtPieceSet::countAndNot(BtPieceSet const &other) const
+{
+    Q_ASSERT(other.Size == Size);
+    int n = 0;
+    for(int i = 0; i < words.size(); ++ i) {
+        n += qPopulationCount(words.at(i) & ~other.words.at(i));
+    }
+    return n;
+}
+
+int BtPieceSet::firstAndNot(BtPieceSet const &other, int from) const
+{
+    Q_ASSERT(other.Size == Size);
+    if(from >= Size) return -1;
+    int i = from >> 6;
+    quint64 w = words.at(i) & ~other.words.at(i) & (~quint64(0) >> (from & 63));
+    for(;;) {
+        if(w) return (i << 6) + leadingZeros(w);
+        if(++ i == words.size()) return -1;
+        w = words.at(i) & ~other.words.at(i);
+    }
+}
+
+BtPieceSet &BtPieceSet::andNot(BtPieceSet const &other)
+{
+    Q_ASSERT(other.Size == Size);
+    for(int i = 0; i < words.size(); ++ i) words[i] &= ~other.words.at(i);
+    return *this;
+}
+
+BtPieceSet &BtPieceSet::operator&=(BtPieceSet const &other)
+{
+    Q_ASSERT(other.Size == Size);
+    for(int i = 0; i < words.size(); ++ i) words[i] &= other.words.at(i);
+    return *this;
+}
+
+BtPieceSet &BtPieceSet::operator|=(BtPieceSet const &other)
+{
+    Q_ASSERT(other.Size == Size);
+    for(int i = 0; i < words.size(); ++ i) words[i] |= other.words.at(i);
+    return *this;
+}
+
+bool BtPieceSet::operator==(BtPieceSet const &other) const
+{
+    return Size == other.Size && words == other.words;
+}
+
+bool BtPieceSet::operator!=(BtPieceSet const &other) const
+{
+    return !(*this == other);
+}
+
+int BtPieceSet::wireSize() const
+{
+    return (Size + 7) >> 3;
+}
+
+void BtPieceSet::toWire(char *out) const
+{
+    int bytes = wireSize();
+    int full = bytes >> 3;
+    uchar *o = reinterpret_cast<uchar *>(out);
+    for(int i = 0; i < full; ++ i) qToBigEndian<quint64>(words.at(i), o + (i << 3));
+    if(bytes & 7) {
+        uchar last[8];
+        qToBigEndian<quint64>(words.at(full), last);
+        memcpy(o + (full << 3), last, bytes & 7);
+    }
+}
+
+QByteArray BtPieceSet::toWire() const
+{
+    QByteArray ret(wireSize(), Qt::Uninitialized);
+    toWire(ret.data());
+    return ret;
+}
+
+bool BtPieceSet::fromWire(const char *bits, int size)
+{
+    if(size != wireSize()) return false;
+    const uchar *b = reinterpret_cast<const uchar *>(bits);
+    int full = size >> 3;
+    for(int i = 0; i < full; ++ i) words[i] = qFromBigEndian<quint64>(b + (i << 3));
+    if(size & 7) {
+        uchar last[8] = { 0 };
+        memcpy(last, b + (full << 3), size & 7);
+        words[full] = qFromBigEndian<quint64>(last);
+    }
+    if(words.isEmpty()) return true;
+    quint64 before = words.last();
+    trim();
+    return words.last() == before;
+}
+
+QBitArray BtPieceSet::toBitArray() const
+{
+    QBitArray ret(Size);
+    for(int i = findFirst(); i >= 0; i = findFirst(i + 1)) ret.setBit(i);
+    return ret;
+}
+
+BtPieceSet BtPieceSet::fromBitArray(QBitArray const &bits)
+{
+    BtPieceSet ret(bits.size());
+    for(int i = 0; i < bits.size(); ++ i) {
+        if(bits.testBit(i)) ret.set(i);
+    }
+    return ret;
+}
@@ -0,0 +1,195 @@
+#include <BtPipeline.h>
+
+using namespace BtQt;
+
+const int BtPipeline::BlockSize;
+const int BtPipeline::MinDepth;
+const int BtPipeline::MaxDepth;
+const int BtPipeline::DepthGain;
+const int BtPipeline::DepthSlack;
+const int BtPipeline::RttWindowMs;
+const int BtPipeline::RateWindowMs;
+const int BtPipeline::DefaultTimeoutMs;
+
+BtPipeline::BtPipeline(int maxDepth)
+    : MaxDepthOfPeer(qMax(maxDepth, 1)), TimeoutMs(DefaultTimeoutMs),
+    Depth(qMin(int(MinDepth), MaxDepthOfPeer)), fast(false), minRtt(-1), lastMinRtt(-1),
+    rttWindowStart(0), Rate(0), rateBytes(0), rateWindowStart(0)
+{
+    clock.start();
+}
+
+void BtPipeline::setMaxDepth(int maxDepth)
+{
+    MaxDepthOfPeer = qMax(maxDepth, 1);
+    Depth = qMin(Depth, MaxDepthOfPeer);
+}
+
+int BtPipeline::maxDepth() const
+{
+    return MaxDepthOfPeer;
+}
+
+void BtPipeline::setTimeout(int ms)
+{
+    TimeoutMs = ms;
+}
+
+void BtPipeline::setFastExtension(bool fast)
+{
+    this->fast = fast;
+}
+
+int BtPipeline::depth() const
+{
+    return Depth;
+}
+
+int BtPipeline::outstanding() const
+{
+    return pending.size();
+}
+
+int BtPipeline::wanted() const
+{
+    return qMax(Depth - pending.size(), 0);
+}
+
+bool BtPipeline::isRequested(BtBlockRequest const &r) const
+{
+    return find(r.index, r.begin) >= 0;
+}
+
+qint64 BtPipeline::rate() const
+{
+    return Rate;
+}
+
+int BtPipeline::rtt() const
+{
+    if(minRtt < 0) return lastMinRtt;
+    if(lastMinRtt < 0) return minRtt;
+    return qMin(minRtt, lastMinRtt);
+}
+
+int BtPipeline::find(quint32 index, quint32 begin) const
+{
+    for(int i = 0; i < pending.size(); ++ i) {
+        const BtBlockRequest &r = pending.at(i).request;
+        if(r.index == index && r.begin == begin) return i;
+    }
+    return -1;
+}
+
+void BtPipeline::requested(BtBlockRequest const &r)
+{
+    qint64 now = clock.elapsed();
+    /* Idle time is not slowness of the peer */
+    if(pending.isEmpty()) {
+        rateBytes = 0;
+        rateWindowStart = now;
+    }
+    Pending p;
+    p.request = r;
+    p.sentAt = now;
+    pending.append(p);
+}
+
+bool BtPipeline::received(quint32 index, quint32 begin, int length)
+{
+    int i = find(index, begin);
+    if(i < 0) return false;
+    int latency = int(clock.elapsed() - pending.at(i).sentAt);
+    pending.remove(i);
+    sample(latency, length);
+    return true;
+}
+
+void BtPipeline::sample(int latency, int length)
+{
+    qint64 now = clock.elapsed();
+
+    if(now - rttWindowStart >= RttWindowMs) {
+        lastMinRtt = minRtt;
+        minRtt = -1;
+        rttWindowStart = now;
+    }
+    if(minRtt < 0 || latency < minRtt) minRtt = latency;
+
+    rateBytes += length;
+    qint64 elapsed = now - rateWindowStart;
+    if(elapsed >= RateWindowMs) {
+        qint64 r = rateBytes * 1000 / elapsed;
+        Rate = Rate == 0 ? r : (Rate * 3 + r) / 4;
+        rateBytes = 0;
+        rateWindowStart = now;
+    }
+
+    updateDepth();
+}
+
+void BtPipeline::updateDepth()
+{
+    if(Rate == 0) {
+        /* Slow start */
+        Depth = qMin(Depth + 1, MaxDepthOfPeer);
+        return;
+    }
+    qint64 bdp = Rate * qMax(rtt(), 1) / 1000 / BlockSize;
+    qint64 d = bdp * DepthGain / 100 + DepthSlack;
+    Depth = int(qBound<qint64>(qMin(int(MinDepth), MaxDepthOfPeer), d, MaxDepthOfPeer));
+}
+
+bool BtPipeline::cancel(BtBlockRequest const &r)
+{
+    int i = find(r.index, r.begin);
+    if(i < 0) return false;
+    pending.remove(i);
+    return true;
+}
+
+bool BtPipeline::cancel(BtPeerWireWriter &writer, BtBlockRequest const &r)
+{
+    if(!cancel(r)) return false;
+    writer.cancel(r);
+    return true;
+}
+
+bool BtPipeline::rejected(BtBlockRequest const &r)
+{
+    return cancel(r);
+}
+
+QVector<BtBlockRequest> BtPipeline::choked()
+{
+    if(fast) return QVector<BtBlockRequest>();
+    return clear();
+}
+
+QVector<BtBlockRequest> BtPipeline::timedOut(BtPeerWireWriter &writer)
+{
+    QVector<BtBlockRequest> ret;
+    qint64 now = clock.elapsed();
+    /* Sent in order, so the old ones are at the front */
+    int n = 0;
+    while(n < pending.size() && now - pending.at(n).sentAt >= TimeoutMs) {
+        writer.cancel(pending.at(n).request);
+        ret.append(pending.at(n).request);
+        ++ n;
+    }
+    if(n > 0) {
+        pending.remove(0, n);
+        /* The peer is slower than we thought */
+        Depth = qMax(qMin(int(MinDepth), MaxDepthOfPeer), Depth / 2);
+    }
+    return ret;
+}
+
+QVector<BtBlockRequest> BtPipeline::clear()
+{
+    QVector<BtBlockRequest> ret;
+    ret.reserve(pending.size());
+    for(auto p : pending) ret.append(p.request);
+    pending.clear();
+    return ret;
+}
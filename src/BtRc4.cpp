@@ -0,0 +1,65 @@
+#include <BtRc4.h>
+
+using namespace BtQt;
+
+const int BtRc4::Discard;
+
+BtRc4::BtRc4()
+    : i(0), j(0), keyed(false)
+{
+}
+
+void BtRc4::setKey(const char *key, int size, int discard)
+{
+    for(int n = 0; n < 256; ++ n) s[n] = quint8(n);
+    quint8 k = 0;
+    for(int n = 0; n < 256; ++ n) {
+        k += s[n] + quint8(key[n % size]);
+        quint8 t = s[n];
+        s[n] = s[k];
+        s[k] = t;
+    }
+    i = j = 0;
+    keyed = true;
+    skip(discard);
+}
+
+bool BtRc4::isKeyed() const
+{
+    return keyed;
+}
+
+void BtRc4::apply(char *data, int size)
+{
+    /* Locals let the compiler keep i, j in registers across the loop */
+    quint8 x = i, y = j;
+    quint8 *state = s;
+    uchar *p = reinterpret_cast<uchar *>(data);
+    uchar *end = p + size;
+    while(p != end) {
+        ++ x;
+        quint8 a = state[x];
+        y += a;
+        quint8 b = state[y];
+        state[x] = b;
+        state[y] = a;
+        *p ++ ^= state[quint8(a + b)];
+    }
+    i = x;
+    j = y;
+}
+
+void BtRc4::skip(int size)
+{
+    quint8 x = i, y = j;
+    quint8 *state = s;
+    for(int n = 0; n < size; ++ n) {
+        ++ x;
+        quint8 a = state[x];
+        y += a;
+        state[x] = state[y];
+        state[y] = a;
+    }
+    i = x;
+    j = y;
+}
@@ -0,0 +1,125 @@
+#include <BtReactor.h>
+#include <QCoreApplication>
+#include <QSemaphore>
+#include <QDebug>
+
+#include <random>
+
+using namespace BtQt;
+
+const int BtReactor::TickMs;
+
+BtReactorWorker::BtReactorWorker()
+    : load(0), ticker(this), scheduled(false)
+{
+    ticker.setTimerType(Qt::CoarseTimer);
+}
+
+void BtReactorWorker::post(std::function<void()> task)
+{
+    tasks.push(std::move(task));
+    /* Only the first post of a batch wakes the worker up */
+    if(!scheduled.exchange(true))
+        QMetaObject::invokeMethod(this, "drain", Qt::QueuedConnection);
+}
+
+void BtReactorWorker::drain()
+{
+    /* Posts from now on wake us up again, anything pushed before is
+     * popped below. A push caught halfway is left to its own wake-up. */
+    scheduled.store(false);
+    std::function<void()> task;
+    while(tasks.pop(task)) task();
+}
+
+BtReactor::BtReactor(int threadCount, QObject *parent)
+    : QObject(parent)
+{
+    if(threadCount <= 0) threadCount = qMax(1, QThread::idealThreadCount());
+    for(int i = 0; i < threadCount; ++ i) {
+        QThread *thread = new QThread;
+        thread->setObjectName(QString("BtReactor %1").arg(i));
+        BtReactorWorker *worker = new BtReactorWorker;
+        worker->moveToThread(thread);
+        thread->start();
+        /* Timers start in the thread they live in. qrand() has a seed per
+         * thread, one never seeded gives what every other process gives,
+         * and the picker and the choker would pick alike everywhere. */
+        worker->post([worker]() {
+                    std::random_device entropy;
+                    qsrand(entropy());
+                    worker->ticker.start(TickMs);
+                });
+        threads.append(thread);
+        workers.append(worker);
+    }
+}
+
+BtReactor::~BtReactor()
+{
+    for(auto thread : threads) thread->quit();
+    for(int i = 0; i < threads.size(); ++ i) {
+        threads.at(i)->wait();
+        if(workers.at(i)->load.load())
+            qDebug() << "BtReactor: worker" << i << "still has objects";
+        delete workers.at(i);
+        delete threads.at(i);
+    }
+}
+
+BtReactor *BtReactor::shared()
+{
+    /* Parented to the application, so it goes away with the event loop */
+    static BtReactor *reactor = new BtReactor(0, QCoreApplication::instance());
+    return reactor;
+}
+
+int BtReactor::threadCount() const
+{
+    return threads.size();
+}
+
+QThread *BtReactor::workerThread(int worker) const
+{
+    return threads.at(worker);
+}
+
+QTimer *BtReactor::ticker(int worker) const
+{
+    return &workers.at(worker)->ticker;
+}
+
+int BtReactor::attach(QObject *object)
+{
+    int best = 0;
+    for(int i = 1; i < workers.size(); ++ i) {
+        if(workers.at(i)->load.load() < workers.at(best)->load.load()) best = i;
+    }
+    ++ workers.at(best)->load;
+    object->moveToThread(threads.at(best));
+    return best;
+}
+
+void BtReactor::detach(int worker)
+{
+    -- workers.at(worker)->load;
+}
+
+void BtReactor::post(int worker, std::function<void()> task)
+{
+    workers.at(worker)->post(std::move(task));
+}
+
+void BtReactor::run(int worker, std::function<void()> task)
+{
+    if(QThread::currentThread() == threads.at(worker)) {
+        task();
+        return;
+    }
+    QSemaphore done;
+    workers.at(worker)->post([&task, &done]() {
+        task();
+        done.release();
+    });
+    done.acquire();
+}
@@ -0,0 +1,216 @@
+#include <BtSession.h>
+#include <BtPeer.h>
+#include <QDir>
+#include <QTimer>
+#include <QDebug>
+
+using namespace BtQt;
+
+const int BtSession::DefaultMaxConnections;
+
+BtSession::BtSession(quint16 listenPort, int threads, QObject *parent)
+    : QObject(parent), PeerId(generatePeerId()), directory(QDir::currentPath()),
+    policy(BtEncryptionPolicy::enabled), Reactor(threads, this), Scheduler(this),
+    Listener(this), limit(DefaultMaxConnections)
+{
+    /* Looked up once, not by every torrent */
+    BtCore::globalAddresses(ipv4, ipv6);
+    Listener.setEncryptionPolicy(policy);
+    Listener.listen(listenPort);
+}
+
+BtSession::~BtSession()
+{
+    Listener.close();
+    entries.unite(removing);
+    removing.clear();
+    for(auto const &e : entries) {
+        /* Swarms still flush their files, only the announce is lost */
+        e.core->setStoppedCallback(nullptr);
+        e.core->stop();
+        delete e.core;
+        delete e.torrent;
+    }
+    entries.clear();
+}
+
+void BtSession::shutdown()
+{
+    Listener.close();
+    /* Every stop is bounded by its own timer, they all run at once */
+    for(auto const &e : entries) {
+        e.core->stop();
+        if(e.core->state() == BtTorrentState::stopping) waiting.insert(e.core);
+    }
+    for(auto const &e : removing) waiting.insert(e.core);
+    if(waiting.isEmpty()) QTimer::singleShot(0, this, [this]() { emit shutdownFinished(); });
+}
+
+void BtSession::coreStopped(BtCore *core)
+{
+    for(auto it = removing.begin(); it != removing.end(); ++ it) {
+        if(it->core != core) continue;
+        delete it->core;
+        delete it->torrent;
+        removing.erase(it);
+        break;
+    }
+    if(waiting.remove(core) && waiting.isEmpty()) emit shutdownFinished();
+}
+
+bool BtSession::isListening() const
+{
+    return Listener.isListening();
+}
+
+quint16 BtSession::port() const
+{
+    return Listener.port();
+}
+
+QByteArray BtSession::peerId() const
+{
+    return PeerId;
+}
+
+void BtSession::setDownloadDirectory(QString const &directory)
+{
+    this->directory = directory;
+}
+
+QString BtSession::downloadDirectory() const
+{
+    return directory;
+}
+
+void BtSession::setEncryptionPolicy(BtEncryptionPolicy policy)
+{
+    this->policy = policy;
+    Listener.setEncryptionPolicy(policy);
+}
+
+BtEncryptionPolicy BtSession::encryptionPolicy() const
+{
+    return policy;
+}
+
+void BtSession::setMaxConnections(int max)
+{
+    limit.setMaximum(qMax(1, max));
+}
+
+int BtSession::maxConnections() const
+{
+    return limit.maximum();
+}
+
+int BtSession::connectionCount() const
+{
+    return limit.count();
+}
+
+void BtSession::setUploadRateLimit(qint64 rate)
+{
+    uploadLimit.setRate(rate);
+}
+
+qint64 BtSession::uploadRateLimit() const
+{
+    return uploadLimit.rate();
+}
+
+void BtSession::setDownloadRateLimit(qint64 rate)
+{
+    downloadLimit.setRate(rate);
+}
+
+qint64 BtSession::downloadRateLimit() const
+{
+    return downloadLimit.rate();
+}
+
+BtCore *BtSession::addTorrent(BtTorrent const &torrent)
+{
+    QByteArray infoHash = torrent.infoHash();
+    if(entries.contains(infoHash) || removing.contains(infoHash)) return 0;
+    Entry e;
+    e.torrent = new BtTorrent(torrent);
+    e.core = new BtCore(*e.torrent, *this);
+    BtCore *core = e.core;
+    /* Queued, the core may be deleted there */
+    e.core->setStoppedCallback([this, core]() {
+                QTimer::singleShot(0, this, [this, core]() { coreStopped(core); });
+            });
+    entries.insert(infoHash, e);
+    return e.core;
+}
+
+BtCore *BtSession::torrent(QByteArray const &infoHash) const
+{
+    auto it = entries.find(infoHash);
+    return it == entries.end() ? 0 : it->core;
+}
+
+QList<BtCore *> BtSession::torrents() const
+{
+    QList<BtCore *> cores;
+    for(auto const &e : entries) cores.append(e.core);
+    return cores;
+}
+
+int BtSession::torrentCount() const
+{
+    return entries.size();
+}
+
+void BtSession::removeTorrent(QByteArray const &infoHash)
+{
+    auto it = entries.find(infoHash);
+    if(it == entries.end()) return;
+    Entry e = it.value();
+    entries.erase(it);
+    e.core->stop();
+    if(e.core->state() == BtTorrentState::stopped) {
+        delete e.core;
+        delete e.torrent;
+        return;
+    }
+    /* Deleting it now would drop the stopped announce */
+    removing.insert(infoHash, e);
+}
+
+BtListener *BtSession::listener()
+{
+    return &Listener;
+}
+
+BtAnnounceScheduler *BtSession::scheduler()
+{
+    return &Scheduler;
+}
+
+BtReactor *BtSession::reactor()
+{
+    return &Reactor;
+}
+
+BtConnectionLimit *BtSession::connectionLimit()
+{
+    return &limit;
+}
+
+BtTokenBucket *BtSession::uploadBucket()
+{
+    return &uploadLimit;
+}
+
+BtTokenBucket *BtSession::downloadBucket()
+{
+    return &downloadLimit;
+}
+
+void BtSession::globalAddresses(QHostAddress &ipv4, QHostAddress &ipv6) const
+{
+    ipv4 = this->ipv4;
+    ipv6 = this->ipv6;
+}
@@ -0,0 +1,253 @@
+#include <BtStorage.h>
+#include <QDir>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QCryptographicHash>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif // Q_OS_UNIX
+
+using namespace BtQt;
+
+const int BtStorage::MappedPieces;
+
+BtStorage::BtStorage(BtTorrent const &torrent, QString const &directory)
+    : directory(directory), name(torrent.name()), totalLength(torrent.length()),
+    PieceLength(torrent.pieceLength()), PieceCount(torrent.pieceCount()),
+    opened(false), existing(false)
+{
+    QDir root(directory);
+    if(torrent.isMultiFile()) {
+        qint64 offset = 0;
+        for(auto f : torrent.files()) {
+            QStringList path;
+            for(auto p : f.value("path").toList()) {
+                path.append(QString::fromUtf8(p.toByteArray()));
+            }
+            File file;
+            file.file = new QFile(root.filePath(name + "/" + path.join("/")));
+            file.offset = offset;
+            file.length = f.value("length").toLongLong();
+            files.append(file);
+            offset += file.length;
+        }
+    } else {
+        File file;
+        file.file = new QFile(root.filePath(name));
+        file.offset = 0;
+        file.length = totalLength;
+        files.append(file);
+    }
+}
+
+BtStorage::~BtStorage()
+{
+    close();
+    for(auto f : files) delete f.file;
+}
+
+bool BtStorage::open()
+{
+    if(opened) return true;
+    for(auto &f : files) {
+        QFileInfo info(f.file->fileName());
+        QDir().mkpath(info.absolutePath());
+        /* Unbuffered, so a write is in the page cache and in the
+         * mappings once it returns */
+        if(!f.file->open(QIODevice::ReadWrite | QIODevice::Unbuffered)) {
+            qDebug() << "Can not open" << f.file->fileName() << f.file->errorString();
+            close();
+            return false;
+        }
+        if(f.length == 0) continue;
+        if(f.file->size() > 0) existing = true;
+        /* Sparse, the blocks are written when they come */
+        if(f.file->size() != f.length && !f.file->resize(f.length)) {
+            qDebug() << "Can not resize" << f.file->fileName() << f.file->errorString();
+            close();
+            return false;
+        }
+    }
+    opened = true;
+    return true;
+}
+
+void BtStorage::flush()
+{
+    if(!opened) return;
+#ifdef Q_OS_UNIX
+    for(auto const &f : files) ::fsync(f.file->handle());
+#endif // Q_OS_UNIX
+    /* Elsewhere closing the files writes them back */
+}
+
+void BtStorage::close()
+{
+    for(auto const &p : mapped) unmap(p);
+    mapped.clear();
+    for(auto &f : files) f.file->close();
+    opened = false;
+}
+
+bool BtStorage::isOpen() const
+{
+    return opened;
+}
+
+bool BtStorage::hadData() const
+{
+    return existing;
+}
+
+QList<qint64> BtStorage::fileTimes() const
+{
+    QList<qint64> times;
+    for(auto const &f : files) {
+        QFileInfo info(f.file->fileName());
+        qint64 t = -1;
+        if(info.exists() && info.size() == f.length)
+            t = info.lastModified().toMSecsSinceEpoch();
+        times.append(t);
+    }
+    return times;
+}
+
+int BtStorage::pieceCount() const
+{
+    return PieceCount;
+}
+
+qint64 BtStorage::pieceSize(int index) const
+{
+    if(index < 0 || index >= PieceCount) return 0;
+    if(index == PieceCount - 1) return totalLength - PieceLength * index;
+    return PieceLength;
+}
+
+int BtStorage::fileAt(qint64 offset) const
+{
+    /* First file ending after offset */
+    int lo = 0, hi = files.size() - 1;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        const File &f = files.at(mid);
+        if(f.offset + f.length <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+bool BtStorage::blockOffset(quint32 index, quint32 begin, int length, qint64 &offset) const
+{
+    if(!opened || length <= 0 || int(index) >= PieceCount
+            || begin + qint64(length) > pieceSize(index)) {
+        return false;
+    }
+    offset = PieceLength * index + begin;
+    return true;
+}
+
+BtStorage::MappedPiece const *BtStorage::mapPiece(int index) const
+{
+    for(int i = 0; i < mapped.size(); ++ i) {
+        if(mapped.at(i).index != index) continue;
+        if(i > 0) mapped.move(i, 0);
+        return &mapped.first();
+    }
+
+    MappedPiece p;
+    p.index = index;
+    qint64 offset = PieceLength * index;
+    qint64 length = pieceSize(index);
+    for(int i = fileAt(offset); length > 0 && i < files.size(); ++ i) {
+        const File &f = files.at(i);
+        if(f.length == 0) continue;
+        Window w;
+        w.file = i;
+        w.from = offset - f.offset;
+        w.size = qMin(length, f.length - w.from);
+        w.map = f.file->map(w.from, w.size);
+        if(!w.map) {
+            qDebug() << "Can not map" << f.file->fileName() << f.file->errorString();
+            unmap(p);
+            return 0;
+        }
+        p.windows.append(w);
+        offset += w.size;
+        length -= w.size;
+    }
+    if(mapped.size() >= MappedPieces) {
+        unmap(mapped.last());
+        mapped.removeLast();
+    }
+    mapped.prepend(p);
+    return &mapped.first();
+}
+
+void BtStorage::unmap(MappedPiece const &p) const
+{
+    for(auto const &w : p.windows) files.at(w.file).file->unmap(w.map);
+}
+
+int BtStorage::slices(quint32 index, quint32 begin, int length,
+        BtIoSlice *slices, int max) const
+{
+    qint64 offset;
+    if(!blockOffset(index, begin, length, offset)) return -1;
+    MappedPiece const *p = mapPiece(int(index));
+    if(!p) return -1;
+
+    int n = 0;
+    for(auto const &w : p->windows) {
+        if(length == 0) break;
+        qint64 in = offset - files.at(w.file).offset;
+        /* The block starts in a later file of the piece */
+        if(in >= w.from + w.size) continue;
+        if(n == max) return -1;
+        int size = int(qMin<qint64>(length, w.from + w.size - in));
+        slices[n].data = reinterpret_cast<const char *>(w.map + (in - w.from));
+        slices[n].size = size;
+        ++ n;
+        offset += size;
+        length -= size;
+    }
+    return n;
+}
+
+bool BtStorage::writeBlock(quint32 index, quint32 begin, const char *data, int length)
+{
+    qint64 offset;
+    if(!blockOffset(index, begin, length, offset)) return false;
+
+    for(int i = fileAt(offset); length > 0 && i < files.size(); ++ i) {
+        const File &f = files.at(i);
+        if(f.length == 0) continue;
+        qint64 in = offset - f.offset;
+        int size = int(qMin<qint64>(length, f.length - in));
+        if(!f.file->seek(in) || f.file->write(data, size) != size) {
+            qDebug() << "Can not write" << f.file->fileName() << f.file->errorString();
+            return false;
+        }
+        data += size;
+        offset += size;
+        length -= size;
+    }
+    return true;
+}
+
+QByteArray BtStorage::pieceHash(int index) const
+{
+    qint64 offset;
+    if(!blockOffset(index, 0, int(pieceSize(index)), offset)) return QByteArray();
+    MappedPiece const *p = mapPiece(index);
+    if(!p) return QByteArray();
+
+    /* Straight from the mapping, a piece may span many small files */
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for(auto const &w : p->windows) {
+        hash.addData(reinterpret_cast<const char *>(w.map), int(w.size));
+    }
+    return hash.result();
+}
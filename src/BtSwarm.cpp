@@ -0,0 +1,697 @@
+#include <BtSwarm.h>
+#include <BtPipeline.h>
+#include <QDir>
+#include <QFile>
+#include <QDataStream>
+#include <QDebug>
+
+using namespace BtQt;
+
+const int BtSwarm::TickMs;
+const int BtSwarm::DefaultMaxConnections;
+const int BtSwarm::ConnectsPerTick;
+const int BtSwarm::EndgameRequests;
+const int BtSwarm::BandwidthRetryMs;
+
+/* First bytes of a resume file, "BtQr" */
+static const quint32 ResumeMagic = 0x42745172;
+
+BtConnectionLimit::BtConnectionLimit(int maximum)
+    : Maximum(maximum), Count(0)
+{
+}
+
+void BtConnectionLimit::setMaximum(int maximum)
+{
+    Maximum.store(maximum);
+}
+
+int BtConnectionLimit::maximum() const
+{
+    return Maximum.load();
+}
+
+int BtConnectionLimit::count() const
+{
+    return Count.load();
+}
+
+bool BtConnectionLimit::acquire()
+{
+    int count = Count.load();
+    do {
+        if(count >= Maximum.load()) return false;
+    } while(!Count.compare_exchange_weak(count, count + 1));
+    return true;
+}
+
+void BtConnectionLimit::release()
+{
+    -- Count;
+}
+
+BtSwarm::BtSwarm(BtTorrent const &torrent, QByteArray const &peerId,
+        quint16 listenPort, QObject *parent)
+    : QObject(parent), Torrent(torrent), InfoHash(torrent.infoHash()),
+    PeerId(peerId), ListenPort(listenPort), directory(QDir::currentPath()),
+    MaxConnections(DefaultMaxConnections), limit(0), policy(BtEncryptionPolicy::enabled),
+    listening(true), running(false), paused(false), endgame(true), Pieces(torrent.pieceCount()),
+    picker(torrent.pieceCount()), peerUpload(0), peerDownload(0), server(this),
+    timer(this), sharedTicker(false), bandwidthTimer(this), Left(torrent.length())
+{
+    bandwidthTimer.setSingleShot(true);
+    connect(&bandwidthTimer, &QTimer::timeout, this, &BtSwarm::retryThrottled);
+    connect(&timer, &QTimer::timeout, this, &BtSwarm::tick);
+    connect(&server, &QTcpServer::newConnection, this, &BtSwarm::acceptConnections);
+}
+
+BtSwarm::~BtSwarm()
+{
+    stop();
+}
+
+void BtSwarm::setDirectory(QString const &directory)
+{
+    this->directory = directory;
+}
+
+void BtSwarm::setMaxConnections(int max)
+{
+    MaxConnections = qMax(1, max);
+}
+
+int BtSwarm::maxConnections() const
+{
+    return MaxConnections;
+}
+
+void BtSwarm::setUploadSlots(int count)
+{
+    choker.setUploadSlots(count);
+}
+
+int BtSwarm::uploadSlots() const
+{
+    return choker.uploadSlots();
+}
+
+void BtSwarm::setEncryptionPolicy(BtEncryptionPolicy policy)
+{
+    this->policy = policy;
+}
+
+BtEncryptionPolicy BtSwarm::encryptionPolicy() const
+{
+    return policy;
+}
+
+void BtSwarm::setConnectionLimit(BtConnectionLimit *limit)
+{
+    this->limit = limit;
+}
+
+void BtSwarm::setTicker(QTimer *ticker)
+{
+    timer.stop();
+    timer.disconnect(this);
+    sharedTicker = true;
+    connect(ticker, &QTimer::timeout, this, &BtSwarm::tick);
+}
+
+void BtSwarm::setRateLimits(qint64 upload, qint64 download)
+{
+    uploadLimit.setRate(upload);
+    downloadLimit.setRate(download);
+}
+
+void BtSwarm::setPeerRateLimits(qint64 upload, qint64 download)
+{
+    peerUpload = upload;
+    peerDownload = download;
+    for(auto c : connections) c->setRateLimits(upload, download);
+}
+
+void BtSwarm::setParentBuckets(BtTokenBucket *upload, BtTokenBucket *download)
+{
+    uploadLimit.setParent(upload);
+    downloadLimit.setParent(download);
+}
+
+BtTokenBucket &BtSwarm::uploadBucket()
+{
+    return uploadLimit;
+}
+
+BtTokenBucket &BtSwarm::downloadBucket()
+{
+    return downloadLimit;
+}
+
+qint64 BtSwarm::peerUploadRate() const
+{
+    return peerUpload;
+}
+
+qint64 BtSwarm::peerDownloadRate() const
+{
+    return peerDownload;
+}
+
+void BtSwarm::waitForBandwidth(BtConnection *connection)
+{
+    throttled.insert(connection);
+    if(!bandwidthTimer.isActive()) bandwidthTimer.start(BandwidthRetryMs);
+}
+
+void BtSwarm::retryThrottled()
+{
+    /* They come back here if there is still not enough */
+    QSet<BtConnection *> waiting;
+    waiting.swap(throttled);
+    for(auto c : waiting) {
+        if(connections.contains(c)) c->bandwidthAvailable();
+    }
+}
+
+void BtSwarm::setListening(bool listening)
+{
+    this->listening = listening;
+    if(!listening) server.close();
+}
+
+bool BtSwarm::start()
+{
+    if(running) return true;
+    if(!Storage) Storage.reset(new BtStorage(Torrent, directory));
+    if(!Storage->isOpen()) {
+        /* Before open(), which creates missing files and touches them */
+        bool resumed = hashes.isEmpty() && loadResume();
+        if(!Storage->open()) return false;
+        if(hashes.isEmpty()) {
+            hashes = Torrent.pieces();
+            if(!resumed && Storage->hadData()) checkPieces();
+        }
+    }
+
+    if(listening && !server.isListening()
+            && !server.listen(QHostAddress::Any, ListenPort)) {
+        qDebug() << "Can not listen on port" << ListenPort << server.errorString();
+    }
+    running = true;
+    if(!sharedTicker) timer.start(TickMs);
+    connectCandidates();
+    return true;
+}
+
+void BtSwarm::stop()
+{
+    if(!running) return;
+    running = false;
+    paused = false;
+    timer.stop();
+    server.close();
+    /* Closing takes them out of the list */
+    for(auto c : QList<BtConnection *>(connections)) c->close("Stopped");
+    /* tick() is over until we start again, don't leave the last rates */
+    stats.clearRates();
+    if(Storage && Storage->isOpen()) {
+        Storage->flush();
+        Storage->close();
+        saveResume();
+    }
+}
+
+void BtSwarm::pause()
+{
+    if(!running || paused) return;
+    paused = true;
+    /* Blocks requested already still come and are kept */
+    for(auto c : QList<BtConnection *>(connections)) {
+        c->choke();
+        c->setInterested(false);
+    }
+}
+
+void BtSwarm::resume()
+{
+    if(!paused) return;
+    paused = false;
+    for(auto c : QList<BtConnection *>(connections)) {
+        if(c->isActive()) updateInterest(c);
+    }
+    choker.rechoke(connections, isComplete(), false);
+}
+
+bool BtSwarm::isPaused() const
+{
+    return paused;
+}
+
+void BtSwarm::setEndgame(bool endgame)
+{
+    this->endgame = endgame;
+}
+
+bool BtSwarm::isEndgame() const
+{
+    return endgame;
+}
+
+bool BtSwarm::isRunning() const
+{
+    return running;
+}
+
+void BtSwarm::checkPieces()
+{
+    /* Files were there before, see what is in them */
+    for(int i = 0; i < hashes.size(); ++ i) {
+        if(Storage->pieceHash(i) == hashes.at(i)) havePiece(i);
+    }
+    qDebug() << Torrent.name() << "has" << Pieces.count() << "of" << Pieces.size()
+        << "pieces already";
+}
+
+void BtSwarm::havePiece(int index)
+{
+    Pieces.set(index);
+    picker.weHave(index);
+    Left.fetch_sub(Storage->pieceSize(index), std::memory_order_relaxed);
+}
+
+QString BtSwarm::resumePath() const
+{
+    return QDir(directory).filePath("." + QString(InfoHash.toHex()) + ".resume");
+}
+
+bool BtSwarm::loadResume()
+{
+    QFile file(resumePath());
+    if(!file.open(QIODevice::ReadOnly)) return false;
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_5_4);
+    quint32 magic;
+    QByteArray infoHash;
+    QList<qint64> times;
+    QByteArray bits;
+    in >> magic >> infoHash >> times >> bits;
+    file.close();
+    file.remove();
+
+    BtPieceSet have(Pieces.size());
+    if(in.status() != QDataStream::Ok || magic != ResumeMagic || infoHash != InfoHash
+            || times != Storage->fileTimes() || !have.fromWire(bits.constData(), bits.size()))
+        return false;
+    for(int i = have.findFirst(); i >= 0; i = have.findFirst(i + 1)) havePiece(i);
+    qDebug() << Torrent.name() << "has" << Pieces.count() << "of" << Pieces.size()
+        << "pieces, from resume data";
+    return true;
+}
+
+void BtSwarm::saveResume()
+{
+    /* Written aside and renamed, a crash leaves the old one or none */
+    QString path = resumePath();
+    QFile file(path + ".part");
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qDebug() << "Can not save resume data of" << Torrent.name() << file.errorString();
+        return;
+    }
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_4);
+    out << ResumeMagic << InfoHash << Storage->fileTimes() << Pieces.toWire();
+    file.close();
+    QFile::remove(path);
+    file.rename(path);
+}
+
+void BtSwarm::addCandidates(QVector<BtPeerEndpoint> const &peers, BtPeerSource source)
+{
+    for(auto const &e : peers) {
+        if(e.port && !byEndpoint.contains(e)) pool.add(e, source);
+    }
+}
+
+int BtSwarm::candidateCount() const
+{
+    return pool.size();
+}
+
+int BtSwarm::connectionCount() const
+{
+    return connections.size();
+}
+
+BtPieceSet const &BtSwarm::pieces() const
+{
+    return Pieces;
+}
+
+bool BtSwarm::isComplete() const
+{
+    return Pieces.isFull();
+}
+
+qint64 BtSwarm::downloaded() const
+{
+    return stats.total(BtTransferStats::PayloadDownload);
+}
+
+qint64 BtSwarm::uploaded() const
+{
+    return stats.total(BtTransferStats::PayloadUpload);
+}
+
+qint64 BtSwarm::left() const
+{
+    return Left.load(std::memory_order_relaxed);
+}
+
+BtTransferStats &BtSwarm::transferStats()
+{
+    return stats;
+}
+
+BtTorrent const &BtSwarm::torrent() const
+{
+    return Torrent;
+}
+
+QByteArray BtSwarm::infoHash() const
+{
+    return InfoHash;
+}
+
+QByteArray BtSwarm::peerId() const
+{
+    return PeerId;
+}
+
+quint16 BtSwarm::listenPort() const
+{
+    return ListenPort;
+}
+
+BtStorage &BtSwarm::storage()
+{
+    return *Storage;
+}
+
+QVector<BtPeerEndpoint> const &BtSwarm::connectedEndpoints() const
+{
+    return Connected;
+}
+
+void BtSwarm::tick()
+{
+    if(!running) return;
+    Connected.clear();
+    for(auto c : connections) {
+        if(!c->isActive()) continue;
+        BtPeerEndpoint e = c->listenEndpoint();
+        if(e.port) Connected.append(e);
+    }
+    for(auto c : QList<BtConnection *>(connections)) c->tick();
+    stats.tick();
+    if(paused) return;
+    choker.tick(connections, isComplete());
+    connectCandidates();
+}
+
+void BtSwarm::connectCandidates()
+{
+    BtPeerEndpoint e;
+    for(int n = 0; n < ConnectsPerTick && pool.next(e); ++ n) {
+        /* It came in since it was added, the pool hears when it closes */
+        if(byEndpoint.contains(e)) {
+            pool.connected(e);
+            continue;
+        }
+        if(!admit()) {
+            pool.putBack(e);
+            break;
+        }
+        BtConnection *c = new BtConnection(*this, e, policy);
+        connections.append(c);
+        byEndpoint.insert(e, c);
+    }
+}
+
+void BtSwarm::acceptConnections()
+{
+    while(server.hasPendingConnections()) {
+        QTcpSocket *socket = server.nextPendingConnection();
+        if(!running || !admit()) {
+            socket->abort();
+            socket->deleteLater();
+            continue;
+        }
+        BtConnection *c = new BtConnection(*this, socket, policy);
+        connections.append(c);
+        byEndpoint.insert(c->endpoint(), c);
+    }
+}
+
+void BtSwarm::acceptIncoming(QTcpSocket *socket, BtStreamStart const &start)
+{
+    if(!running || !admit()) {
+        socket->abort();
+        socket->deleteLater();
+        return;
+    }
+    BtConnection *c = new BtConnection(*this, socket, start, policy);
+    connections.append(c);
+    byEndpoint.insert(c->endpoint(), c);
+}
+
+bool BtSwarm::admit()
+{
+    if(connections.size() >= MaxConnections) return false;
+    return !limit || limit->acquire();
+}
+
+void BtSwarm::peerInterested(BtConnection *connection)
+{
+    if(!paused) choker.interested(connections, connection);
+}
+
+bool BtSwarm::connectionReady(BtConnection *connection)
+{
+    for(auto c : connections) {
+        if(c != connection && c->isActive() && c->peerId() == connection->peerId())
+            return false;
+    }
+    if(connection->isOutgoing()) pool.connected(connection->endpoint());
+    return true;
+}
+
+void BtSwarm::connectionClosed(BtConnection *connection)
+{
+    /* Connects we drop on stop() don't count against the peer */
+    pool.disconnected(connection->endpoint(), running);
+    if(connections.removeOne(connection) && limit) limit->release();
+    if(byEndpoint.value(connection->endpoint()) == connection)
+        byEndpoint.remove(connection->endpoint());
+    choker.remove(connection);
+    throttled.remove(connection);
+    if(seeds.remove(connection)) picker.seedLeft();
+    else picker.peerLost(connection->peerPieces());
+}
+
+void BtSwarm::updateInterest(BtConnection *connection)
+{
+    if(isComplete() && connection->isSeed()) {
+        connection->close("Both are seeds");
+        return;
+    }
+    connection->setInterested(!paused && !isComplete()
+            && connection->peerPieces().anyAndNot(Pieces));
+}
+
+void BtSwarm::peerHas(BtConnection *connection, int index)
+{
+    if(seeds.contains(connection)) return;
+    picker.peerHas(index);
+    if(!connection->amInterested() || connection->isSeed()) updateInterest(connection);
+}
+
+void BtSwarm::peerHasPieces(BtConnection *connection)
+{
+    if(connection->isSeed()) {
+        seeds.insert(connection);
+        picker.seedJoined();
+    } else {
+        picker.peerBitfield(connection->peerPieces());
+    }
+    updateInterest(connection);
+}
+
+int BtSwarm::blockCount(int index) const
+{
+    return int((Storage->pieceSize(index) + BtPipeline::BlockSize - 1) / BtPipeline::BlockSize);
+}
+
+bool BtSwarm::allRequested() const
+{
+    if(!picker.allBusy()) return false;
+    for(auto const &p : partials) {
+        if(p.requested + p.received < p.blocks.size()) return false;
+    }
+    return true;
+}
+
+void BtSwarm::setRequest(BtBlockRequest &r, int index, int block) const
+{
+    r.index = quint32(index);
+    r.begin = quint32(block) * BtPipeline::BlockSize;
+    r.length = quint32(qMin<qint64>(BtPipeline::BlockSize, Storage->pieceSize(index) - r.begin));
+}
+
+bool BtSwarm::nextBlock(BtConnection *connection, BtBlockRequest &r)
+{
+    /* Only its allowed fast pieces while the peer chokes us */
+    BtPieceSet const &has = connection->requestablePieces();
+    int index = -1;
+    int block = -1;
+
+    /* Finish what is started before starting more */
+    for(auto it = partials.begin(); it != partials.end() && index < 0; ++ it) {
+        Partial &p = it.value();
+        if(p.requested + p.received == p.blocks.size() || !has.test(it.key())) continue;
+        for(int b = 0; b < p.blocks.size(); ++ b) {
+            if(p.blocks.at(b) == BlockFree) {
+                index = it.key();
+                block = b;
+                break;
+            }
+        }
+    }
+    /* Then what the peer suggested, it likely has it in cache */
+    for(int i = connection->suggestedPieces().size() - 1; i >= 0 && index < 0; -- i) {
+        int suggested = connection->suggestedPieces().at(i);
+        if(has.test(suggested) && picker.isWanted(suggested) && !partials.contains(suggested)) {
+            index = suggested;
+        }
+    }
+    if(index < 0) index = picker.pick(has, connection->isSeed());
+    if(index < 0) return endgame && allRequested() && duplicateBlock(connection, r);
+    if(!partials.contains(index)) {
+        picker.setBusy(index, true);
+        Partial &p = partials[index];
+        p.blocks = QVector<quint8>(blockCount(index), BlockFree);
+        p.copies = QVector<quint8>(p.blocks.size(), 0);
+        p.requested = 0;
+        p.received = 0;
+        block = 0;
+    }
+
+    Partial &p = partials[index];
+    p.blocks[block] = BlockRequested;
+    p.copies[block] = 1;
+    ++ p.requested;
+    setRequest(r, index, block);
+    return true;
+}
+
+bool BtSwarm::duplicateBlock(BtConnection *connection, BtBlockRequest &r)
+{
+    BtPieceSet const &has = connection->requestablePieces();
+    /* Least requested block first, partials are few by now */
+    Partial *best = 0;
+    int index = -1;
+    int block = -1;
+    for(auto it = partials.begin(); it != partials.end(); ++ it) {
+        if(!has.test(it.key())) continue;
+        Partial &p = it.value();
+        for(int b = 0; b < p.blocks.size(); ++ b) {
+            if(p.blocks.at(b) != BlockRequested || p.copies.at(b) >= EndgameRequests) continue;
+            if(best && best->copies.at(block) <= p.copies.at(b)) continue;
+            BtBlockRequest candidate;
+            setRequest(candidate, it.key(), b);
+            if(connection->pipeline().isRequested(candidate)) continue;
+            best = &p;
+            index = it.key();
+            block = b;
+        }
+    }
+    if(!best) return false;
+    ++ best->copies[block];
+    setRequest(r, index, block);
+    return true;
+}
+
+bool BtSwarm::blockReceived(BtConnection *connection, BtBlockView const &b)
+{
+    auto it = partials.find(int(b.index));
+    if(it == partials.end() || b.begin % BtPipeline::BlockSize) return false;
+    Partial &p = it.value();
+    int block = int(b.begin / BtPipeline::BlockSize);
+    if(block >= p.blocks.size() || p.blocks.at(block) == BlockReceived) return false;
+    qint64 length = qMin<qint64>(BtPipeline::BlockSize, Storage->pieceSize(b.index) - b.begin);
+    if(b.length != length) return false;
+
+    if(!Storage->writeBlock(b.index, b.begin, b.data, b.length)) {
+        qDebug() << "Can not write block" << b.index << b.begin;
+        /* Ask for it again, the disk may have room by then */
+        BtBlockRequest r;
+        setRequest(r, int(b.index), block);
+        blocksReturned(QVector<BtBlockRequest>() << r);
+        return false;
+    }
+    if(p.blocks.at(block) == BlockRequested) -- p.requested;
+    p.blocks[block] = BlockReceived;
+    ++ p.received;
+
+    /* End-game, the other copies are not needed any more */
+    if(p.copies.at(block) > 1) {
+        BtBlockRequest r;
+        setRequest(r, int(b.index), block);
+        /* A failed write closes the connection */
+        for(auto c : QList<BtConnection *>(connections)) {
+            if(c != connection) c->cancelRequest(r);
+        }
+    }
+    p.copies[block] = 0;
+    if(p.received == p.blocks.size()) pieceDone(int(b.index));
+    return true;
+}
+
+void BtSwarm::blocksReturned(QVector<BtBlockRequest> const &requests)
+{
+    for(auto const &r : requests) {
+        auto it = partials.find(int(r.index));
+        if(it == partials.end()) continue;
+        Partial &p = it.value();
+        int block = int(r.begin / BtPipeline::BlockSize);
+        if(block >= p.blocks.size() || p.blocks.at(block) != BlockRequested) continue;
+        /* Free once no copy is outstanding */
+        if(-- p.copies[block] > 0) continue;
+        p.blocks[block] = BlockFree;
+        -- p.requested;
+    }
+}
+
+void BtSwarm::pieceDone(int index)
+{
+    partials.remove(index);
+    picker.setBusy(index, false);
+    if(Storage->pieceHash(index) != hashes.at(index)) {
+        /* It's picked again, from whoever has it */
+        qDebug() << "Piece" << index << "of" << Torrent.name() << "is broken";
+        return;
+    }
+
+    havePiece(index);
+    emit pieceCompleted(index);
+
+    /* Updating interest may close connections */
+    for(auto c : QList<BtConnection *>(connections)) {
+        if(!c->isActive()) continue;
+        if(!c->peerPieces().test(index)) c->sendHave(index);
+        if(c->amInterested() || isComplete()) updateInterest(c);
+    }
+    if(isComplete()) {
+        qDebug() << Torrent.name() << "is complete";
+        emit finished();
+    }
+}
@@ -0,0 +1,99 @@
+#include <BtTokenBucket.h>
+
+using namespace BtQt;
+
+const int BtTokenBucket::Grant;
+const int BtTokenBucket::BurstMs;
+const int BtTokenBucket::RefillMs;
+
+BtTokenBucket::BtTokenBucket(BtTokenBucket *parent)
+    : Parent(parent), Rate(0), tokens(0), refilled(0)
+{
+    clock.start();
+}
+
+void BtTokenBucket::setParent(BtTokenBucket *parent)
+{
+    Parent = parent;
+}
+
+BtTokenBucket *BtTokenBucket::parent() const
+{
+    return Parent;
+}
+
+void BtTokenBucket::setRate(qint64 rate)
+{
+    rate = qMax<qint64>(0, rate);
+    Rate.store(rate);
+    /* Start full, so the first grants don't wait */
+    tokens.store(qMax<qint64>(Grant, rate * BurstMs / 1000));
+    refilled.store(clock.elapsed());
+}
+
+qint64 BtTokenBucket::rate() const
+{
+    return Rate.load(std::memory_order_relaxed);
+}
+
+void BtTokenBucket::refill(qint64 rate)
+{
+    qint64 now = clock.elapsed();
+    qint64 last = refilled.load();
+    if(now - last < RefillMs) return;
+    /* Whoever moves the time on adds the tokens */
+    if(!refilled.compare_exchange_strong(last, now)) return;
+
+    qint64 add = rate * (now - last) / 1000;
+    qint64 capacity = qMax<qint64>(Grant, rate * BurstMs / 1000);
+    qint64 t = tokens.load();
+    while(!tokens.compare_exchange_weak(t, qMin(capacity, t + add)));
+}
+
+qint64 BtTokenBucket::take(qint64 n)
+{
+    if(n <= 0) return 0;
+    qint64 rate = Rate.load(std::memory_order_relaxed);
+    qint64 got = n;
+    if(rate > 0) {
+        refill(rate);
+        qint64 t = tokens.load();
+        do {
+            got = qMin(n, t);
+            if(got <= 0) return 0;
+        } while(!tokens.compare_exchange_weak(t, t - got));
+    }
+    if(Parent) {
+        qint64 granted = Parent->take(got);
+        /* What the buckets above did not grant goes back */
+        if(granted < got && rate > 0) tokens.fetch_add(got - granted);
+        got = granted;
+    }
+    return got;
+}
+
+BtBandwidth::BtBandwidth()
+    : quota(0)
+{
+}
+
+BtTokenBucket &BtBandwidth::bucket()
+{
+    return Bucket;
+}
+
+bool BtBandwidth::spend(qint64 n)
+{
+    if(quota < n) quota += Bucket.take(qMax<qint64>(n - quota, BtTokenBucket::Grant));
+    if(quota < n) return false;
+    quota -= n;
+    return true;
+}
+
+qint64 BtBandwidth::spendUpTo(qint64 n)
+{
+    if(quota < n) quota += Bucket.take(qMax<qint64>(n - quota, BtTokenBucket::Grant));
+    qint64 spent = qMin(quota, n);
+    quota -= spent;
+    return spent;
+}
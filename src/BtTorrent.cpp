@@ -264,6 +264,11 @@ QList<QByteArray> BtTorrent::pieces() const
     return ret;
 }
 
+int BtTorrent::pieceCount() const
+{
+    return torrentPieces.size();
+}
+
 bool BtTorrent::isMultiFile() const
 {
     if(torrentInfo.contains("files"))
@@ -367,10 +372,10 @@ QList<QString> BtTorrent::announceList() const
     if(torrentObject.value("announce-list").canConvert(
                 QMetaType::QVariantList)) {
         QList<QString> ret;
-        for (auto i : torrentObject.value("announce-list").toList()) {
+        for (auto tier : announceTiers()) {
             /* I have to say that always check is not a good choice.
              * Shit, there are so much to check. */
-            ret.append(i.toString());
+            ret.append(tier);
         }
         return ret;
     }
@@ -378,6 +383,30 @@ QList<QString> BtTorrent::announceList() const
     return QList<QString>();
 }
 
+QList<QList<QString>> BtTorrent::announceTiers() const
+{
+    QList<QList<QString>> ret;
+    if(torrentObject.value("announce-list").canConvert(
+                QMetaType::QVariantList)) {
+        /* announce-list is a list of tiers, every tier is a list of urls */
+        for (auto i : torrentObject.value("announce-list").toList()) {
+            QList<QString> tier;
+            for (auto url : i.toList()) {
+                QString trackerUrl = url.toByteArray();
+                if(!trackerUrl.isEmpty()) tier.append(trackerUrl);
+            }
+            if(!tier.isEmpty()) ret.append(tier);
+        }
+    }
+
+    /* As BEP 12 says, announce is ignored when announce-list presents */
+    if(ret.isEmpty() && !announce().isEmpty()) {
+        ret.append(QList<QString>() << announce());
+    }
+
+    return ret;
+}
+
 QList<QString> BtTorrent::httpseeds() const
 {
     if(!torrentObject.contains("httpseeds")) return QList<QString>();
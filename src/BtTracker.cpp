@@ -1,9 +1,10 @@
 #include <BtQt.h>
 #include <QCryptographicHash>
-#include <QUrlQuery>
 #include <QTcpSocket>
 #include <QAbstractSocket>
 
+#include <cstring>
+
 using namespace BtQt;
 
 /* Get the last 'e' of a bencoded list or dictionary, implemented in BtTorrent */
@@ -46,8 +47,9 @@ void BtQt::torrentInfoHash(QByteArray const &torrentMetadata, QByteArray &ret)
     ret = QCryptographicHash::hash(info, QCryptographicHash::Sha1);
 }
 
-BtTrackerRequest::BtTrackerRequest() : event(BtTrackerDownloadEvent::empty),
-    compact(false), no_peer_id(false), numwant(50), requestDataGenerated(false)
+BtTrackerRequest::BtTrackerRequest() : port(0), uploaded(0), downloaded(0),
+    left(0), event(BtTrackerDownloadEvent::empty), compact(false),
+    no_peer_id(false), numwant(50), requestPrefixGenerated(false)
 {
 
 }
@@ -59,26 +61,26 @@ BtTrackerRequest::BtTrackerRequest(QByteArray const &info_hash,
     info_hash(info_hash), peer_id(peer_id), ip(ip), port(port),
     uploaded(uploaded), downloaded(downloaded), left(left), event(event),
     compact(false), no_peer_id(false), numwant(50),
-    requestDataGenerated(false)
+    requestPrefixGenerated(false)
 {
 
 }
 
 void BtTrackerRequest::setInfoHash(QByteArray const &info_hash)
 {
-    requestDataGenerated = false;
+    requestPrefixGenerated = false;
     this->info_hash = info_hash;
 }
 
 void BtTrackerRequest::setPeerId(QByteArray const &peer_id)
 {
-    requestDataGenerated = false;
+    requestPrefixGenerated = false;
     this->peer_id = peer_id;
 }
 
 void BtTrackerRequest::setIp(QHostAddress const &ip)
 {
-    requestDataGenerated = false;
+    requestPrefixGenerated = false;
     this->ip = ip;
 }
 
@@ -86,39 +88,27 @@ void BtTrackerRequest::setPort(quint16 port)
 {
     if(port == this->port) return;
 
-    requestDataGenerated = false;
+    requestPrefixGenerated = false;
     this->port = port;
 }
 
 void BtTrackerRequest::setUploaded(quint64 uploaded)
 {
-    if(uploaded == this->uploaded) return;
-
-    requestDataGenerated = false;
     this->uploaded = uploaded;
 }
 
 void BtTrackerRequest::setDownloaded(quint64 downloaded)
 {
-    if(downloaded == this->downloaded) return;
-
-    requestDataGenerated = false;
     this->downloaded = downloaded;
 }
 
 void BtTrackerRequest::setLeft(quint64 left)
 {
-    if(left == this->left) return;
-
-    requestDataGenerated = false;
     this->left = left;
 }
 
 void BtTrackerRequest::setEvent(BtTrackerDownloadEvent event)
 {
-    if(event == this->event) return;
-
-    requestDataGenerated = false;
     this->event = event;
 }
 
@@ -126,7 +116,7 @@ void BtTrackerRequest::setCompact(bool compact)
 {
     if(compact == this->compact) return;
 
-    requestDataGenerated = false;
+    requestPrefixGenerated = false;
     this->compact = compact;
 }
 
@@ -134,7 +124,7 @@ void BtTrackerRequest::setNoPeerId(bool no_peer_id)
 {
     if(no_peer_id == this->no_peer_id) return;
 
-    requestDataGenerated = false;
+    requestPrefixGenerated = false;
     this->no_peer_id = no_peer_id;
 }
 
@@ -142,7 +132,7 @@ void BtTrackerRequest::setNumwant(int numwant)
 {
     if(numwant == this->numwant) return;
 
-    requestDataGenerated = false;
+    requestPrefixGenerated = false;
     this->numwant = numwant;
 }
 
@@ -187,6 +177,51 @@ int BtTrackerRequest::getNumwant() const
     return numwant;
 }
 
+void BtTrackerRequest::setKey(QByteArray const &key)
+{
+    if(key == this->key) return;
+
+    requestPrefixGenerated = false;
+    this->key = key;
+}
+
+QByteArray BtTrackerRequest::getKey() const
+{
+    return key;
+}
+
+void BtTrackerRequest::setIPv4(QHostAddress const &ipv4)
+{
+    requestPrefixGenerated = false;
+    this->ipv4 = ipv4;
+}
+
+void BtTrackerRequest::setIPv6(QHostAddress const &ipv6)
+{
+    requestPrefixGenerated = false;
+    this->ipv6 = ipv6;
+}
+
+QHostAddress BtTrackerRequest::getIPv4() const
+{
+    return ipv4;
+}
+
+QHostAddress BtTrackerRequest::getIPv6() const
+{
+    return ipv6;
+}
+
+QByteArray BtQt::generateTrackerKey()
+{
+    static const char hex[] = "0123456789ABCDEF";
+    QByteArray key;
+    for(auto i = 0; i < 8; ++ i) {
+        key.append(hex[qrand() % 16]);
+    }
+    return key;
+}
+
 #ifndef QT_NO_DEBUG
 void BtTrackerRequest::display() const
 {
@@ -202,68 +237,142 @@ void BtTrackerRequest::display() const
     qDebug() << "compact: " << compact;
     qDebug() << "no_peer_id: " << no_peer_id;
     qDebug() << "numwant: " << numwant;
+    qDebug() << "key: " << key;
+    if(!ipv4.isNull()) qDebug() << "ipv4: " << ipv4;
+    if(!ipv6.isNull()) qDebug() << "ipv6: " << ipv6;
 }
 #endif // QT_NO_DEBUG
 
-static QString urlencodeUnicode(QByteArray const &in)
+/* Percent-encode everything except unreserved characters of RFC 3986 */
+static void urlencodeAppend(QByteArray &out, QByteArray const &in)
 {
-    QString ret;
+    static const char hex[] = "0123456789ABCDEF";
     for (auto i : in) {
-        if(i >= '0' && i <= '9') ret.append(i);
-        else if(i >= 'a' && i <= 'z') ret.append(i);
-        else if(i >= 'A' && i <= 'z') ret.append(i);
-        else if(i == '.' || i == '-' || i == '_' || i =='~') ret.append(i);
-        /* Encode \xss to "%nn", "nn" is the hexadecimal value of the byte */
-        else {
-            ret.append("%");
-            ret.append(QByteArray(1, i).toHex().toUpper());
+        uchar c = uchar(i);
+        if((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                (c >= 'A' && c <= 'Z') ||
+                c == '.' || c == '-' || c == '_' || c == '~') {
+            out.append(i);
+        } else {
+            /* Encode \xss to "%nn", "nn" is the hexadecimal value of the byte */
+            out.append('%');
+            out.append(hex[c >> 4]);
+            out.append(hex[c & 0xf]);
         }
     }
+}
 
-    return ret;
+/* Format "<name><value in base ten>" at p, return the end */
+static inline char *formatField(char *p, const char *name, quint64 value)
+{
+    while(*name) *p ++ = *name ++;
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n ++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    while(n) *p ++ = digits[-- n];
+    return p;
 }
 
-const QByteArray& BtTrackerRequest::toRequestData() const
+QByteArray BtTrackerRequest::toRequestData() const
 {
     /* If not generated or out of date */
-    if(!requestDataGenerated) {
-        const_cast<QByteArray &>(requestData).clear();
+    if(!requestPrefixGenerated) {
+        QByteArray &prefix = const_cast<QByteArray &>(requestPrefix);
+        prefix.clear();
         /* generate */
-        QUrlQuery params;
-        params.addQueryItem("info_hash", urlencodeUnicode(info_hash));
-        params.addQueryItem("peer_id", urlencodeUnicode(peer_id));
-        params.addQueryItem("port", QByteArray::number(port));
-        params.addQueryItem("uploaded", QByteArray::number(uploaded));
-        params.addQueryItem("downloaded", QByteArray::number(downloaded));
-        params.addQueryItem("left", QByteArray::number(left));
-
-        if(!ip.isNull()) params.addQueryItem("ip", ip.toString());
-        switch(event) {
-            case BtTrackerDownloadEvent::started:
-                params.addQueryItem("event", "started");
-                break;
-            case BtTrackerDownloadEvent::completed:
-                params.addQueryItem("event", "completed");
-                break;
-            case BtTrackerDownloadEvent::stopped:
-                params.addQueryItem("event", "stopped");
-                break;
-            default:
-            /* same as empty */
-                break;
+        prefix.append("info_hash=");
+        urlencodeAppend(prefix, info_hash);
+        prefix.append("&peer_id=");
+        urlencodeAppend(prefix, peer_id);
+        prefix.append("&port=").append(QByteArray::number(port));
+
+        if(!ip.isNull()) {
+            prefix.append("&ip=");
+            urlencodeAppend(prefix, ip.toString().toLatin1());
+        }
+        if(!ipv4.isNull()) {
+            prefix.append("&ipv4=");
+            urlencodeAppend(prefix, ipv4.toString().toLatin1());
+        }
+        if(!ipv6.isNull()) {
+            prefix.append("&ipv6=");
+            urlencodeAppend(prefix, ipv6.toString().toLatin1());
+        }
+        if(!key.isEmpty()) {
+            prefix.append("&key=");
+            urlencodeAppend(prefix, key);
         }
 
-        if(compact) params.addQueryItem("compact", compact?"1":"0");
-        else if(no_peer_id) params.addQueryItem("no_peer_id", no_peer_id?"1":"0");
-        if(numwant != 50) params.addQueryItem("numwant", QByteArray::number(numwant));
+        if(compact) prefix.append("&compact=1");
+        else if(no_peer_id) prefix.append("&no_peer_id=1");
+        if(numwant != 50) prefix.append("&numwant=").append(QByteArray::number(numwant));
 
-        const_cast<QByteArray &>(requestData).append(params.query(QUrl::EncodeUnicode));
-        const_cast<bool &>(requestDataGenerated) = true;
+        const_cast<bool &>(requestPrefixGenerated) = true;
     }
 
+    /* Only these change between announces */
+    char buf[128];
+    char *p = buf;
+    p = formatField(p, "&uploaded=", uploaded);
+    p = formatField(p, "&downloaded=", downloaded);
+    p = formatField(p, "&left=", left);
+    const char *e = 0;
+    switch(event) {
+        case BtTrackerDownloadEvent::started:
+            e = "&event=started";
+            break;
+        case BtTrackerDownloadEvent::completed:
+            e = "&event=completed";
+            break;
+        case BtTrackerDownloadEvent::stopped:
+            e = "&event=stopped";
+            break;
+        default:
+        /* same as empty */
+            break;
+    }
+    if(e) while(*e) *p ++ = *e ++;
+
+    QByteArray requestData;
+    requestData.reserve(requestPrefix.size() + int(p - buf));
+    requestData.append(requestPrefix).append(buf, int(p - buf));
     return requestData;
 }
 
+/* Build the HTTP GET message of an announce */
+static QByteArray announceMessage(QByteArray const &query,
+        QUrl const &trackerUrl, bool keepAlive)
+{
+    QString host = trackerUrl.host();
+    quint16 port = trackerUrl.port(80);
+
+    /* HTTP 1.1 header, for more information please go to RFC2616 */
+    QByteArray header;
+    header.append("HOST: " + host + ":" + QString::number(port) + "\r\n");
+    header.append("User-Agent: " + BtQt::application + " " + BtQt::version + "\r\n");
+    header.append("Accept: */*\r\n");
+    if(keepAlive) header.append("Connection: Keep-Alive\r\n");
+    else header.append("Connection: close\r\n");
+    header.append("\r\n");
+
+    QByteArray string;
+    if(trackerUrl.hasQuery()) {
+        string = "GET " + trackerUrl.toEncoded(QUrl::RemoveScheme | QUrl::RemoveAuthority) + '&' + query + " HTTP/1.1\r\n";
+    } else {
+        string = "GET " + trackerUrl.toEncoded(QUrl::RemoveScheme | QUrl::RemoveAuthority) + '?' + query + " HTTP/1.1\r\n";
+    }
+
+#ifndef QT_NO_DEBUG
+    qDebug() << "Header: " << header;
+    qDebug() << "String: " << string;
+#endif // QT_NO_DEBUG
+
+    return string + header;
+}
+
 QByteArray BtQt::sendTrackerRequest(BtTrackerRequest const &req, QUrl trackerUrl)
 {
     if(trackerUrl.scheme() != "http") {
@@ -293,27 +402,7 @@ QByteArray BtQt::sendTrackerRequest(BtTrackerRequest const &req, QUrl trackerUrl
     }
     socket.setSocketOption(QAbstractSocket::KeepAliveOption, 1);
 
-    /* HTTP 1.1 header, for more information please go to RFC2616 */
-    QByteArray header;
-    header.append("HOST: " + host + ":" + QString::number(port) + "\r\n");
-    header.append("User-Agent: " + BtQt::application + " " + BtQt::version + "\r\n");
-    header.append("Accept: */*\r\n");
-    header.append("Connection: Keep-Alive\r\n");
-    header.append("\r\n");
-
-    QByteArray string;
-    if(trackerUrl.hasQuery()) {
-        string = "GET " + trackerUrl.toEncoded(QUrl::RemoveScheme | QUrl::RemoveAuthority) + '&' + req.toRequestData() + " HTTP/1.1\r\n";
-    } else {
-        string = "GET " + trackerUrl.toEncoded(QUrl::RemoveScheme | QUrl::RemoveAuthority) + '?' + req.toRequestData() + " HTTP/1.1\r\n";
-    }
-
-#ifndef QT_NO_DEBUG
-    qDebug() << "Header: " << header;
-    qDebug() << "String: " << string;
-#endif // QT_NO_DEBUG
-
-    socket.write(string + header);
+    socket.write(announceMessage(req.toRequestData(), trackerUrl, true));
 
     if(!socket.waitForReadyRead(1000)) {
         qDebug() << "There were some error occured or possibly time out! Can not get reply!";
@@ -330,132 +419,317 @@ QByteArray BtQt::sendTrackerRequest(BtTrackerRequest const &req, QUrl trackerUrl
     return trackerReply.mid(replyIdx);
 }
 
-QMap<QString, QVariant> BtQt::parseTrackerResponse(QByteArray const &response)
+/* Get the body of a HTTP reply, closed is true if the connection has been
+ * closed and no more data will come.
+ * Return 1 if the reply is complete, 0 if more data is needed, -1 if the
+ * reply is broken or not successful
+ * */
+static int httpReplyBody(QByteArray const &reply, bool closed, QByteArray &body)
 {
-    QMap<QString, QVariant> ret;
+    int headerEnd = reply.indexOf("\r\n\r\n");
+    if(headerEnd == -1) return closed ? -1 : 0;
 
-    /* This bencoded dictionary is weired.
-     * Shit, the peers will be decoded specially
-     * */
-    int peersIdx = response.indexOf("5:peers");
-    if(peersIdx != -1)
-        BtDecodeBencodeDictionary(response.mid(0, peersIdx).append('e'), ret);
-    else {
-        BtDecodeBencodeDictionary(response, ret);
-        return ret;
+    /* Status line, "HTTP/1.1 200 OK" */
+    int sp = reply.indexOf(' ');
+    if(sp == -1 || sp > headerEnd || reply.mid(sp + 1, 3).toInt() / 100 != 2) {
+        qDebug() << "Tracker replied with" << reply.left(reply.indexOf("\r\n"));
+        return -1;
     }
 
-    QByteArray peers;
-    peers.append(response.mid(peersIdx + 7, response.size() - peersIdx - 8));
-
-    QMap<QString, QVariant> peer;
-    QList<QVariant> peerList;
-    bool haveId = false;
-    if(peers.at(0) == '7') haveId = true;
-    for(auto i = 0; peers.at(i) != 'e'; ) {
-        if(haveId == true) {
-            if(peers.at(i) == '7') {
-                /* peer id */
-                i += 7 + 2;
-                /* id is string, 20 */
-                i += 3;
-                peer.insert("peer id", peers.mid(i, 20));
-                i += 20;
-            } else {
-                qDebug() << "There's shit in trackers response";
-                throw -1;
-            }
-        }
-        if(peers.at(i) == '2') {
-            /* ip */
-            i += 2 + 2;
-            int colonIdx = peers.indexOf(':', i);
-            int ipLen = peers.mid(i, colonIdx - i).toInt();
-            i = colonIdx + 1;
-            peer.insert("ip", peers.mid(i, ipLen));
-            i += ipLen;
-        } else {
-            qDebug() << "There's shit in trackers response";
-            throw -1;
-        }
+    QByteArray header = reply.left(headerEnd + 2).toLower();
+    int bodyIdx = headerEnd + 4;
+
+    int fieldIdx = header.indexOf("\r\ncontent-length:");
+    if(fieldIdx != -1) {
+        fieldIdx += 17;
+        int lineEnd = header.indexOf("\r\n", fieldIdx);
+        bool ok;
+        int length = header.mid(fieldIdx, lineEnd - fieldIdx).trimmed().toInt(&ok);
+        if(!ok || length < 0) return -1;
+        if(reply.size() - bodyIdx < length) return closed ? -1 : 0;
+        body = reply.mid(bodyIdx, length);
+        return 1;
+    }
 
-        if(peers.at(i) == '4') {
-            /* port */
-            i += 4 + 2;
-            int eIdx = peers.indexOf('e', i);
-            peer.insert("port", peers.mid(i + 1, eIdx - i - 1));
-            i = eIdx + 1;
-        } else {
-            qDebug() << "There's shit in trackers response";
-            throw -1;
+    if(header.contains("\r\ntransfer-encoding: chunked")) {
+        /* chunk: <size in hex>\r\n<data>\r\n, the last chunk is empty */
+        body.clear();
+        int pos = bodyIdx;
+        while(true) {
+            int lineEnd = reply.indexOf("\r\n", pos);
+            if(lineEnd == -1) return closed ? -1 : 0;
+            int sizeEnd = reply.indexOf(';', pos);
+            if(sizeEnd == -1 || sizeEnd > lineEnd) sizeEnd = lineEnd;
+            bool ok;
+            int size = reply.mid(pos, sizeEnd - pos).trimmed().toInt(&ok, 16);
+            if(!ok || size < 0) return -1;
+            if(size == 0) return 1;
+            if(reply.size() < lineEnd + 2 + size + 2) return closed ? -1 : 0;
+            body.append(reply.constData() + lineEnd + 2, size);
+            pos = lineEnd + 2 + size + 2;
         }
-        peerList.append(peer);
     }
 
-    ret.insert("peers", peerList);
+    /* Neither, the body ends when the connection is closed */
+    if(!closed) return 0;
+    body = reply.mid(bodyIdx);
+    return 1;
+}
 
-    return ret;
+BtHttpAnnounce::BtHttpAnnounce(QByteArray const &query,
+        QUrl const &trackerUrl, QObject *parent)
+    : QObject(parent), query(query), trackerUrl(trackerUrl),
+    family(QAbstractSocket::AnyIPProtocol), running(false)
+{
+    timer.setSingleShot(true);
+    connect(&timer, &QTimer::timeout, this, &BtHttpAnnounce::timeout);
+    connect(&socket, &QTcpSocket::connected, this, &BtHttpAnnounce::connected);
+    connect(&socket, &QTcpSocket::readyRead, this, &BtHttpAnnounce::readyRead);
+    connect(&socket, &QTcpSocket::disconnected, this, &BtHttpAnnounce::disconnected);
+    connect(&socket, static_cast<void (QAbstractSocket::*)(QAbstractSocket::SocketError)>(&QAbstractSocket::error),
+            this, &BtHttpAnnounce::socketError);
 }
 
-BtTrackerResponse::BtTrackerResponse(QMap<QString, QVariant> const &response)
-    : Interval(-1), Complete(-1), InComplete(-1), MinInterval(-1)
+BtHttpAnnounce::~BtHttpAnnounce()
 {
-    /* Check if failed */
-    if(response.contains("failure reason")) {
-        failureReason = response.value("failure reason").toString();
-    } else {
-        if(response.contains("warning message")) {
-            warningMessage = response.value("warning message").toString();
-        }
+    abort();
+}
 
-        if(response.contains("interval")) {
-            Interval = response.value("interval").toInt();
-        } else {
-            qDebug() << "Warning: There's no interval in tracker's response";
-            Interval = -1;
-        }
+void BtHttpAnnounce::start(int timeout)
+{
+    if(running) return;
+    running = true;
+    reply.clear();
 
-        if(response.contains("min interval")) {
-            MinInterval = response.value("min interval").toInt();
-        } else {
-            MinInterval = -1;
-        }
+    if(trackerUrl.scheme() != "http") {
+        /* Same as sendTrackerRequest, only http is supported.
+         * Fail from the event loop, never inside start() */
+        qDebug() << "Request to announce" << trackerUrl;
+        qDebug() << "Protocol not supported!";
+        timer.start(0);
+        return;
+    }
 
-        if(response.contains("tracker id")) {
-            TrackerId = response.value("tracker id").toByteArray();
-        }
+    socket.connectToHost(trackerUrl.host(), trackerUrl.port(80),
+            QIODevice::ReadWrite, family);
+    timer.start(timeout);
+}
 
-        if(response.contains("complete")) {
-            Complete = response.value("complete").toInt();
-        } else {
-            Complete = -1;
+void BtHttpAnnounce::setProtocol(QAbstractSocket::NetworkLayerProtocol family)
+{
+    this->family = family;
+}
+
+QAbstractSocket::NetworkLayerProtocol BtHttpAnnounce::protocol() const
+{
+    return family;
+}
+
+void BtHttpAnnounce::abort()
+{
+    running = false;
+    timer.stop();
+    socket.abort();
+}
+
+QUrl BtHttpAnnounce::url() const
+{
+    return trackerUrl;
+}
+
+bool BtHttpAnnounce::isRunning() const
+{
+    return running;
+}
+
+void BtHttpAnnounce::connected()
+{
+    socket.write(announceMessage(query, trackerUrl, false));
+}
+
+void BtHttpAnnounce::readyRead()
+{
+    reply.append(socket.readAll());
+    checkReply(false);
+}
+
+void BtHttpAnnounce::disconnected()
+{
+    reply.append(socket.readAll());
+    checkReply(true);
+}
+
+void BtHttpAnnounce::socketError(QAbstractSocket::SocketError e)
+{
+    if(e == QAbstractSocket::RemoteHostClosedError) {
+        /* Normal end of a "Connection: close" reply */
+        reply.append(socket.readAll());
+        checkReply(true);
+        return;
+    }
+#ifndef QT_NO_DEBUG
+    qDebug() << "Announce to" << trackerUrl << "failed:" << socket.errorString();
+#endif // QT_NO_DEBUG
+    fail();
+}
+
+void BtHttpAnnounce::timeout()
+{
+    fail();
+}
+
+void BtHttpAnnounce::checkReply(bool closed)
+{
+    if(!running) return;
+
+    QByteArray body;
+    int r = httpReplyBody(reply, closed, body);
+    if(r == 0) return;
+    if(r < 0) {
+        fail();
+        return;
+    }
+
+    running = false;
+    timer.stop();
+    socket.abort();
+    reply.clear();
+    emit finished(body);
+}
+
+void BtHttpAnnounce::fail()
+{
+    if(!running) return;
+    running = false;
+    timer.stop();
+    socket.abort();
+    reply.clear();
+    emit failed();
+}
+
+static inline void expect(bool ok, const char *what)
+{
+    if(!ok) {
+        qDebug() << "There's shit in trackers response:" << what;
+        throw -1;
+    }
+}
+
+static inline int clampToInt(qint64 v)
+{
+    return int(qBound<qint64>(-1, v, 0x7fffffff));
+}
+
+static void appendCompactPeers(const char *data, int size, int entrySize,
+        QVector<BtPeerEndpoint> &peers)
+{
+    expect(size % entrySize == 0, "compact peers of a wrong size");
+    peers.reserve(peers.size() + size / entrySize);
+    for(int i = 0; i < size; i += entrySize) {
+        if(entrySize == BtPeerEndpoint::CompactIPv4Size)
+            peers.append(BtPeerEndpoint::fromCompactIPv4(data + i));
+        else
+            peers.append(BtPeerEndpoint::fromCompactIPv6(data + i));
+    }
+}
+
+/* l d2:ip<ip>7:peer id<id>4:porti<port>e e ... e, keys in any order */
+static void appendDictionaryPeers(BtBencodeCursor &c, QVector<BtPeerEndpoint> &peers)
+{
+    ++ c.p;
+    while(true) {
+        expect(c.p < c.end, "truncated peer list");
+        if(*c.p == 'e') break;
+        expect(*c.p == 'd', "peer is not a dictionary");
+        ++ c.p;
+
+        const char *ip = 0;
+        int ipLen = 0;
+        qint64 port = -1;
+        while(true) {
+            expect(c.p < c.end, "truncated peer");
+            if(*c.p == 'e') break;
+            const char *key;
+            int keyLen = c.readString(key);
+            expect(c.p < c.end, "peer key without value");
+            if(bencodeKeyIs(key, keyLen, "ip")) ipLen = c.readString(ip);
+            else if(bencodeKeyIs(key, keyLen, "port")) port = c.readInteger();
+            else c.skipValue();
         }
+        ++ c.p;
 
-        if(response.contains("incomplete")) {
-            InComplete = response.value("incomplete").toInt();
+        /* DNS names are not resolved, almost no tracker sends them */
+        QHostAddress address;
+        if(ip && port > 0 && port <= 0xffff &&
+                address.setAddress(QString::fromLatin1(ip, ipLen))) {
+            peers.append(BtPeerEndpoint::fromAddress(address, quint16(port)));
         } else {
-            InComplete = -1;
+            qDebug() << "Ignore peer" << QByteArray(ip, ipLen) << port;
         }
+    }
+    ++ c.p;
+}
+
+BtTrackerResponse BtQt::parseTrackerResponse(QByteArray const &response)
+{
+    BtTrackerResponse r;
+    BtBencodeCursor c = { response.constData(), response.constData() + response.size() };
+
+    expect(c.p < c.end && *c.p == 'd', "response is not a dictionary");
+    ++ c.p;
+    while(true) {
+        expect(c.p < c.end, "truncated dictionary");
+        if(*c.p == 'e') break;
 
-        if(response.contains("peers")) {
-            if(response.value("peers").canConvert(QMetaType::QVariantList)) {
-                /* Dictionary model */
-                auto _Peers = response.value("peers").toList();
-                for(auto i : _Peers) {
-                    Peers.append(i.toMap());
-                }
+        const char *key;
+        int keyLen = c.readString(key);
+        expect(c.p < c.end, "key without value");
+
+        const char *str;
+        int len;
+        if(bencodeKeyIs(key, keyLen, "peers")) {
+            if(*c.p == 'l') {
+                appendDictionaryPeers(c, r.Peers);
             } else {
-                /* Binary model */
-                auto _Peers = response.value("peers").toByteArray();
-                QMap<QString, QVariant> _Peer;
-                for (auto i = 0; i < _Peers.size(); i += 6) {
-                    _Peer.insert("ip", _Peers.at(i) + '.' + _Peers.at(i + 1) + '.'                            + _Peers.at(i + 2) + '.' + _Peers.at(i + 3));
-                    _Peer.insert("port", _Peers.mid(i + 4, 2).toInt());
-                    Peers.append(_Peer);
-                }
+                len = c.readString(str);
+                appendCompactPeers(str, len, BtPeerEndpoint::CompactIPv4Size, r.Peers);
             }
+        } else if(bencodeKeyIs(key, keyLen, "peers6")) {
+            len = c.readString(str);
+            appendCompactPeers(str, len, BtPeerEndpoint::CompactIPv6Size, r.Peers);
+        } else if(bencodeKeyIs(key, keyLen, "interval")) {
+            r.Interval = clampToInt(c.readInteger());
+        } else if(bencodeKeyIs(key, keyLen, "min interval")) {
+            r.MinInterval = clampToInt(c.readInteger());
+        } else if(bencodeKeyIs(key, keyLen, "complete")) {
+            r.Complete = clampToInt(c.readInteger());
+        } else if(bencodeKeyIs(key, keyLen, "incomplete")) {
+            r.InComplete = clampToInt(c.readInteger());
+        } else if(bencodeKeyIs(key, keyLen, "tracker id")) {
+            len = c.readString(str);
+            r.TrackerId = QByteArray(str, len);
+        } else if(bencodeKeyIs(key, keyLen, "failure reason")) {
+            len = c.readString(str);
+            r.failureReason = QString::fromUtf8(str, len);
+        } else if(bencodeKeyIs(key, keyLen, "warning message")) {
+            len = c.readString(str);
+            r.warningMessage = QString::fromUtf8(str, len);
+        } else {
+            c.skipValue();
         }
     }
+
+    if(r.failureReason.isEmpty() && r.Interval == -1) {
+        qDebug() << "Warning: There's no interval in tracker's response";
+    }
+
+    return r;
+}
+
+BtTrackerResponse::BtTrackerResponse()
+    : Interval(-1), Complete(-1), InComplete(-1), MinInterval(-1)
+{
+
 }
 
 int BtTrackerResponse::interval() const
@@ -478,7 +752,7 @@ int BtTrackerResponse::incomplete() const
     return InComplete;
 }
 
-auto BtTrackerResponse::peers()->decltype(Peers) const
+QVector<BtPeerEndpoint> const &BtTrackerResponse::peers() const
 {
     return Peers;
 }
@@ -509,6 +783,11 @@ bool BtTrackerResponse::isEmpty() const
     return Interval == -1 && failureReason.isEmpty();
 }
 
+void BtTrackerResponse::mergePeers(BtTrackerResponse const &other)
+{
+    Peers += other.Peers;
+}
+
 #ifndef QT_NO_DEBUG
 void BtTrackerResponse::display() const
 {
@@ -520,13 +799,10 @@ void BtTrackerResponse::display() const
     qDebug() << "complete: " << Complete;
     qDebug() << "incomplete: " << InComplete;
 
-    qDebug() << "peers: " << Peers;
-    /*
-     *for (auto i : Peers) {
-     *    qDebug() << "ip: " << i.value("ip").toByteArray();
-     *    qDebug() << "port: " << i.value("port").toInt();
-     *}
-     */
+    qDebug() << "peers: " << Peers.size();
+    for (auto i : Peers) {
+        qDebug() << "ip: " << i.address() << "port: " << i.port;
+    }
 
     qDebug() << "min interval: " << MinInterval;
 }
@@ -0,0 +1,68 @@
+#include <BtTransferStats.h>
+
+using namespace BtQt;
+
+const int BtTransferStats::SmoothingTicks;
+
+BtTransferStats::BtTransferStats(BtTransferStats *parent)
+    : Parent(parent), ticks(0)
+{
+    for(int i = 0; i < CounterCount; ++ i) {
+        totals[i].store(0, std::memory_order_relaxed);
+        rates[i].store(0, std::memory_order_relaxed);
+        lastTotals[i] = 0;
+    }
+}
+
+void BtTransferStats::setParent(BtTransferStats *parent)
+{
+    Parent = parent;
+}
+
+void BtTransferStats::add(Counter counter, qint64 bytes)
+{
+    for(BtTransferStats *s = this; s; s = s->Parent)
+        s->totals[counter].fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void BtTransferStats::tick()
+{
+    if(ticks < SmoothingTicks) ++ ticks;
+    for(int i = 0; i < CounterCount; ++ i) {
+        qint64 now = totals[i].load(std::memory_order_relaxed);
+        qint64 sample = now - lastTotals[i];
+        lastTotals[i] = now;
+        qint64 rate = rates[i].load(std::memory_order_relaxed);
+        rates[i].store(rate + (sample - rate) / ticks, std::memory_order_relaxed);
+    }
+}
+
+void BtTransferStats::clearRates()
+{
+    ticks = 0;
+    for(int i = 0; i < CounterCount; ++ i) {
+        lastTotals[i] = totals[i].load(std::memory_order_relaxed);
+        rates[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+qint64 BtTransferStats::total(Counter counter) const
+{
+    return totals[counter].load(std::memory_order_relaxed);
+}
+
+qint64 BtTransferStats::rate(Counter counter) const
+{
+    return rates[counter].load(std::memory_order_relaxed);
+}
+
+qint64 BtTransferStats::protocolDownloaded() const
+{
+    /* Payload of a message is counted once it's whole, wire as it comes */
+    return qMax<qint64>(0, total(WireDownload) - total(PayloadDownload));
+}
+
+qint64 BtTransferStats::protocolUploaded() const
+{
+    return qMax<qint64>(0, total(WireUpload) - total(PayloadUpload));
+}
@@ -0,0 +1,383 @@
+/* Loopback benchmarks of the engine.
+ *
+ *   BtQtBench endgame [options]
+ *
+ * Seeds and leechers of one generated torrent run in this process and
+ * talk to each other over 127.0.0.1. One of the seeds uploads much slower
+ * than the others, the peer every download ends up waiting on without
+ * end-game. Each round runs the swarm with end-game on and off, and the
+ * completion times of every leecher are reported as percentiles.
+ *
+ *   BtQtBench reactor [options]
+ *
+ * Many torrents, each with a seed and a few leechers, are run on a
+ * BtReactor of 1, 2, 4 ... up to --threads workers. Every torrent's
+ * swarms are spread over the workers like BtCore does, and the time for
+ * all leechers to finish gives the throughput of each worker count.
+ * */
+
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QTimer>
+#include <QThread>
+#include <getopt.h>
+#include <BtQt.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+using namespace BtQt;
+
+struct Options {
+    int seeds = 3;
+    /* 0 is the default of the benchmark */
+    int leechers = 0;
+    int rounds = 3;
+    int sizeMiB = 0;
+    int pieceKiB = 256;
+    /* Bytes a second of each seed, the slow one and the others */
+    qint64 slowRate = 32 << 10;
+    qint64 fastRate = 1 << 20;
+    quint16 port = 47000;
+    int timeoutSeconds = 600;
+    int threads = qMax(1, QThread::idealThreadCount());
+    int torrents = 8;
+};
+
+static QTextStream out(stdout);
+
+/* Random data and a torrent of it, the data goes to directory/seed */
+static bool makeTorrent(QString const &directory, Options const &o, BtTorrent &torrent)
+{
+    QDir(directory).mkpath("seed");
+    QFile data(directory + "/seed/bench.bin");
+    if(!data.open(QIODevice::WriteOnly)) return false;
+
+    qint64 size = qint64(o.sizeMiB) << 20;
+    int pieceLength = o.pieceKiB << 10;
+    QByteArray hashes;
+    QByteArray piece(pieceLength, Qt::Uninitialized);
+    /* A word at a time, there may be gigabytes of it */
+    std::mt19937 generator{quint32(qrand())};
+    for(qint64 done = 0; done < size; done += pieceLength) {
+        int length = int(qMin<qint64>(pieceLength, size - done));
+        for(int i = 0; i + 4 <= length; i += 4) {
+            quint32 word = generator();
+            memcpy(piece.data() + i, &word, 4);
+        }
+        data.write(piece.constData(), length);
+        hashes.append(QCryptographicHash::hash(piece.left(length), QCryptographicHash::Sha1));
+    }
+    data.close();
+
+    QMap<QString, QVariant> info;
+    info["name"] = QByteArray("bench.bin");
+    info["piece length"] = QByteArray::number(pieceLength);
+    info["length"] = QByteArray::number(size);
+    info["pieces"] = hashes;
+    QMap<QString, QVariant> root;
+    root["announce"] = QByteArray("http://127.0.0.1:1/announce");
+    root["info"] = info;
+    QByteArray encoded;
+    try {
+        BtEncodeBencodeMap(root, encoded);
+    } catch (int e) {
+        return false;
+    }
+
+    QFile file(directory + "/bench.torrent");
+    if(!file.open(QIODevice::WriteOnly)) return false;
+    file.write(encoded);
+    file.close();
+    return torrent.decodeTorrentFile(file);
+}
+
+/* Completion time of every leecher in ms, -1 for those that did not */
+static QVector<qint64> runRound(BtTorrent const &torrent, Options const &o,
+        QString const &directory, bool endgame, quint16 &port)
+{
+    QList<BtSwarm *> swarms;
+    QVector<BtPeerEndpoint> endpoints;
+    QVector<qint64> times(o.leechers, -1);
+    int left = o.leechers;
+    QElapsedTimer clock;
+    QEventLoop loop;
+
+    for(int i = 0; i < o.seeds + o.leechers; ++ i) {
+        BtSwarm *s = new BtSwarm(torrent, generatePeerId(), port);
+        endpoints.append(BtPeerEndpoint::fromAddress(QHostAddress::LocalHost, port));
+        ++ port;
+        /* What is measured is the piece logic, not RC4 */
+        s->setEncryptionPolicy(BtEncryptionPolicy::disabled);
+        s->setEndgame(endgame);
+        if(i < o.seeds) {
+            s->setDirectory(directory + "/seed");
+            s->setRateLimits(i == 0 ? o.slowRate : o.fastRate, 0);
+        } else {
+            int n = i - o.seeds;
+            /* Empty every round, the port makes it a new one */
+            s->setDirectory(QString("%1/leecher-%2").arg(directory).arg(port));
+            QObject::connect(s, &BtSwarm::finished, [&, n]() {
+                        if(times.at(n) >= 0) return;
+                        times[n] = clock.elapsed();
+                        if(-- left == 0) loop.quit();
+                    });
+        }
+        swarms.append(s);
+    }
+
+    /* Seeds check their files first, that is not part of the time */
+    for(int i = 0; i < swarms.size(); ++ i) {
+        if(!swarms.at(i)->start()) {
+            out << "Can not open files of swarm " << i << endl;
+            left = 0;
+        }
+    }
+    clock.start();
+    for(int i = 0; i < swarms.size(); ++ i) {
+        QVector<BtPeerEndpoint> others = endpoints;
+        others.remove(i);
+        swarms.at(i)->addCandidates(others, BtPeerSource::tracker);
+    }
+    if(left > 0) {
+        QTimer::singleShot(o.timeoutSeconds * 1000, &loop, &QEventLoop::quit);
+        loop.exec();
+    }
+
+    qDeleteAll(swarms);
+    /* Closed connections go with deleteLater() */
+    QCoreApplication::sendPostedEvents(0, QEvent::DeferredDelete);
+    QCoreApplication::processEvents();
+    return times;
+}
+
+/* Nearest rank */
+static qint64 percentile(QVector<qint64> const &sorted, double p)
+{
+    if(sorted.isEmpty()) return -1;
+    int rank = int(std::ceil(p * sorted.size()));
+    return sorted.at(qBound(0, rank - 1, sorted.size() - 1));
+}
+
+static void report(QString const &name, QVector<qint64> const &times)
+{
+    QVector<qint64> done;
+    for(auto t : times) if(t >= 0) done.append(t);
+    std::sort(done.begin(), done.end());
+    out << name << ": " << done.size() << "/" << times.size() << " done"
+        << ", p50 " << percentile(done, 0.5) << " ms"
+        << ", p90 " << percentile(done, 0.9) << " ms"
+        << ", p99 " << percentile(done, 0.99) << " ms" << endl;
+}
+
+static int endgameBenchmark(Options o)
+{
+    if(o.leechers == 0) o.leechers = 8;
+    if(o.sizeMiB == 0) o.sizeMiB = 16;
+    QTemporaryDir directory;
+    BtTorrent torrent;
+    if(!directory.isValid() || !makeTorrent(directory.path(), o, torrent)) {
+        out << "Can not make the torrent" << endl;
+        return EXIT_FAILURE;
+    }
+    out << "end-game: " << o.seeds << " seeds (one at " << (o.slowRate >> 10)
+        << " KiB/s, the others at " << (o.fastRate >> 10) << " KiB/s), "
+        << o.leechers << " leechers, " << torrent.pieceCount() << " pieces of "
+        << o.pieceKiB << " KiB" << endl;
+
+    QVector<qint64> on, off;
+    quint16 port = o.port;
+    for(int r = 0; r < o.rounds; ++ r) {
+        /* Interleaved, so that whatever else the machine does hits both */
+        on += runRound(torrent, o, directory.path(), true, port);
+        off += runRound(torrent, o, directory.path(), false, port);
+        out << "round " << r + 1 << "/" << o.rounds << " done" << endl;
+    }
+    report("end-game on ", on);
+    report("end-game off", off);
+    return EXIT_SUCCESS;
+}
+
+/* Seconds for every leecher of every torrent to finish, -1 if they
+ * did not in time */
+static double runReactor(QList<BtTorrent *> const &torrents, Options const &o,
+        QString const &directory, int threads, quint16 &port)
+{
+    BtReactor reactor(threads);
+    QList<BtSwarm *> swarms;
+    QVector<int> workers;
+    QStringList written;
+    bool failed = false;
+    int left = torrents.size() * o.leechers;
+    QEventLoop loop;
+
+    for(int t = 0; t < torrents.size(); ++ t) {
+        QVector<BtPeerEndpoint> endpoints;
+        int first = swarms.size();
+        for(int i = 0; i <= o.leechers; ++ i) {
+            BtSwarm *s = new BtSwarm(*torrents.at(t), generatePeerId(), port);
+            endpoints.append(BtPeerEndpoint::fromAddress(QHostAddress::LocalHost, port));
+            QString path = i == 0 ? QString("%1/%2/seed").arg(directory).arg(t)
+                : QString("%1/leecher-%2").arg(directory).arg(port);
+            ++ port;
+            int worker = reactor.attach(s);
+            QTimer *ticker = reactor.ticker(worker);
+            bool opened = false;
+            /* Seeds check their files here, before the clock starts */
+            reactor.run(worker, [&]() {
+                        s->setTicker(ticker);
+                        s->setEncryptionPolicy(BtEncryptionPolicy::disabled);
+                        s->setDirectory(path);
+                        opened = s->start();
+                    });
+            if(!opened) {
+                out << "Can not open files of " << path << endl;
+                failed = true;
+            }
+            /* Queued to us, left is only touched here */
+            if(i > 0) {
+                written.append(path);
+                QObject::connect(s, &BtSwarm::finished, &loop, [&]() {
+                            if(-- left == 0) loop.quit();
+                        });
+            }
+            swarms.append(s);
+            workers.append(worker);
+        }
+        for(int i = 0; i <= o.leechers; ++ i) {
+            QVector<BtPeerEndpoint> others = endpoints;
+            others.remove(i);
+            BtSwarm *s = swarms.at(first + i);
+            reactor.post(workers.at(first + i), [s, others]() {
+                        s->addCandidates(others, BtPeerSource::tracker);
+                    });
+        }
+    }
+
+    QElapsedTimer clock;
+    clock.start();
+    if(!failed) {
+        QTimer::singleShot(o.timeoutSeconds * 1000, &loop, &QEventLoop::quit);
+        loop.exec();
+    }
+    double seconds = !failed && left == 0 ? clock.elapsed() / 1000.0 : -1;
+
+    for(int i = 0; i < swarms.size(); ++ i) {
+        BtSwarm *s = swarms.at(i);
+        reactor.run(workers.at(i), [s]() { delete s; });
+        reactor.detach(workers.at(i));
+    }
+    /* What the leechers wrote is not needed again */
+    for(auto const &path : written) QDir(path).removeRecursively();
+    return seconds;
+}
+
+static int reactorBenchmark(Options o)
+{
+    if(o.leechers == 0) o.leechers = 3;
+    if(o.sizeMiB == 0) o.sizeMiB = 32;
+    QTemporaryDir directory;
+    QList<BtTorrent *> torrents;
+    for(int t = 0; t < o.torrents; ++ t) {
+        BtTorrent *torrent = new BtTorrent;
+        torrents.append(torrent);
+        if(!directory.isValid()
+                || !makeTorrent(QString("%1/%2").arg(directory.path()).arg(t), o, *torrent)) {
+            out << "Can not make the torrents" << endl;
+            qDeleteAll(torrents);
+            return EXIT_FAILURE;
+        }
+    }
+    out << "reactor: " << o.torrents << " torrents of " << o.sizeMiB << " MiB, a seed and "
+        << o.leechers << " leechers each" << endl;
+
+    QVector<int> counts;
+    for(int n = 1; n < o.threads; n *= 2) counts.append(n);
+    counts.append(o.threads);
+    double bytes = double(o.torrents) * o.leechers * (qint64(o.sizeMiB) << 20);
+    quint16 port = o.port;
+    for(int n : counts) {
+        double seconds = runReactor(torrents, o, directory.path(), n, port);
+        out << n << " workers: ";
+        if(seconds < 0) out << "did not finish" << endl;
+        else out << qint64(seconds * 1000) << " ms, "
+            << qint64(bytes / seconds / (1 << 20)) << " MiB/s" << endl;
+    }
+    qDeleteAll(torrents);
+    return EXIT_SUCCESS;
+}
+
+static void usage()
+{
+    out << "Usage: BtQtBench endgame|reactor [options]\n"
+        "  -s, --seeds N       endgame: seeds, the first one is slow (3)\n"
+        "  -l, --leechers N    leechers (endgame 8, reactor 3 a torrent)\n"
+        "  -r, --rounds N      endgame: rounds of each mode (3)\n"
+        "  -m, --size MiB      size of a torrent (endgame 16, reactor 32)\n"
+        "  -p, --piece KiB     piece length (256)\n"
+        "  -w, --slow KiB/s    endgame: upload rate of the slow seed (32)\n"
+        "  -f, --fast KiB/s    endgame: upload rate of the other seeds (1024)\n"
+        "  -t, --threads N     reactor: most workers tried (cores)\n"
+        "  -n, --torrents N    reactor: torrents (8)\n"
+        "  -P, --port N        first listening port (47000)\n" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    /* Initialize for qrand */
+    qsrand(QDateTime::currentMSecsSinceEpoch());
+
+    static struct option long_options[] =
+    {
+        {"help",     no_argument,       0, 'h'},
+        {"seeds",    required_argument, 0, 's'},
+        {"leechers", required_argument, 0, 'l'},
+        {"rounds",   required_argument, 0, 'r'},
+        {"size",     required_argument, 0, 'm'},
+        {"piece",    required_argument, 0, 'p'},
+        {"slow",     required_argument, 0, 'w'},
+        {"fast",     required_argument, 0, 'f'},
+        {"threads",  required_argument, 0, 't'},
+        {"torrents", required_argument, 0, 'n'},
+        {"port",     required_argument, 0, 'P'},
+        {0, 0, 0, 0}
+    };
+
+    Options o;
+    int choice;
+    while((choice = getopt_long(argc, argv, "hs:l:r:m:p:w:f:t:n:P:", long_options, 0)) != -1) {
+        switch(choice) {
+            case 's': o.seeds = qMax(1, atoi(optarg)); break;
+            case 'l': o.leechers = qMax(1, atoi(optarg)); break;
+            case 'r': o.rounds = qMax(1, atoi(optarg)); break;
+            case 'm': o.sizeMiB = qMax(1, atoi(optarg)); break;
+            case 'p': o.pieceKiB = qMax(16, atoi(optarg)); break;
+            case 'w': o.slowRate = qint64(qMax(1, atoi(optarg))) << 10; break;
+            case 'f': o.fastRate = qint64(qMax(1, atoi(optarg))) << 10; break;
+            case 't': o.threads = qMax(1, atoi(optarg)); break;
+            case 'n': o.torrents = qMax(1, atoi(optarg)); break;
+            case 'P': o.port = quint16(atoi(optarg)); break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    QString mode = optind < argc ? QString(argv[optind]) : QString();
+    if(mode == "endgame") return endgameBenchmark(o);
+    if(mode == "reactor") return reactorBenchmark(o);
+    usage();
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,21 @@
+TEMPLATE = app
+
+# Loopback benchmarks of the engine, see test/bench.cpp
+#   qmake test/bench.pro && make && ./BtQtBench --help
+TARGET = BtQtBench
+CONFIG += console release
+CONFIG -= app_bundle
+QMAKE_CXXFLAGS += -std=c++11
+
+QT += network core
+QT -= gui
+
+SOURCES += bench.cpp \
+        $$files(../src/Bt*.cpp)
+
+HEADERS += $$files(../include/Bt*.h)
+
+# RtlGenRandom, keys of MSE
+win32: LIBS += -ladvapi32
+
+INCLUDEPATH += ../include/